@@ -0,0 +1,91 @@
+#pragma once
+
+#include "ray.h"
+#include "vec3.h"
+
+#include <math.h>
+#include <stdbool.h>
+
+/*
+** An axis aligned bounding box.
+** An empty box has its min components set to +inf and its max components
+** set to -inf, so that extending it with anything yields the other box.
+*/
+struct aabb
+{
+    struct vec3 min;
+    struct vec3 max;
+};
+
+static inline void aabb_init_empty(struct aabb *box)
+{
+    box->min = (struct vec3){INFINITY, INFINITY, INFINITY};
+    box->max = (struct vec3){-INFINITY, -INFINITY, -INFINITY};
+}
+
+static inline void aabb_extend_point(struct aabb *box, const struct vec3 *point)
+{
+    vec3_update_min_components(&box->min, point);
+    vec3_update_max_components(&box->max, point);
+}
+
+static inline void aabb_extend(struct aabb *box, const struct aabb *o)
+{
+    vec3_update_min_components(&box->min, &o->min);
+    vec3_update_max_components(&box->max, &o->max);
+}
+
+static inline struct vec3 aabb_center(const struct aabb *box)
+{
+    struct vec3 sum = vec3_add(&box->min, &box->max);
+    return vec3_mul(&sum, 0.5);
+}
+
+static inline double aabb_surface_area(const struct aabb *box)
+{
+    struct vec3 extent = vec3_sub(&box->max, &box->min);
+    if (extent.x < 0 || extent.y < 0 || extent.z < 0)
+        return 0;
+
+    return 2 * (extent.x * extent.y + extent.y * extent.z
+                + extent.z * extent.x);
+}
+
+static inline real vec3_get(const struct vec3 *v, int axis)
+{
+    return axis == 0 ? v->x : (axis == 1 ? v->y : v->z);
+}
+
+/*
+** Computes the distance at which the ray enters the box, using the slab
+** method. Returns INFINITY if the ray misses the box, or enters it further
+** than max_dist.
+*/
+static inline double aabb_ray_entry(const struct aabb *box,
+                                    const struct ray *ray, double max_dist)
+{
+    real tmin = -INFINITY;
+    real tmax = INFINITY;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        real inv_dir = vec3_get(&ray->inv_direction, axis);
+        real source = vec3_get(&ray->source, axis);
+        real tnear = (vec3_get(&box->min, axis) - source) * inv_dir;
+        real tfar = (vec3_get(&box->max, axis) - source) * inv_dir;
+        if (inv_dir < 0)
+        {
+            real tmp = tnear;
+            tnear = tfar;
+            tfar = tmp;
+        }
+
+        // NaNs, which come from rays lying in the plane of a slab, are ignored
+        tmin = tnear > tmin ? tnear : tmin;
+        tmax = tfar < tmax ? tfar : tmax;
+    }
+
+    if (tmax < 0 || tmin > tmax || tmin > max_dist)
+        return INFINITY;
+
+    return tmin;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "scene.h"
+
+#include <stddef.h>
+
+/*
+** A cache file, holding the meshes of an obj file along with the binary
+** tree built over their faces. Files are position independent, and are memory
+** mapped so that the tree can be used without being copied.
+*/
+struct accel_cache
+{
+    void *data;
+    size_t size;
+};
+
+/*
+** Looks for a cache file matching the content of the obj file, its material
+** libraries and the build options in cache_dir. If there's one, its
+** meshes are added to the scene, and its tree is used as the acceleration
+** structure. Returns NULL when there's no usable cache file.
+** The cache must be closed once the scene is destroyed.
+*/
+struct accel_cache *accel_cache_load(struct scene *scene,
+                                     const char *cache_dir,
+                                     const char *obj_path,
+                                     enum scene_accel accel,
+                                     const struct bvh_build_options *options);
+
+/*
+** Writes the meshes and tree of a scene loaded from an obj file to
+** cache_dir. Returns 0 on success.
+*/
+int accel_cache_store(struct scene *scene, const char *cache_dir,
+                      const char *obj_path,
+                      const struct bvh_build_options *options);
+
+void accel_cache_close(struct accel_cache *cache);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "scene.h"
+
+#include <stddef.h>
+
+/*
+** Builds each acceleration structure over the scene, and traces one camera
+** ray per pixel of a width x height image through it, as closest hit and
+** occlusion queries. The build time and ray throughput of each structure
+** are printed on stdout.
+*/
+void bench_accels(struct scene *scene, const struct bvh_build_options *options,
+                  size_t width, size_t height);
+
+/*
+** Traces one camera ray per pixel of a width x height image through the
+** binary tree, by square tiles of pixels, with and without packets. The ray
+** throughput of each packet size is printed on stdout.
+*/
+void bench_packets(struct scene *scene,
+                   const struct bvh_build_options *options, size_t width,
+                   size_t height);
+
+/*
+** Finds the closest of triangle_count random triangles hit by each of
+** ray_count random rays, using each triangle intersection kernel, either one
+** triangle at a time or by blocks of triangles. The throughput of each
+** kernel is printed on stdout.
+*/
+void bench_triangles(size_t triangle_count, size_t ray_count);
+
+/*
+** Moves the objects of the scene to their position at some frame.
+*/
+typedef void (*bench_animate_f)(struct scene *scene, size_t frame, void *data);
+
+/*
+** Animates the scene over frame_count frames, updating its acceleration
+** structure instead of rebuilding it, and traces camera rays at each frame.
+** The update time, tree quality and ray throughput of each frame are
+** printed on stdout, followed by the same figures for a full rebuild.
+*/
+void bench_refit(struct scene *scene, const struct bvh_build_options *options,
+                 enum scene_accel accel, size_t frame_count,
+                 bench_animate_f animate, void *data, size_t width,
+                 size_t height);
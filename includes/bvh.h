@@ -0,0 +1,176 @@
+#pragma once
+
+#include "aabb.h"
+#include "ray.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct thread_pool;
+
+// the maximum height of trees. builders make sure it's never exceeded, so
+// that traversal can use a fixed size stack
+#define BVH_MAX_DEPTH 64
+
+/*
+** A bounding volume hierarchy node.
+** Inner nodes have a prim_count of zero, and their two children are stored
+** next to each other, starting at index offset. Leaves reference prim_count
+** entries of the prim_indices array, starting at index offset.
+*/
+struct bvh_node
+{
+    struct aabb bounds;
+    uint32_t offset;
+    uint32_t prim_count;
+};
+
+/*
+** A binary bounding volume hierarchy, built using the surface area heuristic.
+** It doesn't know anything about the primitives it sorts, which are only
+** referred to using their index in the array the tree was built from.
+*/
+struct bvh
+{
+    struct bvh_node *nodes;
+    size_t node_count;
+
+    // leaves reference ranges of this array, which map to primitive indices.
+    // it holds ref_count entries, which is more than prim_count when
+    // primitives are referenced by multiple leaves
+    uint32_t *prim_indices;
+    size_t prim_count;
+    size_t ref_count;
+
+    // the cost of the tree according to the surface area heuristic, when it
+    // was built. refitting degrades the tree, which makes the cost grow
+    double build_cost;
+
+    // nodes and prim_indices belong to someone else, such as a memory
+    // mapped cache file, and aren't freed by bvh_destroy
+    bool borrowed;
+};
+
+enum bvh_builder
+{
+    // evaluates the surface area heuristic for every possible split of
+    // primitives sorted by centroid. slow but exact
+    BVH_BUILDER_SWEEP = 0,
+    // only evaluates splits at the boundaries of a fixed number of bins,
+    // and builds subtrees in parallel
+    BVH_BUILDER_BINNED,
+    // also considers splitting primitives at spatial planes, which helps
+    // with large primitives overlapping many others
+    BVH_BUILDER_SPATIAL,
+};
+
+struct bvh_build_options
+{
+    enum bvh_builder builder;
+    // the threads parallel builders and refits run on, the same the renderer
+    // uses. when NULL, they only run on the calling thread
+    struct thread_pool *pool;
+    // refitted trees are rebuilt from scratch once their cost grows past
+    // this factor of their build cost
+    double rebuild_threshold;
+    // the spatial split builder may create up to this many references per
+    // primitive on top of the first one
+    double spatial_split_budget;
+};
+
+/*
+** Splits a primitive at an axis aligned plane, and stores the bounds of the
+** parts on each side of the plane. Used by the spatial split builder.
+*/
+typedef void (*bvh_split_f)(void *data, size_t prim, int axis, double pos,
+                            struct aabb *left, struct aabb *right);
+
+/*
+** Builds a tree over prim_count primitives, given their bounding boxes.
+** The spatial split builder clips bounding boxes when splitting primitives.
+*/
+void bvh_build(struct bvh *bvh, const struct aabb *prim_bounds,
+               size_t prim_count, const struct bvh_build_options *options);
+
+/*
+** Builds a tree the same way, but lets the spatial split builder split
+** primitives using a callback, which may be NULL.
+*/
+void bvh_build_split(struct bvh *bvh, const struct aabb *prim_bounds,
+                     size_t prim_count,
+                     const struct bvh_build_options *options,
+                     bvh_split_f split, void *data);
+
+void bvh_destroy(struct bvh *bvh);
+
+/*
+** Updates the bounds of all nodes bottom-up, after primitives moved. The
+** tree structure is kept as is, so its quality degrades as primitives move
+** further from where they were when it was built.
+*/
+void bvh_refit(struct bvh *bvh, const struct aabb *prim_bounds,
+               struct thread_pool *pool);
+
+/*
+** Returns the cost of the tree according to the surface area heuristic,
+** relative to the area of its root.
+*/
+double bvh_sah_cost(const struct bvh *bvh);
+
+/*
+** Intersects the prim_count primitives of a leaf with a ray, given their
+** indices. Leaves are tested as a whole, so that the callback may test
+** primitives stored together at once.
+** Returns the distance to the closest intersection, or INFINITY. As leaves
+** are not visited in order, the callback is expected to keep track of the
+** closest intersection itself.
+*/
+typedef double (*bvh_intersect_f)(void *data, const uint32_t *prims,
+                                  size_t prim_count, const struct ray *ray);
+
+/*
+** Returns the distance to the closest primitive hit by the ray,
+** or INFINITY if there's none.
+*/
+double bvh_intersect(const struct bvh *bvh, const struct ray *ray,
+                     bvh_intersect_f intersect, void *data);
+
+/*
+** Returns the distance to the closest primitive under a node hit by the ray
+** closer than max_dist, or max_dist if there's none.
+*/
+double bvh_intersect_node(const struct bvh *bvh, size_t root,
+                          const struct ray *ray, double max_dist,
+                          bvh_intersect_f intersect, void *data);
+
+// the maximum number of rays traced together by bvh_intersect_packet
+#define BVH_PACKET_MAX_SIZE 64
+
+/*
+** Finds the closest primitive hit by each of ray_count rays, which must be
+** close to each other, such as camera rays of neighbouring pixels. The
+** packet visits each node once for all its rays, and is culled as a whole
+** using bounds of its sources and directions. Once few rays are left in a
+** subtree, they go on alone.
+** The callback is called with ray_data[i] for rays[i], and the distance to
+** the closest hit of each ray is stored in dists, or INFINITY.
+*/
+void bvh_intersect_packet(const struct bvh *bvh, const struct ray *rays,
+                          size_t ray_count, double *dists,
+                          bvh_intersect_f intersect, void *const *ray_data);
+
+/*
+** Tests whether any of the prim_count primitives of a leaf is hit by the ray
+** closer than max_dist, given their indices.
+*/
+typedef bool (*bvh_occluded_f)(void *data, const uint32_t *prims,
+                               size_t prim_count, const struct ray *ray,
+                               double max_dist);
+
+/*
+** Returns whether any primitive is hit by the ray closer than max_dist.
+** Traversal stops at the first hit found.
+*/
+bool bvh_occluded(const struct bvh *bvh, const struct ray *ray,
+                  double max_dist, bvh_occluded_f occluded, void *data);
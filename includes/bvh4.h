@@ -0,0 +1,9 @@
+#pragma once
+
+#define BVHW_NAME bvh4
+#define BVHW_WIDTH 4
+
+#include "bvh_wide.h"
+
+#undef BVHW_NAME
+#undef BVHW_WIDTH
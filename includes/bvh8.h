@@ -0,0 +1,9 @@
+#pragma once
+
+#define BVHW_NAME bvh8
+#define BVHW_WIDTH 8
+
+#include "bvh_wide.h"
+
+#undef BVHW_NAME
+#undef BVHW_WIDTH
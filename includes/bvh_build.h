@@ -0,0 +1,104 @@
+#pragma once
+
+#include "bvh.h"
+
+#include <stdbool.h>
+
+/*
+** Definitions shared by the bvh builders.
+*/
+
+// the relative costs of traversing a node and intersecting a primitive,
+// used by the surface area heuristic
+#define BVH_TRAVERSAL_COST 1.
+#define BVH_INTERSECT_COST 1.
+
+#define BVH_MAX_LEAF_SIZE 8
+
+// past this depth, nodes are split at the median, which bounds the height of
+// the tree to BVH_MAX_DEPTH even for pathological inputs
+#define BVH_MEDIAN_DEPTH (BVH_MAX_DEPTH / 2)
+
+/*
+** A primitive reference, as seen by the builder.
+*/
+struct bvh_build_ref
+{
+    struct aabb bounds;
+    struct vec3 center;
+    uint32_t prim;
+};
+
+void bvh_build_sort_refs(struct bvh_build_ref *refs, size_t count, int axis);
+
+/*
+** Computes the bounds of a range of references, and the bounds of their
+** centers.
+*/
+void bvh_build_refs_bounds(struct aabb *bounds, struct aabb *center_bounds,
+                           const struct bvh_build_ref *refs, size_t count);
+
+/*
+** Returns the axis along which the box is the largest.
+*/
+int bvh_build_largest_axis(const struct aabb *box);
+
+/*
+** Returns true if a node is better off as a leaf, given the cost of its best
+** split, as returned by the surface area heuristic.
+*/
+static inline bool bvh_build_make_leaf(size_t count, double split_cost)
+{
+    double leaf_cost = BVH_INTERSECT_COST * count;
+    return count <= BVH_MAX_LEAF_SIZE && leaf_cost <= split_cost;
+}
+
+/*
+** Computes the bounds of a node over the primitives of the range [begin,
+** end), and stores them wherever node_i tells, then splits the primitives in
+** two by reordering them. Returns the number of primitives moved to the left
+** side, or zero if the node should be a leaf. Called by several threads at
+** once, on ranges which don't overlap.
+*/
+typedef size_t (*bvh_build_split_node_f)(void *data, size_t node_i,
+                                         size_t begin, size_t end,
+                                         size_t depth);
+
+/*
+** A node of a tree built by bvh_build_parallel. Inner nodes have a count of
+** zero, and their two children are stored next to each other, starting at
+** index offset. Leaves hold count primitives, starting at index offset.
+** Bounds are left to the caller, who stored them for node index src.
+*/
+struct bvh_build_node
+{
+    uint32_t offset;
+    uint32_t count;
+    uint32_t src;
+};
+
+/*
+** Builds the structure of a tree over prim_count primitives, which split
+** orders as it splits nodes, and may be given node indices up to
+** 2 * prim_count - 1 excluded. The top levels of the tree are split by the
+** calling thread, until there are enough subtrees to keep the threads of the
+** pool busy, which then build them. The pool may be NULL.
+** Returns the nodes in depth first order, and stores their count in
+** node_count.
+*/
+struct bvh_build_node *bvh_build_parallel(size_t prim_count,
+                                          struct thread_pool *pool,
+                                          bvh_build_split_node_f split,
+                                          void *data, size_t *node_count);
+
+void bvh_build_sweep(struct bvh *bvh, struct bvh_build_ref *refs);
+
+void bvh_build_binned(struct bvh *bvh, struct bvh_build_ref *refs,
+                      struct thread_pool *pool);
+
+/*
+** Unlike other builders, allocates the nodes and primitive indices of the
+** tree itself, as their number isn't known beforehand.
+*/
+void bvh_build_spatial(struct bvh *bvh, struct bvh_build_ref *refs,
+                       double budget, bvh_split_f split, void *data);
@@ -0,0 +1,61 @@
+#include "bvh.h"
+#include "bvh_wide_common.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef BVHW_NAME
+#error undefined BVHW_NAME in wide bvh
+#endif
+
+#ifndef BVHW_WIDTH
+#error undefined BVHW_WIDTH in wide bvh
+#endif
+
+/*
+** A node of a wide bounding volume hierarchy.
+** The bounds of all the children are stored as arrays of single precision
+** components, so that they can be loaded in vector registers and tested
+** against a ray all at once.
+** Children with a prim_count of zero are inner nodes, and child is an index
+** in the node array. Other children are leaves, and child is an index in the
+** prim_indices array. Unused children have empty bounds.
+*/
+struct BVHW_FNAME(node)
+{
+    // bounds[0] holds the minimum of the boxes, bounds[1] the maximum
+    float bounds[2][3][BVHW_WIDTH];
+    uint32_t child[BVHW_WIDTH];
+    uint32_t prim_count[BVHW_WIDTH];
+};
+
+/*
+** A wide bounding volume hierarchy, built by collapsing a binary tree.
+** Leaves are the same as in the binary tree, and the primitive index array
+** is borrowed from it, so the binary tree must outlive this one.
+*/
+struct BVHW_NAME
+{
+    struct BVHW_FNAME(node) *nodes;
+    size_t node_count;
+    const uint32_t *prim_indices;
+};
+
+void BVHW_FNAME(build)(struct BVHW_NAME *tree, const struct bvh *bvh);
+
+void BVHW_FNAME(destroy)(struct BVHW_NAME *tree);
+
+/*
+** Returns the distance to the closest primitive hit by the ray,
+** or INFINITY if there's none.
+*/
+double BVHW_FNAME(intersect)(const struct BVHW_NAME *tree,
+                             const struct ray *ray, bvh_intersect_f intersect,
+                             void *data);
+
+/*
+** Returns whether any primitive is hit by the ray closer than max_dist.
+*/
+bool BVHW_FNAME(occluded)(const struct BVHW_NAME *tree, const struct ray *ray,
+                          double max_dist, bvh_occluded_f occluded,
+                          void *data);
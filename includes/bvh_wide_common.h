@@ -0,0 +1,104 @@
+#pragma once
+
+#include "ray.h"
+
+#include <float.h>
+#include <math.h>
+#include <stddef.h>
+
+#define BVHW_U_CONCAT_(A, B) A##_##B
+#define BVHW_U_CONCAT(A, B) BVHW_U_CONCAT_(A, B)
+#define BVHW_FNAME(Suffix) BVHW_U_CONCAT(BVHW_NAME, Suffix)
+
+/*
+** A single precision copy of a ray, as used by wide tree traversal.
+*/
+struct bvh_wide_ray
+{
+    float source[3];
+    float inv_direction[3];
+};
+
+static inline float bvh_wide_inv_component(double inv)
+{
+    // infinite inverses would yield NaNs when multiplied by zero
+    if (inv > FLT_MAX)
+        return FLT_MAX;
+    if (inv < -FLT_MAX)
+        return -FLT_MAX;
+    return inv;
+}
+
+static inline void bvh_wide_ray_init(struct bvh_wide_ray *wray,
+                                     const struct ray *ray)
+{
+    wray->source[0] = ray->source.x;
+    wray->source[1] = ray->source.y;
+    wray->source[2] = ray->source.z;
+    wray->inv_direction[0] = bvh_wide_inv_component(ray->inv_direction.x);
+    wray->inv_direction[1] = bvh_wide_inv_component(ray->inv_direction.y);
+    wray->inv_direction[2] = bvh_wide_inv_component(ray->inv_direction.z);
+}
+
+/*
+** Single precision boxes are slightly enlarged, so that rounding errors in
+** both the boxes and the rays never cause a primitive to be missed.
+*/
+#define BVH_WIDE_BOX_EPSILON 1e-5
+
+static inline float bvh_wide_round_down(double x, double extent)
+{
+    float res = x - (fabs(x) + extent) * BVH_WIDE_BOX_EPSILON;
+    return nextafterf(res, -INFINITY);
+}
+
+static inline float bvh_wide_round_up(double x, double extent)
+{
+    float res = x + (fabs(x) + extent) * BVH_WIDE_BOX_EPSILON;
+    return nextafterf(res, INFINITY);
+}
+
+/*
+** Converts a distance to single precision, rounding it up.
+*/
+static inline float bvh_wide_dist_up(double dist)
+{
+    float res = dist;
+    if (res < dist)
+        res = nextafterf(res, INFINITY);
+    return res;
+}
+
+/*
+** Intersects a ray with width boxes, stored as in wide nodes. Returns a mask
+** of the boxes hit closer than max_dist, and stores the entry distances in
+** dists. This is the portable version of the vectorized tests.
+*/
+static inline unsigned
+bvh_wide_intersect_boxes(const float *bounds, size_t width,
+                         const struct bvh_wide_ray *ray, float max_dist,
+                         float *dists)
+{
+    unsigned mask = 0;
+    for (size_t i = 0; i < width; i++)
+    {
+        float tmin = 0;
+        float tmax = max_dist;
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            size_t near = ray->inv_direction[axis] < 0;
+            float near_plane = bounds[(near * 3 + axis) * width + i];
+            float far_plane = bounds[((1 - near) * 3 + axis) * width + i];
+            float tnear = (near_plane - ray->source[axis])
+                          * ray->inv_direction[axis];
+            float tfar = (far_plane - ray->source[axis])
+                         * ray->inv_direction[axis];
+            tmin = tnear > tmin ? tnear : tmin;
+            tmax = tfar < tmax ? tfar : tmax;
+        }
+        dists[i] = tmin;
+        if (tmin <= tmax)
+            mask |= 1u << i;
+    }
+    return mask;
+}
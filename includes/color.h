@@ -12,16 +12,22 @@
 ** where 0 is no light, and +inf a lot more light. Unfortunately,
 ** regular images can't hold such a huge range, and each color channel
 ** is usualy limited to [0,255]. This function does the (lossy) translation
-** by mapping the float [0,1] range to [0,255]
+** by mapping the float [0,1] range to [0,255]. gamma_compress maps it to
+** [0,1] instead, without rounding.
 */
-static inline uint8_t gamma_encode(double light_comp)
+static inline double gamma_compress(double light_comp)
 {
     if (light_comp < 0.)
         light_comp = 0.;
     if (light_comp > 1.)
         light_comp = 1.;
 
-    return pow(light_comp, 1 / GAMMA_COEFF) * 255;
+    return pow(light_comp, 1 / GAMMA_COEFF);
+}
+
+static inline uint8_t gamma_encode(double light_comp)
+{
+    return gamma_compress(light_comp) * 255;
 }
 
 /*
@@ -35,7 +41,7 @@ static inline double gamma_decode(uint8_t component)
 /*
 ** Converts an rgb floating point light color to 24 bit rgb.
 */
-static inline struct rgb_pixel rgb_color_from_light(const struct vec3 *light)
+static inline struct rgb_pixel rgb_color_from_light(const struct dvec3 *light)
 {
     struct rgb_pixel res;
     res.r = gamma_encode(light->x);
@@ -47,9 +53,10 @@ static inline struct rgb_pixel rgb_color_from_light(const struct vec3 *light)
 /*
 ** Converts 24 bit rgb to floating point light color.
 */
-static inline struct vec3 light_from_rgb_color(uint8_t r, uint8_t g, uint8_t b)
+static inline struct dvec3 light_from_rgb_color(uint8_t r, uint8_t g,
+                                                uint8_t b)
 {
-    struct vec3 res;
+    struct dvec3 res;
     res.x = gamma_decode(r);
     res.y = gamma_decode(g);
     res.z = gamma_decode(b);
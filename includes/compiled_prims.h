@@ -0,0 +1,246 @@
+#pragma once
+
+#include "mesh.h"
+#include "object.h"
+#include "prim_map.h"
+#include "ray.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "triangle_block.h"
+#include "vec3.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** The kinds of primitives compiled_prims knows how to test.
+*/
+enum compiled_prim_type
+{
+    // any other object, tested through its function pointers
+    COMPILED_PRIM_OBJECT = 0,
+    COMPILED_PRIM_SPHERE,
+    COMPILED_PRIM_TRIANGLE,
+    // faces of large meshes, which are read from the vertex buffer of the
+    // mesh
+    COMPILED_PRIM_MESH_FACE,
+};
+
+// the faces of meshes are copied as triangles, with their edges
+// precomputed, as long as the faces copied from all meshes of the map add up
+// to this many. at 76 bytes per face in double precision, this is 4.75 MiB,
+// and meshes which don't fit are tested from their vertex buffer instead
+#define COMPILED_PRIMS_MESH_COPY_BUDGET (UINT32_C(1) << 16)
+
+// leaves with fewer triangles than this are tested one triangle at a time,
+// as the scalar test rejects back faces before computing anything else,
+// which doesn't pay off in blocks until a few lanes are used
+#define COMPILED_PRIMS_MIN_BLOCK_RUN 3
+
+// references to primitives hold their type in their upper bits
+#define COMPILED_PRIM_TYPE_SHIFT 30
+#define COMPILED_PRIM_INDEX_MASK ((UINT32_C(1) << COMPILED_PRIM_TYPE_SHIFT) - 1)
+
+struct compiled_sphere
+{
+    struct vec3 center;
+    real radius;
+};
+
+/*
+** A copy of the geometry of the primitives of a map, grouped by type in
+** contiguous arrays, so that intersection tests can call the kernel of each
+** type directly instead of going through the functions of objects, and
+** don't have to chase pointers to objects.
+** Triangles are stored in blocks, in the order they were laid out in, so
+** that leaves made of consecutive triangles are tested a block at a time.
+** Faces of meshes are copied as triangles until the copy budget is spent,
+** which only makes small scenes faster. The faces of other meshes aren't, as
+** their vertices are already shared in a compact buffer: they are tested
+** directly from it, the mesh and face being found through the map, at the
+** cost of computing their edges on every test.
+** Objects of other types are still tested through their functions, which
+** makes struct object the way to add new kinds of primitives. Hits are
+** always resolved by objects, as it only happens once per ray.
+*/
+struct compiled_prims
+{
+    // the type and index in the array of this type of each primitive. for
+    // mesh faces and other objects, the index is the primitive index
+    uint32_t *refs;
+    size_t prim_count;
+
+    struct compiled_sphere *spheres;
+    size_t sphere_count;
+    // triangle i is stored in lane i % TRIANGLE_BLOCK_WIDTH of block
+    // i / TRIANGLE_BLOCK_WIDTH
+    struct triangle_block *triangle_blocks;
+    size_t triangle_count;
+    // the AVX version of the block test when the processor supports it
+    triangle_block_intersect_f intersect_block;
+};
+
+/*
+** Compiles the primitives of a map. Primitives are laid out in the order
+** they first appear in order, which holds order_count primitive indices,
+** such as the order leaves of a tree reference them in, so that primitives
+** tested together are stored together. Primitives missing from order come
+** last. order may be NULL.
+*/
+void compiled_prims_build(struct compiled_prims *prims,
+                          const struct prim_map *map, const uint32_t *order,
+                          size_t order_count);
+
+/*
+** Copies the geometry of all primitives again, after objects moved. No
+** primitive may be added or removed since the primitives were compiled.
+*/
+void compiled_prims_update(struct compiled_prims *prims,
+                           const struct prim_map *map);
+
+void compiled_prims_destroy(struct compiled_prims *prims);
+
+/*
+** Returns the size of the copies of primitives and their references, in
+** bytes.
+*/
+size_t compiled_prims_memory(const struct compiled_prims *prims);
+
+/*
+** Tests a ray against a primitive, as the intersect function of its object
+** would.
+*/
+static inline double
+compiled_prims_intersect(const struct compiled_prims *prims,
+                         const struct prim_map *map, size_t prim,
+                         const struct ray *ray, struct object_hit *hit)
+{
+    uint32_t ref = prims->refs[prim];
+    uint32_t index = ref & COMPILED_PRIM_INDEX_MASK;
+    switch ((enum compiled_prim_type)(ref >> COMPILED_PRIM_TYPE_SHIFT))
+    {
+    case COMPILED_PRIM_SPHERE:
+    {
+        const struct compiled_sphere *sphere = &prims->spheres[index];
+        return sphere_intersect(&sphere->center, sphere->radius, ray);
+    }
+    case COMPILED_PRIM_TRIANGLE:
+    {
+        struct vec3 v0;
+        struct vec3 e0;
+        struct vec3 e1;
+        triangle_block_get(
+            &prims->triangle_blocks[index / TRIANGLE_BLOCK_WIDTH],
+            index % TRIANGLE_BLOCK_WIDTH, &v0, &e0, &e1);
+        return triangle_intersect(&v0, &e0, &e1, ray, INFINITY, &hit->u,
+                                  &hit->v);
+    }
+    case COMPILED_PRIM_MESH_FACE:
+    {
+        size_t face;
+        const struct mesh *mesh = (const struct mesh *)prim_map_get(map, prim,
+                                                                    &face);
+        struct vec3 edges[2];
+        const struct vec3 *v0 = mesh_face_edges(mesh, face, edges);
+        return triangle_intersect(v0, &edges[0], &edges[1], ray, INFINITY,
+                                  &hit->u, &hit->v);
+    }
+    case COMPILED_PRIM_OBJECT:
+        break;
+    }
+
+    size_t obj_prim;
+    struct object *obj = prim_map_get(map, prim, &obj_prim);
+    return obj->intersect(hit, obj, obj_prim, ray);
+}
+
+/*
+** Tests whether a ray hits a primitive closer than max_dist, as the occluded
+** function of its object would.
+*/
+static inline bool compiled_prims_occluded(const struct compiled_prims *prims,
+                                           const struct prim_map *map,
+                                           size_t prim, const struct ray *ray,
+                                           double max_dist)
+{
+    uint32_t ref = prims->refs[prim];
+    uint32_t index = ref & COMPILED_PRIM_INDEX_MASK;
+    switch ((enum compiled_prim_type)(ref >> COMPILED_PRIM_TYPE_SHIFT))
+    {
+    case COMPILED_PRIM_SPHERE:
+    {
+        const struct compiled_sphere *sphere = &prims->spheres[index];
+        return sphere_intersect(&sphere->center, sphere->radius, ray)
+               < max_dist;
+    }
+    case COMPILED_PRIM_TRIANGLE:
+    {
+        struct vec3 v0;
+        struct vec3 e0;
+        struct vec3 e1;
+        triangle_block_get(
+            &prims->triangle_blocks[index / TRIANGLE_BLOCK_WIDTH],
+            index % TRIANGLE_BLOCK_WIDTH, &v0, &e0, &e1);
+        double u;
+        double v;
+        return !isinf(
+            triangle_intersect(&v0, &e0, &e1, ray, max_dist, &u, &v));
+    }
+    case COMPILED_PRIM_MESH_FACE:
+    {
+        size_t face;
+        const struct mesh *mesh = (const struct mesh *)prim_map_get(map, prim,
+                                                                    &face);
+        struct vec3 edges[2];
+        const struct vec3 *v0 = mesh_face_edges(mesh, face, edges);
+        double u;
+        double v;
+        return !isinf(triangle_intersect(v0, &edges[0], &edges[1], ray,
+                                         max_dist, &u, &v));
+    }
+    case COMPILED_PRIM_OBJECT:
+        break;
+    }
+
+    size_t obj_prim;
+    struct object *obj = prim_map_get(map, prim, &obj_prim);
+    return obj->occluded(obj, obj_prim, ray, max_dist);
+}
+
+/*
+** Returns whether the primitives of a leaf are enough copied triangles,
+** stored one after the other, as leaves of the tree the primitives were laid
+** out for usually are. If so, the first one is stored in first, and they can
+** be tested together using compiled_prims_intersect_triangles.
+*/
+static inline bool compiled_prims_triangle_run(
+    const struct compiled_prims *prims, const uint32_t *leaf_prims,
+    size_t count, size_t *first)
+{
+    if (count < COMPILED_PRIMS_MIN_BLOCK_RUN)
+        return false;
+
+    uint32_t ref = prims->refs[leaf_prims[0]];
+    if (ref >> COMPILED_PRIM_TYPE_SHIFT != COMPILED_PRIM_TRIANGLE)
+        return false;
+
+    // the type is the same, and the index goes up by one
+    for (size_t i = 1; i < count; i++)
+        if (prims->refs[leaf_prims[i]] != ref + i)
+            return false;
+
+    *first = ref & COMPILED_PRIM_INDEX_MASK;
+    return true;
+}
+
+/*
+** Tests a ray against count triangles stored from first, a block at a time,
+** and stores the closest hit closer than max_dist in hit. Returns false if
+** there's none. Results are the same as testing each triangle with
+** compiled_prims_intersect, and ties are broken by primitive index.
+*/
+bool compiled_prims_intersect_triangles(const struct compiled_prims *prims,
+                                        size_t first, size_t count,
+                                        const struct ray *ray,
+                                        double max_dist,
+                                        struct triangle_block_hit *hit);
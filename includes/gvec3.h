@@ -0,0 +1,151 @@
+#include "utils/gvect_common.h"
+
+#ifndef GVEC3_NAME
+#error undefined GVEC3_NAME in generic 3d vector
+#endif
+
+#ifndef GVEC3_TYPE
+#error undefined GVEC3_TYPE in generic 3d vector
+#endif
+
+#ifndef GVEC3_SQRT
+#error undefined GVEC3_SQRT in generic 3d vector
+#endif
+
+#define GVEC3_FNAME(Suffix) GVECT_U_CONCAT(GVEC3_NAME, Suffix)
+
+/*
+** A 3d vector of GVEC3_TYPE components, and the operations on it, which
+** are all named after GVEC3_NAME.
+*/
+struct GVEC3_NAME
+{
+    GVEC3_TYPE x;
+    GVEC3_TYPE y;
+    GVEC3_TYPE z;
+};
+
+static inline struct GVEC3_NAME GVEC3_FNAME(add)(const struct GVEC3_NAME *a,
+                                                 const struct GVEC3_NAME *b)
+{
+    return (struct GVEC3_NAME){
+        .x = a->x + b->x,
+        .y = a->y + b->y,
+        .z = a->z + b->z,
+    };
+}
+
+static inline struct GVEC3_NAME GVEC3_FNAME(sub)(const struct GVEC3_NAME *a,
+                                                 const struct GVEC3_NAME *b)
+{
+    return (struct GVEC3_NAME){
+        .x = a->x - b->x,
+        .y = a->y - b->y,
+        .z = a->z - b->z,
+    };
+}
+
+static inline void GVEC3_FNAME(neg)(struct GVEC3_NAME *v)
+{
+    v->x = -v->x;
+    v->y = -v->y;
+    v->z = -v->z;
+}
+
+static inline struct GVEC3_NAME GVEC3_FNAME(mul)(const struct GVEC3_NAME *a,
+                                                 GVEC3_TYPE c)
+{
+    return (struct GVEC3_NAME){
+        .x = a->x * c,
+        .y = a->y * c,
+        .z = a->z * c,
+    };
+}
+
+static inline struct GVEC3_NAME
+GVEC3_FNAME(mul_vec)(const struct GVEC3_NAME *a, const struct GVEC3_NAME *b)
+{
+    return (struct GVEC3_NAME){
+        .x = a->x * b->x,
+        .y = a->y * b->y,
+        .z = a->z * b->z,
+    };
+}
+
+static inline struct GVEC3_NAME GVEC3_FNAME(div)(struct GVEC3_NAME *a, int d)
+{
+    return (struct GVEC3_NAME){
+        .x = a->x / d,
+        .y = a->y / d,
+        .z = a->z / d,
+    };
+}
+
+static inline GVEC3_TYPE GVEC3_FNAME(length)(const struct GVEC3_NAME *v)
+{
+    return GVEC3_SQRT(v->x * v->x + v->y * v->y + v->z * v->z);
+}
+
+static inline void GVEC3_FNAME(normalize)(struct GVEC3_NAME *v)
+{
+    GVEC3_TYPE len = GVEC3_FNAME(length)(v);
+    v->x /= len;
+    v->y /= len;
+    v->z /= len;
+}
+
+static inline GVEC3_TYPE GVEC3_FNAME(dot)(const struct GVEC3_NAME *a,
+                                          const struct GVEC3_NAME *b)
+{
+    return (a->x * b->x + a->y * b->y + a->z * b->z);
+}
+
+static inline struct GVEC3_NAME
+GVEC3_FNAME(cross)(const struct GVEC3_NAME *a, const struct GVEC3_NAME *b)
+{
+    return (struct GVEC3_NAME){a->y * b->z - b->y * a->z,
+                               a->z * b->x - b->z * a->x,
+                               a->x * b->y - b->x * a->y};
+}
+
+/*
+** Computes the reflection of a vector, given the normal of a surface
+*/
+static inline struct GVEC3_NAME
+GVEC3_FNAME(reflect)(const struct GVEC3_NAME *incident_dir,
+                     const struct GVEC3_NAME *normal)
+{
+    GVEC3_TYPE correction_coeff = -2 * GVEC3_FNAME(dot)(incident_dir, normal);
+    struct GVEC3_NAME corrector = GVEC3_FNAME(mul)(normal, correction_coeff);
+    return GVEC3_FNAME(add)(incident_dir, &corrector);
+}
+
+static inline void
+GVEC3_FNAME(update_min_components)(struct GVEC3_NAME *self,
+                                   const struct GVEC3_NAME *o)
+{
+    if (o->x < self->x)
+        self->x = o->x;
+
+    if (o->y < self->y)
+        self->y = o->y;
+
+    if (o->z < self->z)
+        self->z = o->z;
+}
+
+static inline void
+GVEC3_FNAME(update_max_components)(struct GVEC3_NAME *self,
+                                   const struct GVEC3_NAME *o)
+{
+    if (o->x > self->x)
+        self->x = o->x;
+
+    if (o->y > self->y)
+        self->y = o->y;
+
+    if (o->z > self->z)
+        self->z = o->z;
+}
+
+#undef GVEC3_FNAME
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "object.h"
+#include "vec3.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** A triangle mesh. Faces share a single vertex buffer, and each of them is a
+** primitive of the object, so that meshes of any size only cost a single
+** allocation of each buffer.
+** As with triangles, the facing side of a face is the one where its vertices
+** appear in counter clockwise order.
+*/
+struct mesh
+{
+    struct object base;
+
+    struct vec3 *vertices;
+    size_t vertex_count;
+
+    // three vertex indices per face
+    uint32_t *indices;
+    // the index in materials of the material of each face
+    uint32_t *face_materials;
+    size_t face_count;
+
+    // each material is referenced once by the mesh, however many faces use it
+    struct material **materials;
+    size_t material_count;
+};
+
+/*
+** Creates a mesh with uninitialized vertices, indices and face materials.
+** A reference to all materials is taken.
+*/
+struct mesh *mesh_create(size_t vertex_count, size_t face_count,
+                         struct material **materials, size_t material_count);
+
+/*
+** Returns the first vertex of a face, and stores the edges from it to the
+** two others.
+*/
+static inline const struct vec3 *mesh_face_edges(const struct mesh *mesh,
+                                                 size_t face,
+                                                 struct vec3 edges[2])
+{
+    const uint32_t *indices = &mesh->indices[3 * face];
+    const struct vec3 *v0 = &mesh->vertices[indices[0]];
+    edges[0] = vec3_sub(&mesh->vertices[indices[1]], v0);
+    edges[1] = vec3_sub(&mesh->vertices[indices[2]], v0);
+    return v0;
+}
+
+double object_mesh_ray_intersect(struct object_hit *hit,
+                                 const struct object *obj, size_t prim,
+                                 const struct ray *ray);
+
+void object_mesh_resolve(struct object_intersection *inter,
+                         const struct object *obj, size_t prim,
+                         const struct ray *ray, double dist,
+                         const struct object_hit *hit);
+
+bool object_mesh_occluded(const struct object *obj, size_t prim,
+                          const struct ray *ray, double max_dist);
+
+void object_mesh_bounds(struct aabb *bounds, const struct object *obj,
+                        size_t prim);
+
+void object_mesh_split(const struct object *obj, size_t prim, int axis,
+                       double pos, struct aabb *left, struct aabb *right);
+
+/*
+** Returns the size of the object and buffers of a mesh, in bytes.
+*/
+size_t mesh_memory(const struct mesh *mesh);
+
+void mesh_free(struct object *obj);
@@ -1,5 +1,13 @@
 #pragma once
 
+#include "object_group.h"
 #include "scene.h"
 
 int load_obj(struct scene *scene, const char *filename);
+
+/*
+** Loads an obj file in a new group, ready to be instanced.
+** Returns NULL on failure.
+*/
+struct object_group *load_obj_group(const char *filename,
+                                    const struct bvh_build_options *options);
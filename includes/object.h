@@ -1,9 +1,13 @@
 #pragma once
 
+#include "aabb.h"
 #include "ray.h"
 #include "utils/refcnt.h"
 #include "vec3.h"
 
+#include <stdbool.h>
+#include <stddef.h>
+
 /*
 ** The location and normal of an intersection.
 */
@@ -11,6 +15,10 @@ struct intersection
 {
     struct vec3 point;
     struct vec3 normal;
+    // the coordinates of the point on the surface of the object, such as
+    // barycentric coordinates on triangles
+    double u;
+    double v;
 };
 
 /* The scene type needs to be forward declared, as the scene
@@ -23,10 +31,10 @@ struct material;
 
 /* A pointer to a shading function.
  */
-typedef struct vec3 (*material_shader_f)(const struct material *material,
-                                         const struct intersection *inter,
-                                         const struct scene *scene,
-                                         const struct ray *ray);
+typedef struct dvec3 (*material_shader_f)(const struct material *material,
+                                          const struct intersection *inter,
+                                          const struct scene *scene,
+                                          const struct ray *ray);
 
 /* A generic material type.
 ** As how materials are shaded entirely depends on the shader type,
@@ -78,29 +86,98 @@ struct object_intersection
     struct material *material;
 };
 
+/*
+** What intersection tests find out about a hit, besides its distance: just
+** enough for the object to work out the rest later on. As most hits end up
+** behind closer ones, the point, normal and material are only computed for
+** the closest hit, by the resolve function of the object.
+*/
+struct object_hit
+{
+    // the coordinates of the hit on the surface of the primitive, such as
+    // barycentric coordinates on triangles
+    double u;
+    double v;
+    // for objects made of other objects, such as instances: the primitive
+    // hit inside of them, and the distance to it along their own ray
+    size_t inner_prim;
+    double inner_dist;
+};
+
 struct object;
 
 typedef void (*object_free_f)(struct object *obj);
 
-typedef double (*object_intersect_f)(struct object_intersection *inter,
-                                     const struct object *obj,
+/*
+** All the functions below work on a single primitive of the object, given
+** its index, from 0 to prim_count.
+*/
+typedef double (*object_intersect_f)(struct object_hit *hit,
+                                     const struct object *obj, size_t prim,
                                      const struct ray *ray);
 
+/*
+** Computes the location and material of a hit found by the intersection
+** function, given the same ray and the distance it returned.
+*/
+typedef void (*object_resolve_f)(struct object_intersection *inter,
+                                 const struct object *obj, size_t prim,
+                                 const struct ray *ray, double dist,
+                                 const struct object_hit *hit);
+
+/*
+** Tests whether the ray hits the primitive closer than max_dist, without
+** computing where.
+*/
+typedef bool (*object_occluded_f)(const struct object *obj, size_t prim,
+                                  const struct ray *ray, double max_dist);
+
+typedef void (*object_bounds_f)(struct aabb *bounds, const struct object *obj,
+                                size_t prim);
+
+/*
+** Computes the bounds of the parts of the primitive on each side of an axis
+** aligned plane, for acceleration structures which split primitives.
+*/
+typedef void (*object_split_f)(const struct object *obj, size_t prim,
+                               int axis, double pos, struct aabb *left,
+                               struct aabb *right);
+
 /*
 ** The common interface for objects.
-** Those only need an intersection function and a descructor.
+** Those only need an intersection function, which only finds the distance
+** to hits, a function computing the location of the closest one, a cheaper
+** occlusion test used for shadow rays, a bounding box function used to build
+** acceleration structures, and a descructor. The split function is
+** optional: objects without one are split by clipping their bounding box.
+** Objects are made of prim_count primitives, which acceleration structures
+** handle separately. Most objects have a single one, but meshes have one per
+** face, so that faces don't need to be objects of their own.
 ** If more function pointers are added, they should probably be moved to
 *constant memory.
 */
 struct object
 {
     object_intersect_f intersect;
+    object_resolve_f resolve;
+    object_occluded_f occluded;
+    object_bounds_f bounds;
+    object_split_f split;
     object_free_f free;
+    size_t prim_count;
 };
 
 static inline void object_init(struct object *obj, object_intersect_f intersect,
+                               object_resolve_f resolve,
+                               object_occluded_f occluded,
+                               object_bounds_f bounds, object_split_f split,
                                object_free_f free)
 {
     obj->intersect = intersect;
+    obj->resolve = resolve;
+    obj->occluded = occluded;
+    obj->bounds = bounds;
+    obj->split = split;
     obj->free = free;
+    obj->prim_count = 1;
 }
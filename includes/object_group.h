@@ -0,0 +1,115 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh4.h"
+#include "compiled_prims.h"
+#include "object.h"
+#include "object_vect.h"
+#include "prim_map.h"
+#include "transform.h"
+#include "utils/refcnt.h"
+
+/*
+** A set of objects with its own acceleration structure, which can be placed
+** in a scene any number of times using instances. Groups are reference
+** counted, and shared by all their instances.
+*/
+struct object_group
+{
+    // a reference counter. should be the first field!
+    struct refcnt refcnt;
+
+    struct object_vect objects;
+
+    // built by object_group_build, in the group's own coordinate system
+    struct prim_map prims;
+    struct compiled_prims compiled;
+    struct aabb bounds;
+    struct bvh bvh;
+    struct bvh4 bvh4;
+};
+
+struct object_group *object_group_create(void);
+
+/*
+** Builds the acceleration structure of the group. It must be called once all
+** objects are added, and before the group is instanced. Groups can't contain
+** instances.
+*/
+void object_group_build(struct object_group *group,
+                        const struct bvh_build_options *options);
+
+/*
+** Finds the closest object of the group intersecting the ray. Returns the
+** distance to the intersection, or INFINITY if there's none. The primitive
+** hit and the distance to it are stored in the inner fields of hit.
+*/
+double object_group_intersect(struct object_hit *hit,
+                              const struct object_group *group,
+                              const struct ray *ray);
+
+/*
+** Computes the location and material of a hit found by
+** object_group_intersect, given the same ray.
+*/
+void object_group_resolve(struct object_intersection *inter,
+                          const struct object_group *group,
+                          const struct ray *ray, const struct object_hit *hit);
+
+/*
+** Returns whether any object of the group is hit by the ray closer than
+** max_dist.
+*/
+bool object_group_occluded(const struct object_group *group,
+                           const struct ray *ray, double max_dist);
+
+// increases the group reference counter
+static inline struct object_group *object_group_get(struct object_group *group)
+{
+    ref_get(&group->refcnt);
+    return group;
+}
+
+// decreases the group reference counter
+static inline void object_group_put(struct object_group *group)
+{
+    ref_put(&group->refcnt);
+}
+
+/*
+** A transformed reference to a group of objects.
+** Rays are brought to the coordinate system of the group, so that its
+** acceleration structure can be used as is.
+*/
+struct instance
+{
+    struct object base;
+
+    // from the group's coordinate system to the scene's, and back
+    struct transform to_world;
+    struct transform to_object;
+    struct object_group *group;
+};
+
+double object_instance_ray_intersect(struct object_hit *hit,
+                                     const struct object *obj, size_t prim,
+                                     const struct ray *ray);
+
+void object_instance_resolve(struct object_intersection *inter,
+                             const struct object *obj, size_t prim,
+                             const struct ray *ray, double dist,
+                             const struct object_hit *hit);
+
+bool object_instance_occluded(const struct object *obj, size_t prim,
+                              const struct ray *ray, double max_dist);
+
+void object_instance_bounds(struct aabb *bounds, const struct object *obj,
+                            size_t prim);
+
+void instance_free(struct object *obj);
+
+/*
+** Creates an instance of a built group. The transform must be invertible.
+*/
+struct instance *instance_create(struct object_group *group,
+                                 const struct transform *transform);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "object.h"
+
+#include "utils/pvect.h"
+
+// this code creates a new type of vector using C's
+// poor man template metaprogramming™
+#define GVECT_NAME object_vect
+#define GVECT_TYPE struct object *
+#include "utils/pvect_wrap.h"
+#undef GVECT_NAME
+#undef GVECT_TYPE
+
@@ -10,7 +10,7 @@ struct phong_material
     // the base class structure
     struct material base;
 
-    struct vec3 surface_color;
+    struct dvec3 surface_color;
     // the diffuse light intensity coefficient
     double diffuse_Kn;
 
@@ -23,10 +23,10 @@ struct phong_material
     double ambient_intensity;
 };
 
-struct vec3 phong_metarial_shade(const struct material *material,
-                                 const struct intersection *inter,
-                                 const struct scene *scene,
-                                 const struct ray *ray);
+struct dvec3 phong_metarial_shade(const struct material *material,
+                                  const struct intersection *inter,
+                                  const struct scene *scene,
+                                  const struct ray *ray);
 
 static inline void phong_material_init(struct phong_material *mat)
 {
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "aabb.h"
+#include "object_vect.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Numbers the primitives of a vector of objects, so that acceleration
+** structures can be built over primitives instead of objects. The primitives
+** of each object get consecutive indices, in the order of objects.
+** The map must be built again whenever objects are added, or their
+** primitive count changes.
+*/
+struct prim_map
+{
+    struct object_vect *objects;
+    // the index of the object of each primitive
+    uint32_t *prim_objects;
+    // the index of the first primitive of each object
+    uint32_t *object_prims;
+    size_t prim_count;
+};
+
+void prim_map_build(struct prim_map *map, struct object_vect *objects);
+
+void prim_map_destroy(struct prim_map *map);
+
+/*
+** Returns the object a primitive belongs to, and stores the index of the
+** primitive in this object in obj_prim.
+*/
+static inline struct object *prim_map_get(const struct prim_map *map,
+                                          size_t prim, size_t *obj_prim)
+{
+    uint32_t obj_i = map->prim_objects[prim];
+    *obj_prim = prim - map->object_prims[obj_i];
+    return object_vect_get(map->objects, obj_i);
+}
+
+/*
+** Returns an array holding the bounding box of all primitives, and stores
+** the bounding box of the whole set in bounds.
+*/
+struct aabb *prim_map_bounds(const struct prim_map *map, struct aabb *bounds);
+
+/*
+** Splits a primitive, as a bvh_split_f over a map. Objects which can't split
+** their primitives get unbounded parts, so that their bounding box is
+** clipped.
+*/
+void prim_map_split(void *data, size_t prim, int axis, double pos,
+                    struct aabb *left, struct aabb *right);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh4.h"
+#include "utils/static_assert.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define QBVH_WIDTH 4
+
+/*
+** A node of a quantized 4 wide bounding volume hierarchy.
+** Child boxes are stored as 8 bit offsets on a grid spanning the bounds of
+** the node: the coordinate of a child plane along an axis is
+** origin + q * 2^exponent. Children are laid out as in wide trees, and
+** empty children have their min above their max.
+** Nodes are aligned to and exactly fill a 64 byte cache line, where nodes
+** with single precision boxes use two.
+*/
+struct __attribute__((aligned(64))) qbvh_node
+{
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t prim_count[QBVH_WIDTH];
+    // qbounds[0] holds the minimum of the boxes, qbounds[1] the maximum
+    uint8_t qbounds[2][3][QBVH_WIDTH];
+    uint32_t child[QBVH_WIDTH];
+};
+
+STATIC_ASSERT(qbvh_node_size, sizeof(struct qbvh_node) == 64);
+
+/*
+** A quantized bounding volume hierarchy, built from a 4 wide tree.
+** Leaves are the same as in the wide tree, and the primitive index array
+** is borrowed from the binary tree it was built from.
+*/
+struct qbvh
+{
+    struct qbvh_node *nodes;
+    size_t node_count;
+    const uint32_t *prim_indices;
+};
+
+void qbvh_build(struct qbvh *tree, const struct bvh4 *bvh4);
+
+void qbvh_destroy(struct qbvh *tree);
+
+/*
+** Returns the distance to the closest primitive hit by the ray,
+** or INFINITY if there's none.
+*/
+double qbvh_intersect(const struct qbvh *tree, const struct ray *ray,
+                      bvh_intersect_f intersect, void *data);
+
+/*
+** Returns whether any primitive is hit by the ray closer than max_dist.
+*/
+bool qbvh_occluded(const struct qbvh *tree, const struct ray *ray,
+                   double max_dist, bvh_occluded_f occluded, void *data);
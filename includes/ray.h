@@ -6,4 +6,16 @@ struct ray
 {
     struct vec3 source;
     struct vec3 direction;
+
+    // the componentwise inverse of direction, used to intersect bounding
+    // boxes. it must be updated using ray_update_inv_direction whenever
+    // direction changes
+    struct vec3 inv_direction;
 };
+
+static inline void ray_update_inv_direction(struct ray *ray)
+{
+    ray->inv_direction.x = 1 / ray->direction.x;
+    ray->inv_direction.y = 1 / ray->direction.y;
+    ray->inv_direction.z = 1 / ray->direction.z;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the quincunx pattern has the pixel center and its four corners
+#define SAMPLER_QUINCUNX_COUNT 5
+
+// blue noise masks are tiled over the image, this many pixels wide and high
+#define SAMPLER_BLUE_NOISE_SIZE 64
+
+enum sampler_type
+{
+    // the same five points in all pixels, see sampler_quincunx
+    SAMPLER_QUINCUNX,
+    // the Halton sequence in bases 2 and 3, shifted by a random offset per
+    // pixel
+    SAMPLER_HALTON,
+    // the Sobol sequence, Owen scrambled with a random seed per pixel
+    SAMPLER_SOBOL,
+    // the same Owen scrambled Sobol points in all pixels, shifted by blue
+    // noise masks, so that the error left between neighbouring pixels is
+    // high frequency noise, which the eye averages out
+    SAMPLER_BLUE_NOISE,
+};
+
+/*
+** Provides the positions of the samples of pixels, as a function of the
+** pixel coordinates and sample index only, so that images don't depend on
+** the order pixels are rendered in.
+*/
+struct sampler
+{
+    enum sampler_type type;
+    uint32_t seed;
+    // for SAMPLER_BLUE_NOISE, one mask per dimension, with values in [0, 1)
+    float *blue_noise[2];
+};
+
+/*
+** The offsets of the quincunx pattern, from the pixel center.
+*/
+extern const double sampler_quincunx[SAMPLER_QUINCUNX_COUNT][2];
+
+/*
+** Initializes a sampler. seed selects a different randomization of the
+** same sequence. Blue noise masks are generated right away, which takes a
+** few tens of milliseconds.
+*/
+void sampler_init(struct sampler *sampler, enum sampler_type type,
+                  uint32_t seed);
+
+/*
+** Returns the offset of the sample of pixel (x, y) of the given index,
+** from the pixel center, within half a pixel on both axis. The quincunx
+** sampler only has SAMPLER_QUINCUNX_COUNT samples.
+*/
+void sampler_offset(const struct sampler *sampler, size_t x, size_t y,
+                    size_t index, double *dx, double *dy);
+
+void sampler_destroy(struct sampler *sampler);
@@ -1,17 +1,35 @@
 #pragma once
 
+#include "bvh.h"
+#include "bvh4.h"
+#include "bvh8.h"
 #include "camera.h"
+#include "compiled_prims.h"
 #include "object.h"
+#include "object_group.h"
+#include "object_vect.h"
+#include "prim_map.h"
+#include "qbvh.h"
+#include "transform.h"
 
-#include "utils/pvect.h"
-
-// this code creates a new type of vector using C's
-// poor man template metaprogramming™
-#define GVECT_NAME object_vect
-#define GVECT_TYPE struct object *
-#include "utils/pvect_wrap.h"
-#undef GVECT_NAME
-#undef GVECT_TYPE
+/* The acceleration structure used to find which objects a ray intersects.
+*/
+enum scene_accel
+{
+    // test all the primitives of the scene, one after the other
+    SCENE_ACCEL_LINEAR = 0,
+    // a bounding volume hierarchy over the primitives of the scene
+    SCENE_ACCEL_BVH,
+    // the same hierarchy, collapsed into nodes with 4 children tested
+    // using SSE
+    SCENE_ACCEL_BVH4,
+    // the same hierarchy, collapsed into nodes with 8 children tested
+    // using AVX
+    SCENE_ACCEL_BVH8,
+    // the 4 wide hierarchy, with child boxes quantized to 8 bits so that
+    // nodes fit in a cache line
+    SCENE_ACCEL_QBVH,
+};
 
 /* The scene contains all the objects, lights, and cameras.
 ** for simplicity scene, this scene type only handles a single light and
@@ -22,9 +40,19 @@ struct scene
     // the list of objects in the scene
     struct object_vect objects;
 
+    // the acceleration structure over the primitives of objects, built by
+    // scene_build_accel, along with a copy of the primitives it tests
+    struct prim_map prims;
+    struct compiled_prims compiled;
+    enum scene_accel accel;
+    struct bvh bvh;
+    struct bvh4 bvh4;
+    struct bvh8 bvh8;
+    struct qbvh qbvh;
+
     // a very hacky single light
     // TODO: handle multiple lights
-    struct vec3 light_color;
+    struct dvec3 light_color;
     struct vec3 light_direction;
     double light_intensity;
 
@@ -34,6 +62,97 @@ struct scene
 static inline void scene_init(struct scene *scene)
 {
     object_vect_init(&scene->objects, 42);
+    scene->prims = (struct prim_map){0};
+    scene->compiled = (struct compiled_prims){0};
+    scene->accel = SCENE_ACCEL_LINEAR;
+    scene->bvh = (struct bvh){0};
+    scene->bvh4 = (struct bvh4){0};
+    scene->bvh8 = (struct bvh8){0};
+    scene->qbvh = (struct qbvh){0};
 }
 
+/* Builds the acceleration structure of the scene. It must be called again
+** whenever objects are added.
+*/
+void scene_build_accel(struct scene *scene, enum scene_accel accel,
+                       const struct bvh_build_options *options);
+
+/* Uses a tree built beforehand over the primitives of the scene, such as one
+** loaded from a cache file, instead of building one.
+*/
+void scene_adopt_accel(struct scene *scene, enum scene_accel accel,
+                       const struct bvh *bvh);
+
+/* Updates the acceleration structure after objects moved. No primitive may
+** be added or removed since it was built. The tree is refitted to the new
+** bounds of primitives, unless this degrades it past
+** options->rebuild_threshold, in which case it is rebuilt. Returns true if
+** the tree was rebuilt.
+*/
+bool scene_update_accel(struct scene *scene,
+                        const struct bvh_build_options *options);
+
+/* Returns the size of the nodes of the acceleration structure, in bytes.
+*/
+size_t scene_accel_node_memory(const struct scene *scene);
+
+/* The closest hit of a ray found by scene_intersect_hit: the primitive hit,
+** and what its object needs to locate the hit.
+*/
+struct scene_hit
+{
+    size_t prim;
+    struct object_hit hit;
+};
+
+/* Finds the closest primitive intersecting the ray, without computing the
+** location of the hit. Returns the distance to the intersection, or INFINITY
+** if there's none.
+*/
+double scene_intersect_hit(struct scene_hit *closest_hit, struct scene *scene,
+                           const struct ray *ray);
+
+/* Computes the location and material of a hit found by scene_intersect_hit,
+** given the same ray and the distance it returned.
+*/
+void scene_resolve_hit(struct object_intersection *intersection,
+                       const struct scene *scene, const struct ray *ray,
+                       double dist, const struct scene_hit *hit);
+
+/* Finds the closest object intersecting the ray. Returns the distance to
+** the intersection, or INFINITY if there's none. The intersection is only
+** stored if there's one.
+*/
+double scene_intersect_ray(struct object_intersection *closest_intersection,
+                           struct scene *scene, const struct ray *ray);
+
+/* Finds the closest primitive intersecting each of ray_count rays, which
+** should be coherent, such as camera rays of neighbouring pixels, without
+** computing the location of hits. The binary tree traces them as a packet,
+** other structures one by one. Stores the distance to each intersection in
+** dists, or INFINITY if there's none.
+*/
+void scene_intersect_packet_hits(struct scene_hit *hits, double *dists,
+                                 struct scene *scene, const struct ray *rays,
+                                 size_t ray_count);
+
+/* Finds the closest object intersecting each of ray_count rays, as
+** scene_intersect_packet_hits, and computes the location of hits.
+*/
+void scene_intersect_packet(struct object_intersection *intersections,
+                            double *dists, struct scene *scene,
+                            const struct ray *rays, size_t ray_count);
+
+/* Returns whether any object is hit by the ray closer than max_dist. This is
+** cheaper than scene_intersect_ray, as it stops at the first hit found.
+*/
+bool scene_occluded(const struct scene *scene, const struct ray *ray,
+                    double max_dist);
+
+/* Places an instance of a group of objects in the scene. The group's geometry
+** is shared by all its instances, and isn't copied.
+*/
+void scene_add_instance(struct scene *scene, struct object_group *group,
+                        const struct transform *transform);
+
 void scene_destroy(struct scene *scene);
@@ -6,26 +6,67 @@
 
 #include <stddef.h>
 
+/*
+** Returns the distance to the intersection of a ray and the sphere of center
+** center and radius radius, or INFINITY. Rays starting inside the sphere hit
+** it from the inside.
+*/
+static inline double sphere_intersect(const struct vec3 *center, real radius,
+                                      const struct ray *ray)
+{
+    struct vec3 hypothenuse = vec3_sub(center, &ray->source);
+    real hyp_len = vec3_length(&hypothenuse);
+    real projection = vec3_dot(&hypothenuse, &ray->direction);
+    if (projection < 0)
+        return INFINITY;
+
+    real d = REAL_SQRT(hyp_len * hyp_len - projection * projection);
+    if (d > radius)
+        return INFINITY;
+
+    real m = REAL_SQRT(radius * radius - d * d);
+    real t0 = projection - m;
+    real t1 = projection + m;
+
+    real t = t0;
+    if (t < 0.)
+        t = t1;
+    return t;
+}
+
 struct sphere
 {
     struct object base;
 
     struct vec3 center;
-    double radius;
+    real radius;
     struct material *material;
 };
 
-double object_sphere_ray_intersect(struct object_intersection *inter,
-                                   const struct object *obj,
+double object_sphere_ray_intersect(struct object_hit *hit,
+                                   const struct object *obj, size_t prim,
                                    const struct ray *ray);
 
+void object_sphere_resolve(struct object_intersection *inter,
+                           const struct object *obj, size_t prim,
+                           const struct ray *ray, double dist,
+                           const struct object_hit *hit);
+
+bool object_sphere_occluded(const struct object *obj, size_t prim,
+                            const struct ray *ray, double max_dist);
+
+void object_sphere_bounds(struct aabb *bounds, const struct object *obj,
+                          size_t prim);
+
 void sphere_free(struct object *obj);
 
 static inline struct sphere *sphere_create(struct vec3 center, double radius,
                                            struct material *mat)
 {
     struct sphere *sphere = zalloc(sizeof(*sphere));
-    object_init(&sphere->base, object_sphere_ray_intersect, sphere_free);
+    object_init(&sphere->base, object_sphere_ray_intersect,
+                object_sphere_resolve, object_sphere_occluded,
+                object_sphere_bounds, NULL, sphere_free);
     sphere->center = center;
     sphere->radius = radius;
     sphere->material = material_get(mat);
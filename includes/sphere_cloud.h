@@ -0,0 +1,100 @@
+#pragma once
+
+#include "bvh.h"
+#include "object.h"
+#include "vec3.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// spheres are tested by groups of this many
+#define SPHERE_CLOUD_LANES 4
+
+/*
+** A node of the tree of a sphere cloud: a binary tree node with single
+** precision bounds, rounded outwards. Inner nodes have a count of zero, and
+** their children are stored next to each other, starting at index offset.
+** Leaves hold count spheres, starting at index offset.
+*/
+struct sphere_cloud_node
+{
+    float min[3];
+    float max[3];
+    uint32_t offset;
+    uint32_t count;
+};
+
+/*
+** A large set of spheres sharing a single material, such as particles.
+** The whole cloud is a single primitive of the scene, which has its own
+** tree. Spheres are stored as single precision arrays of components, in the
+** order leaves of the tree reference them, so that a leaf is tested at
+** once using vector instructions, and only costs 16 bytes per sphere.
+*/
+struct sphere_cloud
+{
+    struct object base;
+
+    // the spheres, followed by SPHERE_CLOUD_LANES - 1 empty spheres, so
+    // that groups of spheres can be loaded past the last one
+    float *x;
+    float *y;
+    float *z;
+    float *radius;
+    size_t sphere_count;
+    size_t capacity;
+
+    // built by sphere_cloud_build
+    struct sphere_cloud_node *nodes;
+    size_t node_count;
+    struct aabb bounds;
+
+    struct material *material;
+};
+
+/*
+** Creates an empty cloud. A reference to the material is taken.
+*/
+struct sphere_cloud *sphere_cloud_create(struct material *mat);
+
+/*
+** Makes room for capacity spheres, so that adding them doesn't grow arrays
+** over and over.
+*/
+void sphere_cloud_reserve(struct sphere_cloud *cloud, size_t capacity);
+
+/*
+** Adds a sphere to the cloud, which must be built again afterwards.
+*/
+void sphere_cloud_push(struct sphere_cloud *cloud, float x, float y, float z,
+                       float radius);
+
+/*
+** Builds the tree of the cloud using binned surface area heuristic, directly
+** over the single precision spheres, which get reordered in place. Only the
+** thread pool of options is used, whatever the builder.
+*/
+void sphere_cloud_build(struct sphere_cloud *cloud,
+                        const struct bvh_build_options *options);
+
+/*
+** Returns the size of the spheres and nodes of the cloud, in bytes.
+*/
+size_t sphere_cloud_memory(const struct sphere_cloud *cloud);
+
+double object_sphere_cloud_ray_intersect(struct object_hit *hit,
+                                         const struct object *obj,
+                                         size_t prim, const struct ray *ray);
+
+void object_sphere_cloud_resolve(struct object_intersection *inter,
+                                 const struct object *obj, size_t prim,
+                                 const struct ray *ray, double dist,
+                                 const struct object_hit *hit);
+
+bool object_sphere_cloud_occluded(const struct object *obj, size_t prim,
+                                  const struct ray *ray, double max_dist);
+
+void object_sphere_cloud_bounds(struct aabb *bounds, const struct object *obj,
+                                size_t prim);
+
+void sphere_cloud_free(struct object *obj);
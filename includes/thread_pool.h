@@ -0,0 +1,60 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+** A task run by every thread of a pool, thread_i going from zero, the
+** calling thread, to the size of the pool excluded.
+*/
+typedef void (*thread_pool_task_f)(void *data, size_t thread_i);
+
+/*
+** Threads which are created once, and wait for tasks between runs, so that
+** repeated renders don't pay for creating threads. The thread which creates
+** the pool is its thread zero.
+*/
+struct thread_pool
+{
+    size_t thread_count;
+    pthread_t *threads;
+    struct thread_pool_worker *workers;
+
+    // the processor each thread is pinned to, or -1 if it isn't pinned,
+    // and the NUMA node of that processor
+    int *cpus;
+    int *nodes;
+
+    // the current task, and how many threads haven't completed it yet
+    pthread_mutex_t lock;
+    pthread_cond_t task_cond;
+    pthread_cond_t done_cond;
+    thread_pool_task_f task;
+    void *data;
+    size_t generation;
+    size_t running;
+    bool stopping;
+};
+
+/*
+** Creates a pool of thread_count threads, including the calling thread.
+** When pin is true, threads are pinned to the processors the process may
+** run on, in order.
+*/
+struct thread_pool *thread_pool_create(size_t thread_count, bool pin);
+
+/*
+** Runs a task on all threads of the pool, and waits until they're done.
+*/
+void thread_pool_run(struct thread_pool *pool, thread_pool_task_f task,
+                     void *data);
+
+/*
+** Returns the NUMA node thread_i runs on: that of its processor when it's
+** pinned, and that of the processor it currently runs on otherwise, as the
+** scheduler may move it. Must be called by thread_i itself.
+*/
+int thread_pool_node(const struct thread_pool *pool, size_t thread_i);
+
+void thread_pool_destroy(struct thread_pool *pool);
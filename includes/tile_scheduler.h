@@ -0,0 +1,77 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <stddef.h>
+
+// images are cut into tiles this many pixels wide and high by default
+#define TILE_SCHEDULER_DEFAULT_SIZE 32
+
+/*
+** Renders the pixels of a tile, which is at most the tile size wide and
+** high, as it's cut at the right and bottom edges of the image.
+*/
+typedef void (*tile_render_f)(void *data, size_t min_x, size_t min_y,
+                              size_t width, size_t height);
+
+/*
+** What each thread did during a run of the scheduler.
+*/
+struct tile_thread_stats
+{
+    size_t tile_count;
+    // how many of these tiles were taken from other threads
+    size_t stolen_count;
+    size_t pixel_count;
+    // the time spent rendering tiles, in seconds
+    double busy_time;
+    // the NUMA node the thread ran on when the run started
+    int node;
+};
+
+/*
+** The sum of the stats of the threads of a NUMA node.
+*/
+struct tile_node_stats
+{
+    size_t thread_count;
+    size_t tile_count;
+    size_t pixel_count;
+    double busy_time;
+};
+
+struct tile_scheduler_stats
+{
+    size_t tile_count;
+    size_t thread_count;
+    double wall_time;
+    // thread_count entries, the calling thread first
+    struct tile_thread_stats *threads;
+    // node_count entries, one per node up to the highest one threads ran on
+    size_t node_count;
+    struct tile_node_stats *nodes;
+};
+
+/*
+** Renders a width by height image by cutting it into square tiles of
+** tile_size pixels, using all threads of the pool. Each thread owns a
+** contiguous range of tiles, in row order, which it renders from the start.
+** Threads which are done with their own range steal tiles from the end of
+** the range with the most tiles left, so that threads rendering cheap parts
+** of the image end up rendering more tiles. stats may be NULL, otherwise it
+** must be destroyed using tile_scheduler_stats_destroy.
+*/
+void tile_scheduler_run(struct thread_pool *pool, size_t width, size_t height,
+                        size_t tile_size, tile_render_f render, void *data,
+                        struct tile_scheduler_stats *stats);
+
+/*
+** Calls touch on the tiles each thread owns when rendering, without any
+** stealing. Memory written by touch first, such as the frame buffer, is
+** then placed on the NUMA node of the thread which will render it.
+*/
+void tile_scheduler_first_touch(struct thread_pool *pool, size_t width,
+                                size_t height, size_t tile_size,
+                                tile_render_f touch, void *data);
+
+void tile_scheduler_stats_destroy(struct tile_scheduler_stats *stats);
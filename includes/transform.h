@@ -0,0 +1,166 @@
+#pragma once
+
+#include "aabb.h"
+#include "vec3.h"
+
+#include <math.h>
+#include <stdbool.h>
+
+/*
+** An affine transform. The first three columns are a linear map, and the
+** last one is a translation.
+*/
+struct transform
+{
+    double m[3][4];
+};
+
+static inline struct transform transform_identity(void)
+{
+    return (struct transform){{
+        {1, 0, 0, 0},
+        {0, 1, 0, 0},
+        {0, 0, 1, 0},
+    }};
+}
+
+static inline struct transform transform_translation(const struct vec3 *off)
+{
+    return (struct transform){{
+        {1, 0, 0, off->x},
+        {0, 1, 0, off->y},
+        {0, 0, 1, off->z},
+    }};
+}
+
+static inline struct transform transform_scaling(const struct vec3 *scale)
+{
+    return (struct transform){{
+        {scale->x, 0, 0, 0},
+        {0, scale->y, 0, 0},
+        {0, 0, scale->z, 0},
+    }};
+}
+
+/*
+** A rotation of angle radians around an axis, which must be normalized.
+*/
+static inline struct transform transform_rotation(const struct vec3 *axis,
+                                                  double angle)
+{
+    double c = cos(angle);
+    double s = sin(angle);
+    double t = 1 - c;
+    double x = axis->x;
+    double y = axis->y;
+    double z = axis->z;
+    return (struct transform){{
+        {t * x * x + c, t * x * y - s * z, t * x * z + s * y, 0},
+        {t * x * y + s * z, t * y * y + c, t * y * z - s * x, 0},
+        {t * x * z - s * y, t * y * z + s * x, t * z * z + c, 0},
+    }};
+}
+
+/*
+** Returns the transform applying b, then a.
+*/
+static inline struct transform transform_compose(const struct transform *a,
+                                                 const struct transform *b)
+{
+    struct transform res;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 4; j++)
+        {
+            res.m[i][j] = a->m[i][0] * b->m[0][j] + a->m[i][1] * b->m[1][j]
+                          + a->m[i][2] * b->m[2][j];
+            if (j == 3)
+                res.m[i][j] += a->m[i][3];
+        }
+    return res;
+}
+
+/*
+** Computes the inverse of a transform. Returns false if it isn't invertible.
+*/
+static inline bool transform_invert(struct transform *res,
+                                    const struct transform *t)
+{
+    const double(*m)[4] = t->m;
+    // the cofactors of the linear part
+    double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    double det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    if (det == 0 || !isfinite(det))
+        return false;
+
+    double inv_det = 1 / det;
+    res->m[0][0] = c00 * inv_det;
+    res->m[1][0] = c01 * inv_det;
+    res->m[2][0] = c02 * inv_det;
+    res->m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    res->m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    res->m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    res->m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    res->m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    res->m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+    // the translation is undone after the linear part
+    for (int i = 0; i < 3; i++)
+        res->m[i][3] = -(res->m[i][0] * m[0][3] + res->m[i][1] * m[1][3]
+                         + res->m[i][2] * m[2][3]);
+    return true;
+}
+
+static inline struct vec3 transform_vector(const struct transform *t,
+                                           const struct vec3 *v)
+{
+    return (struct vec3){
+        t->m[0][0] * v->x + t->m[0][1] * v->y + t->m[0][2] * v->z,
+        t->m[1][0] * v->x + t->m[1][1] * v->y + t->m[1][2] * v->z,
+        t->m[2][0] * v->x + t->m[2][1] * v->y + t->m[2][2] * v->z,
+    };
+}
+
+static inline struct vec3 transform_point(const struct transform *t,
+                                          const struct vec3 *p)
+{
+    struct vec3 res = transform_vector(t, p);
+    res.x += t->m[0][3];
+    res.y += t->m[1][3];
+    res.z += t->m[2][3];
+    return res;
+}
+
+/*
+** Normals are transformed using the transposed inverse of the transform
+** applied to points, which is what inv must be. The result isn't normalized.
+*/
+static inline struct vec3 transform_normal(const struct transform *inv,
+                                           const struct vec3 *n)
+{
+    return (struct vec3){
+        inv->m[0][0] * n->x + inv->m[1][0] * n->y + inv->m[2][0] * n->z,
+        inv->m[0][1] * n->x + inv->m[1][1] * n->y + inv->m[2][1] * n->z,
+        inv->m[0][2] * n->x + inv->m[1][2] * n->y + inv->m[2][2] * n->z,
+    };
+}
+
+/*
+** Computes the bounding box of a transformed box.
+*/
+static inline void transform_aabb(struct aabb *res, const struct transform *t,
+                                  const struct aabb *box)
+{
+    aabb_init_empty(res);
+    for (int corner = 0; corner < 8; corner++)
+    {
+        struct vec3 point = {
+            corner & 1 ? box->max.x : box->min.x,
+            corner & 2 ? box->max.y : box->min.y,
+            corner & 4 ? box->max.z : box->min.z,
+        };
+        point = transform_point(t, &point);
+        aabb_extend_point(res, &point);
+    }
+}
@@ -6,31 +6,123 @@
 
 #include <stddef.h>
 
+// the tolerance of the edge tests, relative to the size of the triangle
+#define TRIANGLE_EPSILON 0.0000001
+
+/*
+** Returns the distance to the intersection of a ray and the triangle of
+** point v0 and edges e0 and e1 from v0, if it's lower than max_dist, or
+** INFINITY. Also stores the barycentric coordinates of the intersection,
+** relative to the ends of e0 and e1.
+** This is the Moller-Trumbore algorithm: the intersection is solved for in
+** barycentric coordinates using Cramer's rule, where all determinants are
+** scalar triple products sharing terms.
+*/
+static inline double triangle_intersect(const struct vec3 *v0,
+                                        const struct vec3 *e0,
+                                        const struct vec3 *e1,
+                                        const struct ray *ray,
+                                        double max_dist, double *u, double *v)
+{
+    struct vec3 p = vec3_cross(&ray->direction, e1);
+
+    // det is the dot product of the ray direction and the unnormalized normal,
+    // negated. when it isn't positive, the triangle is facing the wrong way
+    real det = vec3_dot(e0, &p);
+    if (det <= 0)
+        return INFINITY;
+
+    // all coordinates below are scaled by det, and so is the tolerance
+    real tolerance = (real)TRIANGLE_EPSILON * det;
+
+    struct vec3 s = vec3_sub(&ray->source, v0);
+    real det_u = vec3_dot(&s, &p);
+    if (det_u < -tolerance || det_u > det + tolerance)
+        return INFINITY;
+
+    struct vec3 q = vec3_cross(&s, e0);
+    real det_v = vec3_dot(&ray->direction, &q);
+    if (det_v < -tolerance || det_u + det_v > det + tolerance)
+        return INFINITY;
+
+    real t = vec3_dot(e1, &q) / det;
+    if (t < 0 || t >= max_dist)
+        return INFINITY;
+
+    *u = det_u / det;
+    *v = det_v / det;
+    return t;
+}
+
+/*
+** Computes the bounds of the parts of a triangle on each side of an axis
+** aligned plane.
+*/
+void triangle_split(const struct vec3 *points[3], int axis, double pos,
+                    struct aabb *left, struct aabb *right);
+
 /*
 ** The facing side of the triangle is the one where the points appear
 ** in counter clockwise order.
+** The edges and normal are derived from the points when the triangle is
+** created, so that intersection tests don't have to. Whoever moves the
+** points must call triangle_update.
 */
 struct triangle
 {
     struct object base;
     struct vec3 points[3];
+    // points[1] - points[0] and points[2] - points[0]
+    struct vec3 edges[2];
+    // the unit normal of the facing side
+    struct vec3 normal;
     struct material *material;
 };
 
-double object_triangle_ray_intersect(struct object_intersection *inter,
-                                     const struct object *obj,
+/*
+** Returns the distance to the intersection of a ray and a triangle, if it's
+** lower than max_dist, or INFINITY. Also stores the barycentric coordinates
+** of the intersection, relative to points 1 and 2.
+*/
+double triangle_ray_dist(const struct triangle *trian, const struct ray *ray,
+                         double max_dist, double *u, double *v);
+
+/*
+** Recomputes the edges and normal of the triangle, after its points moved.
+*/
+void triangle_update(struct triangle *trian);
+
+double object_triangle_ray_intersect(struct object_hit *hit,
+                                     const struct object *obj, size_t prim,
                                      const struct ray *ray);
 
+void object_triangle_resolve(struct object_intersection *inter,
+                             const struct object *obj, size_t prim,
+                             const struct ray *ray, double dist,
+                             const struct object_hit *hit);
+
+bool object_triangle_occluded(const struct object *obj, size_t prim,
+                              const struct ray *ray, double max_dist);
+
+void object_triangle_bounds(struct aabb *bounds, const struct object *obj,
+                            size_t prim);
+
+void object_triangle_split(const struct object *obj, size_t prim, int axis,
+                           double pos, struct aabb *left, struct aabb *right);
+
 void triangle_free(struct object *obj);
 
 static inline struct triangle *triangle_create(struct vec3 points[3],
                                                struct material *mat)
 {
     struct triangle *trian = zalloc(sizeof(*trian));
-    object_init(&trian->base, object_triangle_ray_intersect, triangle_free);
+    object_init(&trian->base, object_triangle_ray_intersect,
+                object_triangle_resolve, object_triangle_occluded,
+                object_triangle_bounds, object_triangle_split, triangle_free);
     trian->points[0] = points[0];
     trian->points[1] = points[1];
     trian->points[2] = points[2];
+    triangle_update(trian);
     trian->material = material_get(mat);
     return trian;
 }
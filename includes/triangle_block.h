@@ -0,0 +1,152 @@
+#pragma once
+
+#include "ray.h"
+#include "vec3.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// blocks fill a 256 bit register per component, whatever the precision
+#ifdef RT_FLOAT_GEOMETRY
+#define TRIANGLE_BLOCK_WIDTH 8
+#else
+#define TRIANGLE_BLOCK_WIDTH 4
+#endif
+
+/*
+** Up to TRIANGLE_BLOCK_WIDTH triangles, stored as arrays of components so
+** that a ray can be tested against all of them at once using vector
+** instructions. Triangles are stored as a point and the edges from it to the
+** two others, as triangle_intersect takes them.
+** Unused lanes have null edges, which no ray can hit.
+** compiled_prims stores its copies of triangles in blocks, so that leaves
+** made of consecutive triangles are tested a block at a time.
+*/
+struct triangle_block
+{
+    real v0[3][TRIANGLE_BLOCK_WIDTH];
+    real e0[3][TRIANGLE_BLOCK_WIDTH];
+    real e1[3][TRIANGLE_BLOCK_WIDTH];
+    // the primitive index of each triangle, which the block doesn't use
+    uint32_t prims[TRIANGLE_BLOCK_WIDTH];
+};
+
+/*
+** Stores a triangle in a lane of the block, given its points.
+*/
+void triangle_block_set(struct triangle_block *block, size_t lane,
+                        const struct vec3 *points[3], uint32_t prim);
+
+/*
+** Stores a triangle in a lane of the block, given a point and the edges from
+** it, as triangle_intersect takes them.
+*/
+void triangle_block_set_edges(struct triangle_block *block, size_t lane,
+                              const struct vec3 *v0, const struct vec3 *e0,
+                              const struct vec3 *e1, uint32_t prim);
+
+/*
+** Reads back the triangle of a lane, as triangle_block_set_edges took it.
+*/
+static inline void triangle_block_get(const struct triangle_block *block,
+                                      size_t lane, struct vec3 *v0,
+                                      struct vec3 *e0, struct vec3 *e1)
+{
+    *v0 = (struct vec3){
+        block->v0[0][lane], block->v0[1][lane], block->v0[2][lane]};
+    *e0 = (struct vec3){
+        block->e0[0][lane], block->e0[1][lane], block->e0[2][lane]};
+    *e1 = (struct vec3){
+        block->e1[0][lane], block->e1[1][lane], block->e1[2][lane]};
+}
+
+/*
+** The result of a block intersection: the lane and primitive index of the
+** closest triangle hit, the distance to it and the barycentric coordinates
+** of the hit.
+*/
+struct triangle_block_hit
+{
+    size_t lane;
+    uint32_t prim;
+    double dist;
+    double u;
+    double v;
+};
+
+/*
+** Tests a ray against the triangles of the block in lanes lane_begin to
+** lane_end excluded, and stores the closest hit closer than max_dist in hit.
+** Returns false if there's none. Results are the same as
+** triangle_intersect's, and ties are broken by picking the lowest primitive
+** index. This version uses SSE2 where available.
+*/
+bool triangle_block_intersect(const struct triangle_block *block,
+                              size_t lane_begin, size_t lane_end,
+                              const struct ray *ray, double max_dist,
+                              struct triangle_block_hit *hit);
+
+/*
+** The same test, using AVX. Callers must check that the processor supports
+** it first.
+*/
+bool triangle_block_intersect_avx(const struct triangle_block *block,
+                                  size_t lane_begin, size_t lane_end,
+                                  const struct ray *ray, double max_dist,
+                                  struct triangle_block_hit *hit);
+
+/*
+** The type of both block tests, so that callers can pick one once.
+*/
+typedef bool (*triangle_block_intersect_f)(const struct triangle_block *block,
+                                           size_t lane_begin, size_t lane_end,
+                                           const struct ray *ray,
+                                           double max_dist,
+                                           struct triangle_block_hit *hit);
+
+/*
+** Converts a distance to the precision of geometry, rounding it up, so that
+** distances in this precision compare the same way to both.
+*/
+static inline real triangle_block_dist_up(double dist)
+{
+    real res = dist;
+    if (res < dist)
+        res = REAL_NEXTAFTER(res, INFINITY);
+    return res;
+}
+
+/*
+** Picks the closest of the distances of lanes lane_begin to lane_end, as
+** computed by the vectorized tests, and computes the barycentric coordinates
+** of the hit.
+*/
+static inline bool
+triangle_block_closest(const struct triangle_block *block, size_t lane_begin,
+                       size_t lane_end, const real dists[],
+                       const real det_u[], const real det_v[],
+                       const real det[], struct triangle_block_hit *hit)
+{
+    size_t best = TRIANGLE_BLOCK_WIDTH;
+    for (size_t i = lane_begin; i < lane_end; i++)
+    {
+        if (!(dists[i] < INFINITY))
+            continue;
+        if (best == TRIANGLE_BLOCK_WIDTH || dists[i] < dists[best]
+            || (dists[i] == dists[best]
+                && block->prims[i] < block->prims[best]))
+            best = i;
+    }
+
+    if (best == TRIANGLE_BLOCK_WIDTH)
+        return false;
+
+    hit->lane = best;
+    hit->prim = block->prims[best];
+    hit->dist = dists[best];
+    hit->u = det_u[best] / det[best];
+    hit->v = det_v[best] / det[best];
+    return true;
+}
@@ -9,3 +9,5 @@ void *xrealloc(void *ptr, size_t size);
 __attribute__((malloc)) void *xcalloc(size_t nmemb, size_t size);
 
 __attribute__((malloc)) void *zalloc(size_t size);
+
+__attribute__((malloc)) void *xaligned_alloc(size_t alignment, size_t size);
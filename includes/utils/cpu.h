@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// worker counts given by users are capped to this
+#define CPU_MAX_WORKERS 4096
+
+/*
+** Parses a worker count given by the user, as a positive decimal number of
+** at most CPU_MAX_WORKERS. Returns zero if it's invalid.
+*/
+size_t cpu_parse_worker_count(const char *str);
+
+/*
+** Returns the number of worker threads to use for rendering, and for the
+** other parallel tasks which run before it: one per processor the process
+** may run on, according to its affinity mask and the CPU quota of its
+** cgroups, and at least one. The RT_THREADS environment variable overrides
+** it, and the program exits if it's invalid.
+*/
+size_t cpu_worker_count(void);
+
+/*
+** Returns the NUMA node of a processor, or zero if it isn't known.
+*/
+int cpu_node(int cpu);
+
+/*
+** Returns whether the processor supports the AVX instruction set.
+** It's always true on architectures where AVX code isn't used.
+*/
+bool cpu_has_avx(void);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <time.h>
+
+/*
+** Returns the time elapsed since some arbitrary point, in seconds.
+** Only differences between two calls are meaningful.
+*/
+static inline double timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
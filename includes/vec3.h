@@ -2,123 +2,46 @@
 
 #include <math.h>
 
-struct vec3
-{
-    double x;
-    double y;
-    double z;
-};
-
-static inline struct vec3 vec3_add(const struct vec3 *a, const struct vec3 *b)
-{
-    return (struct vec3){
-        .x = a->x + b->x,
-        .y = a->y + b->y,
-        .z = a->z + b->z,
-    };
-}
-
-static inline struct vec3 vec3_sub(const struct vec3 *a, const struct vec3 *b)
-{
-    return (struct vec3){
-        .x = a->x - b->x,
-        .y = a->y - b->y,
-        .z = a->z - b->z,
-    };
-}
-
-static inline void vec3_neg(struct vec3 *v)
-{
-    v->x = -v->x;
-    v->y = -v->y;
-    v->z = -v->z;
-}
-
-static inline struct vec3 vec3_mul(const struct vec3 *a, double c)
-{
-    return (struct vec3){
-        .x = a->x * c,
-        .y = a->y * c,
-        .z = a->z * c,
-    };
-}
-
-static inline struct vec3 vec3_mul_vec(const struct vec3 *a,
-                                       const struct vec3 *b)
-{
-    return (struct vec3){
-        .x = a->x * b->x,
-        .y = a->y * b->y,
-        .z = a->z * b->z,
-    };
-}
-
-static inline struct vec3 vec3_div(struct vec3 *a, int d)
-{
-    return (struct vec3){
-        .x = a->x / d,
-        .y = a->y / d,
-        .z = a->z / d,
-    };
-}
-
-static inline double vec3_length(const struct vec3 *v)
-{
-    return sqrt(v->x * v->x + v->y * v->y + v->z * v->z);
-}
-
-static inline void vec3_normalize(struct vec3 *v)
-{
-    double len = vec3_length(v);
-    v->x /= len;
-    v->y /= len;
-    v->z /= len;
-}
-
-static inline double vec3_dot(const struct vec3 *a, const struct vec3 *b)
-{
-    return (a->x * b->x + a->y * b->y + a->z * b->z);
-}
-
-static inline struct vec3 vec3_cross(const struct vec3 *a, const struct vec3 *b)
-{
-    return (struct vec3){a->y * b->z - b->y * a->z, a->z * b->x - b->z * a->x,
-                         a->x * b->y - b->x * a->y};
-}
-
 /*
-** Computes the reflection of a vector, given the normal of a surface
+** The precision of geometry: vertices, rays, bounding boxes and the
+** intersection tests using them. Building with RT_FLOAT_GEOMETRY defined
+** makes it single precision, which halves the size of geometry and doubles
+** the width of vector instructions. Shading always uses doubles.
 */
-static inline struct vec3 vec3_reflect(const struct vec3 *incident_dir,
-                                       const struct vec3 *normal)
-{
-    double correction_coeff = -2 * vec3_dot(incident_dir, normal);
-    struct vec3 corrector = vec3_mul(normal, correction_coeff);
-    return vec3_add(incident_dir, &corrector);
-}
-
-static inline void vec3_update_min_components(struct vec3 *self,
-                                              const struct vec3 *o)
-{
-    if (o->x < self->x)
-        self->x = o->x;
-
-    if (o->y < self->y)
-        self->y = o->y;
-
-    if (o->z < self->z)
-        self->z = o->z;
-}
-
-static inline void vec3_update_max_components(struct vec3 *self,
-                                              const struct vec3 *o)
-{
-    if (o->x > self->x)
-        self->x = o->x;
-
-    if (o->y > self->y)
-        self->y = o->y;
-
-    if (o->z > self->z)
-        self->z = o->z;
+#ifdef RT_FLOAT_GEOMETRY
+typedef float real;
+#define REAL_SQRT sqrtf
+#define REAL_NEXTAFTER nextafterf
+#else
+typedef double real;
+#define REAL_SQRT sqrt
+#define REAL_NEXTAFTER nextafter
+#endif
+
+// positions and directions, using the precision of geometry
+#define GVEC3_NAME vec3
+#define GVEC3_TYPE real
+#define GVEC3_SQRT REAL_SQRT
+#include "gvec3.h"
+#undef GVEC3_NAME
+#undef GVEC3_TYPE
+#undef GVEC3_SQRT
+
+// colors, and the directions shading computations are made with
+#define GVEC3_NAME dvec3
+#define GVEC3_TYPE double
+#define GVEC3_SQRT sqrt
+#include "gvec3.h"
+#undef GVEC3_NAME
+#undef GVEC3_TYPE
+#undef GVEC3_SQRT
+
+static inline struct dvec3 vec3_to_dvec3(const struct vec3 *v)
+{
+    return (struct dvec3){v->x, v->y, v->z};
+}
+
+static inline struct vec3 dvec3_to_vec3(const struct dvec3 *v)
+{
+    return (struct vec3){v->x, v->y, v->z};
 }
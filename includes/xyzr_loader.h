@@ -0,0 +1,30 @@
+#pragma once
+
+#include "bvh.h"
+#include "sphere_cloud.h"
+
+#include <stdbool.h>
+
+/*
+** Sphere cloud files hold one sphere per particle, either as text or in
+** binary. Text files have a line per sphere, holding the coordinates of its
+** center and its radius, separated by spaces. Empty lines and lines
+** starting with # are skipped. Binary files start with the 8 bytes of
+** XYZR_BINARY_MAGIC and the number of spheres as a 64 bit unsigned integer,
+** followed by the x, y, z and radius of each sphere, as single precision
+** floats. Numbers use the byte order of the machine.
+*/
+#define XYZR_BINARY_MAGIC "XYZRBIN\n"
+
+/*
+** Returns whether the file name has the extension of sphere cloud files,
+** .xyzr for text files and .xyzrb for binary ones.
+*/
+bool is_xyzr_file(const char *filename);
+
+/*
+** Loads a sphere cloud file, whichever its format, and builds the tree of
+** the cloud. All spheres share a default material. Returns NULL on failure.
+*/
+struct sphere_cloud *load_xyzr(const char *filename,
+                               const struct bvh_build_options *options);
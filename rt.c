@@ -9,30 +9,108 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "accel_cache.h"
+#include "bench.h"
 #include "bmp.h"
 #include "camera.h"
 #include "image.h"
+#include "mesh.h"
 #include "normal_material.h"
 #include "obj_loader.h"
 #include "phong_material.h"
 #include "procedural_background.h"
+#include "sampler.h"
 #include "scene.h"
 #include "sphere.h"
+#include "sphere_cloud.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
 #include "triangle.h"
+#include "utils/cpu.h"
+#include "utils/hash.h"
+#include "utils/timer.h"
 #include "vec3.h"
+#include "xyzr_loader.h"
 #include "color.h"
 
 #define NB_REC_REFLECTION 4
 
-#define NB_RAY_PER_PIXEL 5
-// Offset coordonates for the five rays throw for each pixel
-static double coor_offset[5][2] = {
-    {0, 0},
-    {-0.5, -0.5},
-    {-0.5, 0.5},
-    {0.5, -0.5},
-    {0.5, 0.5},
+// the largest packets of camera rays are this many pixels wide and high
+#define PACKET_MAX_WIDTH 8
+
+// the size of the triangle intersection benchmark, in ray triangle pairs
+#define BENCH_TRIANGLE_COUNT 1024
+#define BENCH_TRIANGLE_RAY_COUNT 4096
+
+// where the antialiasing samples of render_shaded and render_shaded_tile
+// are, and how many there are per pixel
+static struct sampler aa_sampler;
+static size_t aa_spp = SAMPLER_QUINCUNX_COUNT;
+
+// the sample count of adaptive antialiasing is stored on 16 bits per pixel
+#define ADAPTIVE_MAX_SPP UINT16_MAX
+
+// pixels whose color differs from a neighbour by this many times the
+// adaptive antialiasing threshold are considered to be on an edge
+#define ADAPTIVE_CONTRAST_SCALE 4
+
+/*
+** Settings of adaptive antialiasing, which traces at least min_spp and at
+** most max_spp samples per pixel, and stops once the standard error of the
+** mean of the gamma encoded channels is below threshold.
+*/
+struct adaptive_aa
+{
+    size_t min_spp;
+    size_t max_spp;
+    double threshold;
+    // the number of samples kept for each pixel
+    uint16_t *pixel_spp;
+    // samples traced for the rings around tiles, which aren't kept
+    size_t ring_samples;
+    pthread_mutex_t lock;
+};
+
+static struct adaptive_aa adaptive_aa = {
+    .min_spp = 2,
+    .max_spp = 16,
+    .threshold = 0.01,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+** When reflected rays stop being traced, besides after NB_REC_REFLECTION
+** bounces
+*/
+enum bounce_cutoff
+{
+    BOUNCE_CUTOFF_NONE,
+    // once the weight of the next bounce in the sample is below a threshold
+    BOUNCE_CUTOFF_THRESHOLD,
+};
+
+struct bounce_settings
+{
+    enum bounce_cutoff cutoff;
+    double threshold;
+    // instead of always stopping, paths under the cutoff go on with a
+    // probability proportional to how close they are to it, and get
+    // weighted up when they do, which keeps the image unbiased
+    bool roulette;
+
+    // bounces and camera paths traced by all threads, gathered after each
+    // tile from the counters of threads
+    size_t bounce_count;
+    size_t path_count;
+    pthread_mutex_t lock;
+};
+
+static struct bounce_settings bounce_settings = {
+    .cutoff = BOUNCE_CUTOFF_NONE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
 };
+static __thread size_t thread_bounce_count;
+static __thread size_t thread_path_count;
 
 static void build_test_scene(struct scene *scene, double aspect_ratio)
 {
@@ -116,6 +194,154 @@ static void build_obj_scene(struct scene *scene, double aspect_ratio)
     vec3_normalize(&scene->camera.up);
 }
 
+/* Moves the camera back along its axis, so that it sees all of a box. It
+** must be called after build_obj_scene, which gives it a 40 degrees field
+** of view.
+*/
+static void frame_camera(struct scene *scene, const struct aabb *bounds)
+{
+    struct vec3 center = aabb_center(bounds);
+    struct vec3 diagonal = vec3_sub(&bounds->max, &bounds->min);
+    double radius = vec3_length(&diagonal) / 2;
+    double distance = radius / sin(20 * M_PI / 180);
+    struct vec3 back = vec3_mul(&scene->camera.forward, -distance);
+    scene->camera.center = vec3_add(&center, &back);
+}
+
+/* Lays instance_count instances of a group out on a square grid, spanning
+** the same area as the group itself, each with its own rotation.
+*/
+static void place_instances(struct scene *scene, struct object_group *group,
+                            size_t instance_count)
+{
+    size_t side = ceil(sqrt(instance_count));
+    const struct aabb *bounds = &group->bounds;
+    struct vec3 center = aabb_center(bounds);
+    struct vec3 extent = vec3_sub(&bounds->max, &bounds->min);
+    struct vec3 to_origin = vec3_mul(&center, -1);
+    struct vec3 scale = {1. / side, 1. / side, 1. / side};
+    struct vec3 up = {0, 1, 0};
+
+    for (size_t i = 0; i < instance_count; i++)
+    {
+        struct vec3 cell_center = {
+            bounds->min.x + (i % side + 0.5) * extent.x / side,
+            center.y,
+            bounds->min.z + (i / side + 0.5) * extent.z / side,
+        };
+
+        struct transform transform = transform_translation(&to_origin);
+        struct transform step = transform_rotation(
+            &up, 2 * M_PI * i / instance_count);
+        transform = transform_compose(&step, &transform);
+        step = transform_scaling(&scale);
+        transform = transform_compose(&step, &transform);
+        step = transform_translation(&cell_center);
+        transform = transform_compose(&step, &transform);
+        scene_add_instance(scene, group, &transform);
+    }
+}
+
+/* Print how much memory the faces of the meshes of the scene take on
+** average, including the copies of faces made to test them faster
+*/
+static void print_mesh_memory(struct scene *scene)
+{
+    size_t face_count = 0;
+    size_t mesh_bytes = 0;
+    for (size_t i = 0; i < object_vect_size(&scene->objects); i++)
+    {
+        struct object *obj = object_vect_get(&scene->objects, i);
+        if (obj->intersect != object_mesh_ray_intersect)
+            continue;
+
+        const struct mesh *mesh = (const struct mesh *)obj;
+        face_count += mesh->face_count;
+        mesh_bytes += mesh_memory(mesh);
+    }
+    if (face_count == 0)
+        return;
+
+    size_t compiled_bytes = compiled_prims_memory(&scene->compiled);
+    fprintf(stderr, "meshes: %zu faces, %.1f bytes per face, %.1f with "
+            "%zu compiled copies\n", face_count,
+            (double)mesh_bytes / face_count,
+            (double)(mesh_bytes + compiled_bytes) / face_count,
+            scene->compiled.triangle_count);
+}
+
+/* A turntable animation of the meshes of the scene, which spin around a
+** vertical axis going through the center of their bounding box.
+*/
+struct turntable
+{
+    // the position of the vertices of all meshes at the first frame
+    struct vec3 *rest_vertices;
+    struct vec3 center;
+    size_t frame_count;
+};
+
+/* Return an object of the scene, which must be a mesh, as only meshes can
+** be animated
+*/
+static struct mesh *turntable_mesh(struct scene *scene, size_t i)
+{
+    struct object *obj = object_vect_get(&scene->objects, i);
+    if (obj->intersect != object_mesh_ray_intersect)
+        errx(1, "--frames only supports scenes made of meshes");
+    return (struct mesh *)obj;
+}
+
+static void turntable_init(struct turntable *turntable, struct scene *scene,
+                           size_t frame_count)
+{
+    size_t vertex_count = 0;
+    for (size_t i = 0; i < object_vect_size(&scene->objects); i++)
+    {
+        struct mesh *mesh = turntable_mesh(scene, i);
+        vertex_count += mesh->vertex_count;
+    }
+
+    turntable->rest_vertices
+        = xcalloc(vertex_count, sizeof(*turntable->rest_vertices));
+    turntable->frame_count = frame_count;
+
+    struct aabb bounds;
+    aabb_init_empty(&bounds);
+    struct vec3 *rest = turntable->rest_vertices;
+    for (size_t i = 0; i < object_vect_size(&scene->objects); i++)
+    {
+        struct mesh *mesh = turntable_mesh(scene, i);
+        for (size_t vertex_i = 0; vertex_i < mesh->vertex_count; vertex_i++)
+        {
+            *rest = mesh->vertices[vertex_i];
+            aabb_extend_point(&bounds, rest++);
+        }
+    }
+    turntable->center = aabb_center(&bounds);
+}
+
+static void turntable_animate(struct scene *scene, size_t frame, void *data)
+{
+    struct turntable *turntable = data;
+    struct vec3 up = {0, 1, 0};
+    struct vec3 to_origin = vec3_mul(&turntable->center, -1);
+    struct transform transform = transform_translation(&to_origin);
+    struct transform step
+        = transform_rotation(&up, 2 * M_PI * frame / turntable->frame_count);
+    transform = transform_compose(&step, &transform);
+    step = transform_translation(&turntable->center);
+    transform = transform_compose(&step, &transform);
+
+    const struct vec3 *rest = turntable->rest_vertices;
+    for (size_t i = 0; i < object_vect_size(&scene->objects); i++)
+    {
+        struct mesh *mesh = turntable_mesh(scene, i);
+        for (size_t vertex_i = 0; vertex_i < mesh->vertex_count; vertex_i++)
+            mesh->vertices[vertex_i] = transform_point(&transform, rest++);
+    }
+}
+
 static struct ray image_cast_ray(const struct rgb_image *image,
                                  const struct scene *scene, double x, double y)
 {
@@ -131,30 +357,6 @@ static struct ray image_cast_ray(const struct rgb_image *image,
     return ray;
 }
 
-static double
-scene_intersect_ray(struct object_intersection *closest_intersection,
-                    struct scene *scene, struct ray *ray)
-{
-    // we will now try to find the closest object in the scene
-    // intersecting this ray
-    double closest_intersection_dist = INFINITY;
-
-    for (size_t i = 0; i < object_vect_size(&scene->objects); i++)
-    {
-        struct object *obj = object_vect_get(&scene->objects, i);
-        struct object_intersection intersection;
-        // if there's no intersection between the ray and this object, skip it
-        double intersection_dist = obj->intersect(&intersection, obj, ray);
-        if (intersection_dist >= closest_intersection_dist)
-            continue;
-
-        closest_intersection_dist = intersection_dist;
-        *closest_intersection = intersection;
-    }
-
-    return closest_intersection_dist;
-}
-
 /* Return the reflected ray reflection
 ** Source -> Intersection point
 ** Direction -> Use reflect function
@@ -164,20 +366,78 @@ static void get_reflect_ray(struct ray *ray,
 {
     ray->direction =
         vec3_reflect(&ray->direction, &closest_intersection->location.normal);
+    ray_update_inv_direction(ray);
     struct vec3 off = vec3_mul(&ray->direction, 0.01);
     ray->source = vec3_add(&closest_intersection->location.point, &off);
 }
 
-static struct vec3 reflect(struct rgb_image *image, struct scene *scene,
-                           struct ray *ray, int rec, double x, double y)
+/* The state of a path starting from the camera, as it bounces off
+** surfaces
+*/
+struct path
 {
-    if (rec >= NB_REC_REFLECTION)
-        return (struct vec3){0};
+    int depth;
+    // the weight of the radiance seen by the current ray in the sample
+    double throughput;
+};
 
-    // Get intersection
-    struct object_intersection closest_intersection;
-    double closest_intersection_dist
-        = scene_intersect_ray(&closest_intersection, scene, ray);
+#define CAMERA_PATH ((struct path){.depth = 0, .throughput = 1})
+
+/* Return a random number in [0, 1) for a bounce of the sample at (x, y),
+** which only depends on its arguments, so that images don't depend on the
+** order pixels are rendered in
+*/
+static double bounce_random(double x, double y, int depth)
+{
+    uint64_t hash = HASH_INIT;
+    hash = hash_bytes(hash, &x, sizeof(x));
+    hash = hash_bytes(hash, &y, sizeof(y));
+    hash = hash_bytes(hash, &depth, sizeof(depth));
+    return (hash >> 11) * 0x1p-53;
+}
+
+/* Return how much the next bounce of a path matters, relative to the
+** cutoff: below one, it's under the cutoff
+*/
+static double bounce_importance(const struct path *next)
+{
+    return next->throughput / bounce_settings.threshold;
+}
+
+/* Return the probability for a path to go on with its next bounce, which
+** is either zero or one without russian roulette
+*/
+static double bounce_probability(const struct path *next, double x, double y)
+{
+    if (next->depth >= NB_REC_REFLECTION)
+        return 0;
+    if (bounce_settings.cutoff == BOUNCE_CUTOFF_NONE)
+        return 1;
+
+    double importance = bounce_importance(next);
+    if (importance >= 1)
+        return 1;
+    if (!bounce_settings.roulette
+        || bounce_random(x, y, next->depth) >= importance)
+        return 0;
+    return importance;
+}
+
+static struct dvec3 reflect(struct rgb_image *image, struct scene *scene,
+                            struct ray *ray, struct path path, double x,
+                            double y);
+
+/* Return the color seen along a ray, given the closest intersection, which
+** was already found
+*/
+static struct dvec3 shade_hit(struct rgb_image *image, struct scene *scene,
+                              struct ray *ray,
+                              struct object_intersection *closest_intersection,
+                              double closest_intersection_dist,
+                              struct path path, double x, double y)
+{
+    if (path.depth == 0)
+        thread_path_count++;
 
     // If no intersection
     if (isinf(closest_intersection_dist))
@@ -185,24 +445,56 @@ static struct vec3 reflect(struct rgb_image *image, struct scene *scene,
 
     // Get material
     struct phong_material *mat =
-        (struct phong_material *)closest_intersection.material;
-    struct vec3 pix_color =
-        mat->base.shade(&mat->base, &closest_intersection.location, scene, ray);
+        (struct phong_material *)closest_intersection->material;
+    struct dvec3 pix_color = mat->base.shade(
+        &mat->base, &closest_intersection->location, scene, ray);
+
+    // stop once the reflection can't matter enough
+    struct path next = {
+        .depth = path.depth + 1,
+        .throughput = path.throughput * mat->spec_Ks,
+    };
+    double probability = bounce_probability(&next, x, y);
+    if (probability == 0)
+        return pix_color;
+    next.throughput /= probability;
 
     // Create reflected ray
-    get_reflect_ray(ray, &closest_intersection);
+    get_reflect_ray(ray, closest_intersection);
 
     /* Add reflected ray to current color
     ** pixel_color += 0.2 * reflect()
     */
-    struct vec3 ret_vec = reflect(image, scene, ray, rec + 1, x, y);
-    ret_vec = vec3_mul(&ret_vec, mat->spec_Ks);
-    return vec3_add(&ret_vec, &pix_color);
+    struct dvec3 ret_vec = reflect(image, scene, ray, next, x, y);
+    ret_vec = dvec3_mul(&ret_vec, mat->spec_Ks / probability);
+    return dvec3_add(&ret_vec, &pix_color);
+}
+
+static struct dvec3 reflect(struct rgb_image *image, struct scene *scene,
+                            struct ray *ray, struct path path, double x,
+                            double y)
+{
+    if (path.depth >= NB_REC_REFLECTION)
+        return (struct dvec3){0};
+    if (path.depth != 0)
+        thread_bounce_count++;
+
+    // Get intersection
+    struct object_intersection closest_intersection;
+    double closest_intersection_dist
+        = scene_intersect_ray(&closest_intersection, scene, ray);
+    return shade_hit(image, scene, ray, &closest_intersection,
+                     closest_intersection_dist, path, x, y);
 }
 
 typedef void (*render_mode_f)(struct rgb_image *, struct scene *, size_t x,
                               size_t y);
 
+// renders a tile of pixels, given its corner and size
+typedef void (*render_tile_f)(struct rgb_image *, struct scene *,
+                              size_t min_x, size_t min_y, size_t width,
+                              size_t height);
+
 /* For all the pixels of the image, try to find the closest object
 ** intersecting the camera ray. If an object is found, shade the pixel to
 ** find its color.
@@ -211,29 +503,645 @@ static void render_shaded(struct rgb_image *image, struct scene *scene,
                           size_t x, size_t y)
 {
     struct ray ray;
-    struct vec3 pix_color = {0};
-    struct vec3 tmp;
+    struct dvec3 pix_color = {0};
+    struct dvec3 tmp;
 
-    /* Throw NB_RAY_PER_PIXEL rays for one pixel (antialiasing)
+    /* Throw aa_spp rays for one pixel (antialiasing)
     */
-    for (short i = 0; i < NB_RAY_PER_PIXEL; i++)
+    for (size_t i = 0; i < aa_spp; i++)
     {
-        ray = image_cast_ray(image, scene, x + coor_offset[i][0],
-                                           y + coor_offset[i][1]);
+        double dx, dy;
+        sampler_offset(&aa_sampler, x, y, i, &dx, &dy);
+        ray = image_cast_ray(image, scene, x + dx, y + dy);
 
-        tmp = reflect(image, scene, &ray, 0, x + coor_offset[i][0],
-                                             y + coor_offset[i][1]);
+        tmp = reflect(image, scene, &ray, CAMERA_PATH, x + dx, y + dy);
 
         /* Divide the resulting vec by the number of pixel per ray and
         ** add it to the previous one
         */
-        tmp = vec3_div(&tmp, NB_RAY_PER_PIXEL);
-        pix_color = vec3_add(&pix_color, &tmp);
+        tmp = dvec3_div(&tmp, aa_spp);
+        pix_color = dvec3_add(&pix_color, &tmp);
     }
 
     rgb_image_set(image, x, y, rgb_color_from_light(&pix_color));
 }
 
+/* Render a tile of pixels the same way as render_shaded, but trace the
+** camera rays of all pixels together, as a packet, for each antialiasing
+** offset. Reflected rays are traced one by one.
+*/
+static void render_shaded_tile(struct rgb_image *image, struct scene *scene,
+                               size_t min_x, size_t min_y, size_t width,
+                               size_t height)
+{
+    struct ray rays[PACKET_MAX_WIDTH * PACKET_MAX_WIDTH];
+    struct object_intersection intersections[PACKET_MAX_WIDTH
+                                             * PACKET_MAX_WIDTH];
+    double dists[PACKET_MAX_WIDTH * PACKET_MAX_WIDTH];
+    struct dvec3 pix_colors[PACKET_MAX_WIDTH * PACKET_MAX_WIDTH] = {{0}};
+    double sample_x[PACKET_MAX_WIDTH * PACKET_MAX_WIDTH];
+    double sample_y[PACKET_MAX_WIDTH * PACKET_MAX_WIDTH];
+    size_t ray_count = width * height;
+
+    for (size_t i = 0; i < aa_spp; i++)
+    {
+        for (size_t j = 0; j < ray_count; j++)
+        {
+            size_t x = min_x + j % width;
+            size_t y = min_y + j / width;
+            double dx, dy;
+            sampler_offset(&aa_sampler, x, y, i, &dx, &dy);
+            sample_x[j] = x + dx;
+            sample_y[j] = y + dy;
+            rays[j] = image_cast_ray(image, scene, sample_x[j], sample_y[j]);
+        }
+
+        scene_intersect_packet(intersections, dists, scene, rays, ray_count);
+
+        for (size_t j = 0; j < ray_count; j++)
+        {
+            struct dvec3 tmp = shade_hit(
+                image, scene, &rays[j], &intersections[j], dists[j],
+                CAMERA_PATH, sample_x[j], sample_y[j]);
+            tmp = dvec3_div(&tmp, aa_spp);
+            pix_colors[j] = dvec3_add(&pix_colors[j], &tmp);
+        }
+    }
+
+    for (size_t j = 0; j < ray_count; j++)
+        rgb_image_set(image, min_x + j % width, min_y + j / width,
+                      rgb_color_from_light(&pix_colors[j]));
+}
+
+/* Trace the corners of a row of pixels, which sit at y, from min_x - 0.5
+** to min_x + width - 0.5
+*/
+static void trace_corner_row(struct rgb_image *image, struct scene *scene,
+                             struct dvec3 *corners, size_t min_x,
+                             size_t width, double y)
+{
+    for (size_t i = 0; i <= width; i++)
+    {
+        double x = min_x + sampler_quincunx[1][0] + i;
+        struct ray ray = image_cast_ray(image, scene, x, y);
+        corners[i] = reflect(image, scene, &ray, CAMERA_PATH, x, y);
+    }
+}
+
+// the two rows of corners render_shaded_shared keeps, allocated once per
+// thread for the widest tile
+static __thread struct dvec3 *thread_corner_rows[2];
+
+/* Render a tile of pixels the same way as render_shaded, but trace each
+** pixel corner once: the four corner samples of a pixel are shared with
+** its neighbours, so only the center of each pixel and the corner grid of
+** the tile are traced, about two camera rays per pixel instead of five.
+** Corners are traced a row at a time, and samples are summed in the order
+** of sampler_quincunx, so that the image is the same as with render_shaded
+** and the quincunx sampler.
+*/
+static void render_shaded_shared(struct rgb_image *image,
+                                 struct scene *scene, size_t min_x,
+                                 size_t min_y, size_t width, size_t height)
+{
+    struct dvec3 *top = thread_corner_rows[0];
+    struct dvec3 *bottom = thread_corner_rows[1];
+    trace_corner_row(image, scene, top, min_x, width,
+                     min_y + sampler_quincunx[1][1]);
+
+    for (size_t y = min_y; y < min_y + height; y++)
+    {
+        trace_corner_row(image, scene, bottom, min_x, width,
+                         y + sampler_quincunx[2][1]);
+
+        for (size_t i = 0; i < width; i++)
+        {
+            size_t x = min_x + i;
+            struct ray ray = image_cast_ray(image, scene, x, y);
+            struct dvec3 samples[SAMPLER_QUINCUNX_COUNT] = {
+                reflect(image, scene, &ray, CAMERA_PATH, x, y),
+                top[i],
+                bottom[i],
+                top[i + 1],
+                bottom[i + 1],
+            };
+
+            struct dvec3 pix_color = {0};
+            for (short j = 0; j < SAMPLER_QUINCUNX_COUNT; j++)
+            {
+                struct dvec3 tmp
+                    = dvec3_div(&samples[j], SAMPLER_QUINCUNX_COUNT);
+                pix_color = dvec3_add(&pix_color, &tmp);
+            }
+            rgb_image_set(image, x, y, rgb_color_from_light(&pix_color));
+        }
+
+        struct dvec3 *swap = top;
+        top = bottom;
+        bottom = swap;
+    }
+}
+
+/* The rays of a wavefront at a given depth, one entry per path still
+** going, stored as separate arrays so that each stage loops over the
+** fields it needs only. Rays are only put together for scene traversal.
+*/
+struct wavefront_queue
+{
+    size_t count;
+    // the components of the origin and direction of rays
+    real *origin[3];
+    real *direction[3];
+    // the camera sample the path belongs to
+    uint32_t *samples;
+    double *throughput;
+};
+
+/* The closest hits of the rays of a queue, as found by traversal, which
+** are only resolved when shading them
+*/
+struct wavefront_hits
+{
+    // the distance to the hit, or INFINITY if there's none
+    double *dists;
+    uint32_t *prims;
+    double *u;
+    double *v;
+    // for instances, the primitive hit inside of them, and the distance to
+    // it along their own ray
+    uint32_t *inner_prims;
+    double *inner_dists;
+};
+
+/* Everything a wavefront needs for a tile, for all its camera samples
+*/
+struct wavefront
+{
+    // the samples of the current tile, and how many there is room for
+    size_t sample_count;
+    size_t capacity;
+    double *sample_x;
+    double *sample_y;
+
+    // the depth of the last vertex of each path, and for each depth, the
+    // color each path saw there, and the factor of the color of the next
+    // vertex
+    uint8_t *last_depth;
+    struct dvec3 *colors[NB_REC_REFLECTION];
+    double *factors[NB_REC_REFLECTION];
+
+    // the rays traced at the current depth, and the ones they reflect into
+    struct wavefront_queue queues[2];
+    struct wavefront_hits hits;
+};
+
+// the wavefront render_wavefront uses, allocated once per thread for the
+// largest tile
+static __thread struct wavefront thread_wavefront;
+
+static void wavefront_queue_init(struct wavefront_queue *queue,
+                                 size_t capacity)
+{
+    queue->count = 0;
+    for (size_t i = 0; i < 3; i++)
+    {
+        queue->origin[i] = xcalloc(capacity, sizeof(*queue->origin[i]));
+        queue->direction[i] = xcalloc(capacity, sizeof(*queue->direction[i]));
+    }
+    queue->samples = xcalloc(capacity, sizeof(*queue->samples));
+    queue->throughput = xcalloc(capacity, sizeof(*queue->throughput));
+}
+
+static void wavefront_queue_destroy(struct wavefront_queue *queue)
+{
+    for (size_t i = 0; i < 3; i++)
+    {
+        free(queue->origin[i]);
+        free(queue->direction[i]);
+    }
+    free(queue->samples);
+    free(queue->throughput);
+}
+
+/* Store a ray in the queue, at index i
+*/
+static void wavefront_queue_set_ray(struct wavefront_queue *queue, size_t i,
+                                    const struct ray *ray)
+{
+    queue->origin[0][i] = ray->source.x;
+    queue->origin[1][i] = ray->source.y;
+    queue->origin[2][i] = ray->source.z;
+    queue->direction[0][i] = ray->direction.x;
+    queue->direction[1][i] = ray->direction.y;
+    queue->direction[2][i] = ray->direction.z;
+}
+
+/* Return the ray of the queue at index i, as scene traversal takes it
+*/
+static struct ray wavefront_queue_ray(const struct wavefront_queue *queue,
+                                      size_t i)
+{
+    struct ray ray = {
+        .source = {queue->origin[0][i], queue->origin[1][i],
+                   queue->origin[2][i]},
+        .direction = {queue->direction[0][i], queue->direction[1][i],
+                      queue->direction[2][i]},
+    };
+    ray_update_inv_direction(&ray);
+    return ray;
+}
+
+static void wavefront_init(struct wavefront *wf, size_t sample_count)
+{
+    wf->sample_count = 0;
+    wf->capacity = sample_count;
+    wf->sample_x = xcalloc(sample_count, sizeof(*wf->sample_x));
+    wf->sample_y = xcalloc(sample_count, sizeof(*wf->sample_y));
+    wf->last_depth = xcalloc(sample_count, sizeof(*wf->last_depth));
+    for (size_t i = 0; i < NB_REC_REFLECTION; i++)
+    {
+        wf->colors[i] = xcalloc(sample_count, sizeof(*wf->colors[i]));
+        wf->factors[i] = xcalloc(sample_count, sizeof(*wf->factors[i]));
+    }
+    for (size_t i = 0; i < 2; i++)
+        wavefront_queue_init(&wf->queues[i], sample_count);
+
+    struct wavefront_hits *hits = &wf->hits;
+    hits->dists = xcalloc(sample_count, sizeof(*hits->dists));
+    hits->prims = xcalloc(sample_count, sizeof(*hits->prims));
+    hits->u = xcalloc(sample_count, sizeof(*hits->u));
+    hits->v = xcalloc(sample_count, sizeof(*hits->v));
+    hits->inner_prims = xcalloc(sample_count, sizeof(*hits->inner_prims));
+    hits->inner_dists = xcalloc(sample_count, sizeof(*hits->inner_dists));
+}
+
+static void wavefront_destroy(struct wavefront *wf)
+{
+    free(wf->sample_x);
+    free(wf->sample_y);
+    free(wf->last_depth);
+    for (size_t i = 0; i < NB_REC_REFLECTION; i++)
+    {
+        free(wf->colors[i]);
+        free(wf->factors[i]);
+    }
+    for (size_t i = 0; i < 2; i++)
+        wavefront_queue_destroy(&wf->queues[i]);
+
+    free(wf->hits.dists);
+    free(wf->hits.prims);
+    free(wf->hits.u);
+    free(wf->hits.v);
+    free(wf->hits.inner_prims);
+    free(wf->hits.inner_dists);
+    *wf = (struct wavefront){0};
+}
+
+/* Generate the camera rays of a tile, sample after sample, so that rays
+** next to each other in the queue belong to neighbouring pixels
+*/
+static void wavefront_generate(struct wavefront *wf, struct rgb_image *image,
+                               struct scene *scene, size_t min_x,
+                               size_t min_y, size_t width, size_t height)
+{
+    struct wavefront_queue *queue = &wf->queues[0];
+    size_t pixel_count = width * height;
+    for (size_t i = 0; i < wf->sample_count; i++)
+    {
+        size_t pixel = i % pixel_count;
+        size_t x = min_x + pixel % width;
+        size_t y = min_y + pixel / width;
+        double dx, dy;
+        sampler_offset(&aa_sampler, x, y, i / pixel_count, &dx, &dy);
+        wf->sample_x[i] = x + dx;
+        wf->sample_y[i] = y + dy;
+        struct ray ray = image_cast_ray(image, scene, wf->sample_x[i],
+                                        wf->sample_y[i]);
+        wavefront_queue_set_ray(queue, i, &ray);
+        queue->samples[i] = i;
+        queue->throughput[i] = 1;
+    }
+    queue->count = wf->sample_count;
+}
+
+/* Find the closest hit of all rays of a queue, by packets of rays which
+** are next to each other in the queue. Hits aren't resolved.
+*/
+static void wavefront_intersect(struct wavefront *wf, struct scene *scene,
+                                const struct wavefront_queue *queue)
+{
+    struct wavefront_hits *hits = &wf->hits;
+    for (size_t i = 0; i < queue->count; i += BVH_PACKET_MAX_SIZE)
+    {
+        size_t count = queue->count - i;
+        if (count > BVH_PACKET_MAX_SIZE)
+            count = BVH_PACKET_MAX_SIZE;
+
+        struct ray rays[BVH_PACKET_MAX_SIZE];
+        for (size_t j = 0; j < count; j++)
+            rays[j] = wavefront_queue_ray(queue, i + j);
+
+        struct scene_hit packet_hits[BVH_PACKET_MAX_SIZE];
+        scene_intersect_packet_hits(packet_hits, &hits->dists[i], scene, rays,
+                                    count);
+
+        for (size_t j = 0; j < count; j++)
+        {
+            hits->prims[i + j] = packet_hits[j].prim;
+            hits->u[i + j] = packet_hits[j].hit.u;
+            hits->v[i + j] = packet_hits[j].hit.v;
+            hits->inner_prims[i + j] = packet_hits[j].hit.inner_prim;
+            hits->inner_dists[i + j] = packet_hits[j].hit.inner_dist;
+        }
+    }
+}
+
+/* Shade the hits of the rays of a queue at the given depth, and push the
+** reflected rays of the paths which go on into the next queue. This does
+** what shade_hit does, one stage at a time. Hits are resolved here, and
+** phong materials, which all obj files use, are shaded without going
+** through the function pointer of materials.
+*/
+static void wavefront_shade(struct wavefront *wf, struct rgb_image *image,
+                            struct scene *scene, int depth,
+                            struct wavefront_queue *queue,
+                            struct wavefront_queue *next_queue)
+{
+    const struct wavefront_hits *hits = &wf->hits;
+    next_queue->count = 0;
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        uint32_t sample = queue->samples[i];
+        double x = wf->sample_x[sample];
+        double y = wf->sample_y[sample];
+        wf->last_depth[sample] = depth;
+
+        double dist = hits->dists[i];
+        if (isinf(dist))
+        {
+            wf->colors[depth][sample]
+                = get_procedural_pixel_vec(scene, image, x, y);
+            continue;
+        }
+
+        struct ray ray = wavefront_queue_ray(queue, i);
+        struct scene_hit hit = {
+            .prim = hits->prims[i],
+            .hit = {
+                .u = hits->u[i],
+                .v = hits->v[i],
+                .inner_prim = hits->inner_prims[i],
+                .inner_dist = hits->inner_dists[i],
+            },
+        };
+        struct object_intersection inter;
+        scene_resolve_hit(&inter, scene, &ray, dist, &hit);
+
+        struct phong_material *mat = (struct phong_material *)inter.material;
+        struct dvec3 pix_color;
+        if (mat->base.shade == phong_metarial_shade)
+            pix_color = phong_metarial_shade(&mat->base, &inter.location,
+                                             scene, &ray);
+        else
+            pix_color = mat->base.shade(&mat->base, &inter.location, scene,
+                                        &ray);
+        wf->colors[depth][sample] = pix_color;
+
+        struct path next = {
+            .depth = depth + 1,
+            .throughput = queue->throughput[i] * mat->spec_Ks,
+        };
+        double probability = bounce_probability(&next, x, y);
+        if (probability == 0)
+            continue;
+
+        get_reflect_ray(&ray, &inter);
+        size_t next_i = next_queue->count++;
+        wavefront_queue_set_ray(next_queue, next_i, &ray);
+        next_queue->samples[next_i] = sample;
+        next_queue->throughput[next_i] = next.throughput / probability;
+        wf->factors[depth][sample] = mat->spec_Ks / probability;
+    }
+}
+
+/* Render a tile of pixels the same way as render_shaded, but breadth first:
+** all camera rays of the tile are generated into a queue, which is then
+** intersected as a whole, and shaded as a whole, which fills the queue of
+** reflected rays, and so on until no path goes on. The colors seen along
+** paths are combined from the last vertex up at the end, in the same order
+** as the recursion of shade_hit, so that the image is the same.
+*/
+static void render_wavefront(struct rgb_image *image, struct scene *scene,
+                             size_t min_x, size_t min_y, size_t width,
+                             size_t height)
+{
+    size_t pixel_count = width * height;
+    struct wavefront *wf = &thread_wavefront;
+    wf->sample_count = pixel_count * aa_spp;
+    assert(wf->sample_count <= wf->capacity);
+
+    wavefront_generate(wf, image, scene, min_x, min_y, width, height);
+    thread_path_count += wf->sample_count;
+
+    for (int depth = 0; wf->queues[depth % 2].count != 0; depth++)
+    {
+        struct wavefront_queue *queue = &wf->queues[depth % 2];
+        if (depth != 0)
+            thread_bounce_count += queue->count;
+        wavefront_intersect(wf, scene, queue);
+        wavefront_shade(wf, image, scene, depth, queue,
+                        &wf->queues[(depth + 1) % 2]);
+    }
+
+    for (size_t pixel = 0; pixel < pixel_count; pixel++)
+    {
+        struct dvec3 pix_color = {0};
+        for (size_t i = 0; i < aa_spp; i++)
+        {
+            size_t sample = i * pixel_count + pixel;
+            int depth = wf->last_depth[sample];
+            struct dvec3 color = wf->colors[depth][sample];
+            while (depth-- > 0)
+            {
+                struct dvec3 tmp
+                    = dvec3_mul(&color, wf->factors[depth][sample]);
+                color = dvec3_add(&tmp, &wf->colors[depth][sample]);
+            }
+
+            struct dvec3 tmp = dvec3_div(&color, aa_spp);
+            pix_color = dvec3_add(&pix_color, &tmp);
+        }
+        rgb_image_set(image, min_x + pixel % width, min_y + pixel / width,
+                      rgb_color_from_light(&pix_color));
+    }
+}
+
+/* Return the offset of the nth sample of adaptive antialiasing, from the
+** pixel center. Samples come from the selected sampler, unless it's the
+** quincunx one, which doesn't have enough: the first sample is then the
+** center itself, and the next ones follow the R2 low discrepancy sequence,
+** which covers the pixel evenly whatever the sample count.
+*/
+static void adaptive_sample_offset(size_t x, size_t y, size_t n, double *dx,
+                                   double *dy)
+{
+    if (aa_sampler.type != SAMPLER_QUINCUNX)
+    {
+        sampler_offset(&aa_sampler, x, y, n, dx, dy);
+        return;
+    }
+
+    // the inverses of the plastic number and its square
+    const double alpha_x = 0.7548776662466927;
+    const double alpha_y = 0.5698402909980532;
+    double u = 0.5 + alpha_x * n;
+    double v = 0.5 + alpha_y * n;
+    *dx = u - floor(u) - 0.5;
+    *dy = v - floor(v) - 0.5;
+}
+
+/* The samples of a pixel traced by adaptive antialiasing so far, and the
+** running mean and sum of squared differences of its gamma encoded
+** channels, as of Welford's method
+*/
+struct adaptive_pixel
+{
+    struct dvec3 sum;
+    double mean[3];
+    double m2[3];
+    size_t n;
+};
+
+// the pixels of the tile and ring render_adaptive samples, the standard
+// error of each one and whether it sits on an edge, allocated once per thread
+// for the largest ring
+static __thread struct adaptive_pixel *thread_adaptive_pixels;
+static __thread double *thread_adaptive_errors;
+static __thread bool *thread_adaptive_edges;
+
+/* Trace the next sample of a pixel, and return the standard error of the
+** mean of its gamma encoded channels, the highest of the three
+*/
+static double adaptive_sample(struct rgb_image *image, struct scene *scene,
+                              struct adaptive_pixel *pixel, size_t x,
+                              size_t y)
+{
+    double dx, dy;
+    adaptive_sample_offset(x, y, pixel->n, &dx, &dy);
+    struct ray ray = image_cast_ray(image, scene, x + dx, y + dy);
+    struct dvec3 light
+        = reflect(image, scene, &ray, CAMERA_PATH, x + dx, y + dy);
+    pixel->sum = dvec3_add(&pixel->sum, &light);
+    size_t n = ++pixel->n;
+
+    // the variance can't be estimated from a single sample
+    double error = n < 2 ? INFINITY : 0;
+    double channels[3] = {light.x, light.y, light.z};
+    for (size_t i = 0; i < 3; i++)
+    {
+        double value = gamma_compress(channels[i]);
+        double delta = value - pixel->mean[i];
+        pixel->mean[i] += delta / n;
+        pixel->m2[i] += delta * (value - pixel->mean[i]);
+
+        // the variance of the mean is that of samples divided by n
+        if (n >= 2)
+            error = fmax(error, sqrt(pixel->m2[i] / (n - 1) / n));
+    }
+    return error;
+}
+
+/* Return whether two pixels differ by more than the contrast threshold on
+** any channel
+*/
+static bool adaptive_contrasted(const struct adaptive_pixel *a,
+                                const struct adaptive_pixel *b)
+{
+    double limit = adaptive_aa.threshold * ADAPTIVE_CONTRAST_SCALE;
+    for (size_t i = 0; i < 3; i++)
+        if (fabs(a->mean[i] - b->mean[i]) > limit)
+            return true;
+    return false;
+}
+
+/* Render a tile using as many samples per pixel as it takes for colors to
+** converge. All pixels first get min_spp samples, along with a ring of
+** pixels around the tile, so that edges are found across tiles as well.
+** Pixels which contrast with a neighbour, and may thus sit on an edge that
+** their first samples all missed, then get at least a quarter of max_spp.
+** Pixels keep getting samples until the standard error of their mean
+** drops below the threshold, or max_spp is reached. Flat areas thus stop
+** after min_spp samples, while edges and noisy areas get up to max_spp.
+*/
+static void render_adaptive(struct rgb_image *image, struct scene *scene,
+                            size_t min_x, size_t min_y, size_t width,
+                            size_t height)
+{
+    // the tile and its ring, clipped to the image
+    size_t ring_min_x = min_x == 0 ? 0 : min_x - 1;
+    size_t ring_min_y = min_y == 0 ? 0 : min_y - 1;
+    size_t ring_max_x = min_x + width < image->width ? min_x + width + 1
+                                                     : image->width;
+    size_t ring_max_y = min_y + height < image->height ? min_y + height + 1
+                                                       : image->height;
+    size_t ring_width = ring_max_x - ring_min_x;
+    size_t ring_height = ring_max_y - ring_min_y;
+    struct adaptive_pixel *pixels = thread_adaptive_pixels;
+    double *errors = thread_adaptive_errors;
+    memset(pixels, 0, ring_width * ring_height * sizeof(*pixels));
+
+    for (size_t y = ring_min_y; y < ring_max_y; y++)
+        for (size_t x = ring_min_x; x < ring_max_x; x++)
+        {
+            size_t i = (y - ring_min_y) * ring_width + x - ring_min_x;
+            while (pixels[i].n < adaptive_aa.min_spp)
+                errors[i] = adaptive_sample(image, scene, &pixels[i], x, y);
+        }
+
+    // edges are all found from the first samples, before any pixel gets
+    // more, so that they don't depend on where tile borders fall
+    bool *edges = thread_adaptive_edges;
+    for (size_t y = min_y; y < min_y + height; y++)
+        for (size_t x = min_x; x < min_x + width; x++)
+        {
+            size_t i = (y - ring_min_y) * ring_width + x - ring_min_x;
+            const struct adaptive_pixel *pixel = &pixels[i];
+            edges[i] = (x > ring_min_x
+                        && adaptive_contrasted(pixel, &pixel[-1]))
+                       || (x + 1 < ring_max_x
+                           && adaptive_contrasted(pixel, &pixel[1]))
+                       || (y > ring_min_y
+                           && adaptive_contrasted(pixel,
+                                                  &pixel[-ring_width]))
+                       || (y + 1 < ring_max_y
+                           && adaptive_contrasted(pixel,
+                                                  &pixel[ring_width]));
+        }
+
+    size_t edge_spp = adaptive_aa.max_spp / 4;
+    for (size_t y = min_y; y < min_y + height; y++)
+        for (size_t x = min_x; x < min_x + width; x++)
+        {
+            size_t i = (y - ring_min_y) * ring_width + x - ring_min_x;
+            struct adaptive_pixel *pixel = &pixels[i];
+            double error = errors[i];
+            while (pixel->n < adaptive_aa.max_spp
+                   && (error > adaptive_aa.threshold
+                       || (edges[i] && pixel->n < edge_spp)))
+                error = adaptive_sample(image, scene, pixel, x, y);
+
+            adaptive_aa.pixel_spp[y * image->width + x] = pixel->n;
+            struct dvec3 pix_color = dvec3_div(&pixel->sum, pixel->n);
+            rgb_image_set(image, x, y, rgb_color_from_light(&pix_color));
+        }
+
+    size_t ring_samples = (ring_width * ring_height - width * height)
+                          * adaptive_aa.min_spp;
+    pthread_mutex_lock(&adaptive_aa.lock);
+    adaptive_aa.ring_samples += ring_samples;
+    pthread_mutex_unlock(&adaptive_aa.lock);
+}
+
 /* For all the pixels of the image, try to find the closest object
 ** intersecting the camera ray. If an object is found, shade the pixel to
 ** find its color.
@@ -256,7 +1164,7 @@ static void render_normals(struct rgb_image *image, struct scene *scene,
     }
 
     struct material *mat = closest_intersection.material;
-    struct vec3 pix_color = normal_material.shade(
+    struct dvec3 pix_color = normal_material.shade(
         mat, &closest_intersection.location, scene, &ray);
     rgb_image_set(image, x, y, rgb_color_from_light(&pix_color));
 }
@@ -270,9 +1178,10 @@ static void render_distances(struct rgb_image *image, struct scene *scene,
 {
     struct ray ray = image_cast_ray(image, scene, x, y);
 
-    struct object_intersection closest_intersection;
+    // only the distance is needed, so the hit isn't resolved
+    struct scene_hit closest_hit;
     double closest_intersection_dist
-        = scene_intersect_ray(&closest_intersection, scene, &ray);
+        = scene_intersect_hit(&closest_hit, scene, &ray);
 
     // if the intersection distance is infinite, do not shade the pixel
     if (isinf(closest_intersection_dist))
@@ -293,91 +1202,190 @@ static void render_distances(struct rgb_image *image, struct scene *scene,
     rgb_image_set(image, x, y, pix_color);
 }
 
-/* Worker for threads
+/* What a tile of the image is rendered with
 */
-struct worker_args
+struct render_args
 {
     render_mode_f renderer;
+    // when packet_width isn't zero, tiles of packet_width pixels squared are
+    // rendered at once by tile_renderer
+    render_tile_f tile_renderer;
+    size_t packet_width;
+    // when set, whole tiles are rendered at once by whole_tile_renderer
+    render_tile_f whole_tile_renderer;
     struct rgb_image *image;
     struct scene *scene;
-    size_t min_y;
-    size_t max_y;
+    size_t tile_size;
+    struct rgb_pixel clear_color;
 };
 
-/* Init worker_args structure
+/* Allocate the buffers the whole tile renderer of the render_args pointed
+** to by data needs, for the largest tiles, on the calling thread
+** Executed once by each thread of the pool before rendering, so that
+** tiles reuse them
 */
-static struct worker_args *init_worker_args(render_mode_f renderer,
-                                            struct rgb_image *image,
-                                            struct scene *scene,
-                                            size_t line_per_process,
-                                            size_t i)
+static void tile_buffers_alloc(void *data, size_t thread_i)
 {
-    struct worker_args *wa = malloc(sizeof(struct worker_args));
-
-    if (wa == NULL)
-        err(1, "Not enough memory");
-
-    wa->renderer = renderer;
-    wa->image = image;
-    wa->scene = scene;
+    (void)thread_i;
+    struct render_args *ra = data;
+    if (ra->whole_tile_renderer == render_shaded_shared)
+        for (size_t i = 0; i < 2; i++)
+            thread_corner_rows[i] = xcalloc(ra->tile_size + 1,
+                                            sizeof(*thread_corner_rows[i]));
+    else if (ra->whole_tile_renderer == render_adaptive)
+    {
+        size_t ring_size = (ra->tile_size + 2) * (ra->tile_size + 2);
+        thread_adaptive_pixels
+            = xcalloc(ring_size, sizeof(*thread_adaptive_pixels));
+        thread_adaptive_errors
+            = xcalloc(ring_size, sizeof(*thread_adaptive_errors));
+        thread_adaptive_edges
+            = xcalloc(ring_size, sizeof(*thread_adaptive_edges));
+    }
+    else if (ra->whole_tile_renderer == render_wavefront)
+        wavefront_init(&thread_wavefront,
+                       ra->tile_size * ra->tile_size * aa_spp);
+}
 
-    // min_y is the line where the process will begin to throw rays
-    wa->min_y = i * line_per_process;
+/* Free the buffers of tile_buffers_alloc
+** Executed once by each thread of the pool after rendering
+*/
+static void tile_buffers_free(void *data, size_t thread_i)
+{
+    (void)data;
+    (void)thread_i;
+    for (size_t i = 0; i < 2; i++)
+    {
+        free(thread_corner_rows[i]);
+        thread_corner_rows[i] = NULL;
+    }
+    free(thread_adaptive_pixels);
+    free(thread_adaptive_errors);
+    free(thread_adaptive_edges);
+    thread_adaptive_pixels = NULL;
+    thread_adaptive_errors = NULL;
+    thread_adaptive_edges = NULL;
+    wavefront_destroy(&thread_wavefront);
+}
 
-    // max_y - 1 is the last line where the process will throw rays
-    // If it is the last process to be start, take all the last lines
-    if (image->height - (i + 1) * line_per_process < line_per_process)
-        wa->max_y = image->height;
+/* Throw rays in a tile of the image
+** Executed by the threads of the tile scheduler
+*/
+static void render_tile(void *data, size_t min_x, size_t min_y, size_t width,
+                        size_t height)
+{
+    struct render_args *ra = data;
+    size_t max_x = min_x + width;
+    size_t max_y = min_y + height;
+
+    size_t step = ra->packet_width;
+    if (ra->whole_tile_renderer != NULL)
+        ra->whole_tile_renderer(ra->image, ra->scene, min_x, min_y, width,
+                                height);
+    else if (step != 0)
+    {
+        for (size_t y = min_y; y < max_y; y += step)
+            for (size_t x = min_x; x < max_x; x += step)
+            {
+                size_t packet_width = max_x - x;
+                size_t packet_height = max_y - y;
+                ra->tile_renderer(ra->image, ra->scene, x, y,
+                                  packet_width < step ? packet_width : step,
+                                  packet_height < step ? packet_height
+                                                       : step);
+            }
+    }
     else
-        wa->max_y = (i + 1) * line_per_process;
-
-    return wa;
+        for (size_t y = min_y; y < max_y; y++)
+            for (size_t x = min_x; x < max_x; x++)
+                ra->renderer(ra->image, ra->scene, x, y);
+
+    pthread_mutex_lock(&bounce_settings.lock);
+    bounce_settings.bounce_count += thread_bounce_count;
+    bounce_settings.path_count += thread_path_count;
+    pthread_mutex_unlock(&bounce_settings.lock);
+    thread_bounce_count = 0;
+    thread_path_count = 0;
 }
 
-/* Throw rays in its proper part delimited by min_y and max_y
-** Executed by a thread
+/* Clear a tile of the image to the color pointed to by data
+** Executed by the thread which will render the tile, so that its memory
+** gets placed on the NUMA node of that thread
 */
-static void *worker(void *args)
+static void clear_tile(void *data, size_t min_x, size_t min_y, size_t width,
+                       size_t height)
 {
-    struct worker_args* wa = args;
-
-    for (size_t y = wa->min_y; y < wa->max_y; y++)
-        for (size_t x = 0; x < wa->image->width; x++)
-            wa->renderer(wa->image, wa->scene, x, y);
-
-    free(args);
-    pthread_exit(NULL);
+    struct render_args *ra = data;
+    for (size_t y = min_y; y < min_y + height; y++)
+        for (size_t x = min_x; x < min_x + width; x++)
+            rgb_image_set(ra->image, x, y, ra->clear_color);
 }
 
-/* Render the image by callong a thread each line_per_process
+/* Render the image using the threads of the pool, which share its tiles
 */
 static void handle_renderer(render_mode_f renderer,
+                            render_tile_f tile_renderer,
+                            size_t packet_width,
+                            render_tile_f whole_tile_renderer,
                             struct rgb_image *image,
-                            struct scene *scene)
+                            struct scene *scene,
+                            size_t tile_size,
+                            struct thread_pool *pool)
 {
-    // Compute the number of process could be launch
-    // (= number of threads / 2 to do not use at 100% the cpu)
-    size_t nb_process = sysconf(_SC_NPROCESSORS_ONLN) / 2;
-    size_t line_per_process = image->height / nb_process;
-    pthread_t thrds[nb_process];
+    struct render_args ra = {
+        .renderer = renderer,
+        .tile_renderer = tile_renderer,
+        .packet_width = packet_width,
+        .whole_tile_renderer = whole_tile_renderer,
+        .image = image,
+        .scene = scene,
+        .tile_size = tile_size,
+    };
 
-    // Launch each process
-    for(size_t i = 0; i < nb_process; i++)
+    // set all the pixels of the image to black
+    tile_scheduler_first_touch(pool, image->width, image->height, tile_size,
+                               clear_tile, &ra);
+
+    struct tile_scheduler_stats stats;
+    thread_pool_run(pool, tile_buffers_alloc, &ra);
+    tile_scheduler_run(pool, image->width, image->height, tile_size,
+                       render_tile, &ra, &stats);
+    thread_pool_run(pool, tile_buffers_free, NULL);
+
+    double busy_time = 0;
+    for (size_t i = 0; i < stats.thread_count; i++)
+        busy_time += stats.threads[i].busy_time;
+    fprintf(stderr, "render: %zu tiles of %zu pixels in %.3f ms "
+            "(%zu threads, %.0f%% busy)\n", stats.tile_count, tile_size,
+            stats.wall_time * 1e3, stats.thread_count,
+            busy_time / (stats.wall_time * stats.thread_count) * 100);
+    for (size_t i = 0; i < stats.thread_count; i++)
+        fprintf(stderr, "  thread %zu: %zu tiles (%zu stolen), busy %.3f ms, "
+                "node %d\n", i, stats.threads[i].tile_count,
+                stats.threads[i].stolen_count,
+                stats.threads[i].busy_time * 1e3, stats.threads[i].node);
+    for (size_t i = 0; i < stats.node_count; i++)
     {
-        struct worker_args *wa = init_worker_args(renderer,
-                                                  image,
-                                                  scene,
-                                                  line_per_process,
-                                                  i);
-
-        if (pthread_create(&thrds[i], NULL, worker, (void *)wa) != 0)
-            err(1, "Fail to create thread");
+        const struct tile_node_stats *node = &stats.nodes[i];
+        if (node->thread_count == 0)
+            continue;
+        fprintf(stderr, "  node %zu: %zu threads, %zu tiles, %.2f Mpixels/s "
+                "per busy thread\n", i, node->thread_count, node->tile_count,
+                node->pixel_count / node->busy_time * 1e-6);
     }
+    tile_scheduler_stats_destroy(&stats);
+}
 
-    // Wait each process
-    for(size_t i = 0; i < nb_process; i++)
-        if (pthread_join(thrds[i], NULL) != 0)
-            err(1, "Fail to join thread");
+/* Return the whole tile renderer selected by an option, given the one
+** selected by previous options, as only one of them may be used
+*/
+static render_tile_f select_whole_tile_renderer(render_tile_f selected,
+                                                render_tile_f renderer)
+{
+    if (selected != NULL && selected != renderer)
+        errx(1, "only one of --share-corners, --wavefront and --adaptive "
+                "may be given");
+    return renderer;
 }
 
 int main(int argc, char *argv[])
@@ -385,20 +1393,26 @@ int main(int argc, char *argv[])
     int rc;
 
     if (argc < 3)
-        errx(1, "Usage: SCENE.obj OUTPUT.bmp [--normals] [--distances]");
+        errx(1, "Usage: SCENE.obj|SCENE.xyzr|SCENE.xyzrb OUTPUT.bmp "
+                "[--normals] [--distances] "
+                "[--accel=linear|bvh|bvh4|bvh8|qbvh] [--packets=4|8] "
+                "[--share-corners] [--wavefront] [--adaptive] [--min-spp=N] "
+                "[--max-spp=N] [--aa-threshold=X] "
+                "[--sampler=quincunx|halton|sobol|blue-noise] [--spp=N] "
+                "[--bounce-cutoff=none|X] [--russian-roulette] "
+                "[--bvh-builder=sweep|binned|spatial] "
+                "[--spatial-split-budget=X] [--instances=N] [--bench] "
+                "[--frames=N] [--rebuild-threshold=X] [--cache-dir=DIR] "
+                "[--threads=N] [--tile-size=N] [--pin-threads]");
 
     srand(time(NULL));
     struct scene scene;
     scene_init(&scene);
 
     // initialize the frame buffer (the buffer that will store the result of the
-    // rendering)
+    // rendering). It's cleared by the threads which render it
     struct rgb_image *image = rgb_image_alloc(1000, 1000);
 
-    // set all the pixels of the image to black
-    struct rgb_pixel bg_color = {0};
-    rgb_image_clear(image, &bg_color);
-
     // Init procedural background
     init_seed(50);
     generate_noise_map(image->width, image->height, 100);
@@ -408,21 +1422,342 @@ int main(int argc, char *argv[])
     // build the scene
     build_obj_scene(&scene, aspect_ratio);
 
-    if (load_obj(&scene, argv[1]))
-        return 41;
-
     // parse options
     render_mode_f renderer = render_shaded;
+    render_tile_f tile_renderer = render_shaded_tile;
+    size_t packet_width = 0;
+    render_tile_f whole_tile_renderer = NULL;
+    enum sampler_type sampler_type = SAMPLER_QUINCUNX;
+    enum scene_accel accel = SCENE_ACCEL_BVH;
+    bool bench = false;
+    size_t instance_count = 0;
+    size_t frame_count = 0;
+    const char *cache_dir = NULL;
+    // RT_THREADS and the processors available are only looked at without
+    // --threads
+    size_t thread_count = 0;
+    size_t tile_size = TILE_SCHEDULER_DEFAULT_SIZE;
+    bool pin_threads = false;
+    struct bvh_build_options build_options = {
+        .builder = BVH_BUILDER_BINNED,
+        .rebuild_threshold = 1.5,
+        .spatial_split_budget = 0.25,
+    };
     for (int i = 3; i < argc; i++)
     {
         if (strcmp(argv[i], "--normals") == 0)
+        {
             renderer = render_normals;
+            tile_renderer = NULL;
+        }
         else if (strcmp(argv[i], "--distances") == 0)
+        {
             renderer = render_distances;
+            tile_renderer = NULL;
+        }
+        else if (strcmp(argv[i], "--packets=4") == 0)
+            packet_width = 4;
+        else if (strcmp(argv[i], "--packets=8") == 0)
+            packet_width = 8;
+        else if (strncmp(argv[i], "--packets=", 10) == 0)
+            errx(1, "unsupported packet size: %s", argv[i] + 10);
+        else if (strcmp(argv[i], "--share-corners") == 0)
+            whole_tile_renderer = select_whole_tile_renderer(
+                whole_tile_renderer, render_shaded_shared);
+        else if (strcmp(argv[i], "--sampler=quincunx") == 0)
+            sampler_type = SAMPLER_QUINCUNX;
+        else if (strcmp(argv[i], "--sampler=halton") == 0)
+            sampler_type = SAMPLER_HALTON;
+        else if (strcmp(argv[i], "--sampler=sobol") == 0)
+            sampler_type = SAMPLER_SOBOL;
+        else if (strcmp(argv[i], "--sampler=blue-noise") == 0)
+            sampler_type = SAMPLER_BLUE_NOISE;
+        else if (strncmp(argv[i], "--sampler=", 10) == 0)
+            errx(1, "unknown sampler: %s", argv[i] + 10);
+        else if (strncmp(argv[i], "--spp=", 6) == 0)
+        {
+            char *end;
+            aa_spp = strtoul(argv[i] + 6, &end, 10);
+            if (*end != '\0' || aa_spp == 0)
+                errx(1, "invalid sample count: %s", argv[i] + 6);
+        }
+        else if (strcmp(argv[i], "--bounce-cutoff=none") == 0)
+            bounce_settings.cutoff = BOUNCE_CUTOFF_NONE;
+        else if (strncmp(argv[i], "--bounce-cutoff=", 16) == 0)
+        {
+            char *end;
+            bounce_settings.cutoff = BOUNCE_CUTOFF_THRESHOLD;
+            bounce_settings.threshold = strtod(argv[i] + 16, &end);
+            if (*end != '\0' || !(bounce_settings.threshold > 0))
+                errx(1, "invalid bounce cutoff: %s", argv[i] + 16);
+        }
+        else if (strcmp(argv[i], "--russian-roulette") == 0)
+            bounce_settings.roulette = true;
+        else if (strcmp(argv[i], "--wavefront") == 0)
+            whole_tile_renderer = select_whole_tile_renderer(
+                whole_tile_renderer, render_wavefront);
+        else if (strcmp(argv[i], "--adaptive") == 0)
+            whole_tile_renderer = select_whole_tile_renderer(
+                whole_tile_renderer, render_adaptive);
+        else if (strncmp(argv[i], "--min-spp=", 10) == 0)
+        {
+            char *end;
+            adaptive_aa.min_spp = strtoul(argv[i] + 10, &end, 10);
+            if (*end != '\0' || adaptive_aa.min_spp == 0)
+                errx(1, "invalid sample count: %s", argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--max-spp=", 10) == 0)
+        {
+            char *end;
+            adaptive_aa.max_spp = strtoul(argv[i] + 10, &end, 10);
+            if (*end != '\0' || adaptive_aa.max_spp == 0
+                || adaptive_aa.max_spp > ADAPTIVE_MAX_SPP)
+                errx(1, "invalid sample count: %s", argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--aa-threshold=", 15) == 0)
+        {
+            char *end;
+            adaptive_aa.threshold = strtod(argv[i] + 15, &end);
+            if (*end != '\0' || adaptive_aa.threshold < 0)
+                errx(1, "invalid antialiasing threshold: %s", argv[i] + 15);
+        }
+        else if (strcmp(argv[i], "--accel=linear") == 0)
+            accel = SCENE_ACCEL_LINEAR;
+        else if (strcmp(argv[i], "--accel=bvh") == 0)
+            accel = SCENE_ACCEL_BVH;
+        else if (strcmp(argv[i], "--accel=bvh4") == 0)
+            accel = SCENE_ACCEL_BVH4;
+        else if (strcmp(argv[i], "--accel=bvh8") == 0)
+            accel = SCENE_ACCEL_BVH8;
+        else if (strcmp(argv[i], "--accel=qbvh") == 0)
+            accel = SCENE_ACCEL_QBVH;
+        else if (strncmp(argv[i], "--accel=", 8) == 0)
+            errx(1, "unknown acceleration structure: %s", argv[i] + 8);
+        else if (strcmp(argv[i], "--bvh-builder=sweep") == 0)
+            build_options.builder = BVH_BUILDER_SWEEP;
+        else if (strcmp(argv[i], "--bvh-builder=binned") == 0)
+            build_options.builder = BVH_BUILDER_BINNED;
+        else if (strcmp(argv[i], "--bvh-builder=spatial") == 0)
+            build_options.builder = BVH_BUILDER_SPATIAL;
+        else if (strncmp(argv[i], "--bvh-builder=", 14) == 0)
+            errx(1, "unknown bvh builder: %s", argv[i] + 14);
+        else if (strncmp(argv[i], "--instances=", 12) == 0)
+        {
+            char *end;
+            instance_count = strtoul(argv[i] + 12, &end, 10);
+            if (*end != '\0' || instance_count == 0)
+                errx(1, "invalid instance count: %s", argv[i] + 12);
+        }
+        else if (strcmp(argv[i], "--bench") == 0)
+            bench = true;
+        else if (strncmp(argv[i], "--frames=", 9) == 0)
+        {
+            char *end;
+            frame_count = strtoul(argv[i] + 9, &end, 10);
+            if (*end != '\0' || frame_count == 0)
+                errx(1, "invalid frame count: %s", argv[i] + 9);
+        }
+        else if (strncmp(argv[i], "--cache-dir=", 12) == 0)
+            cache_dir = argv[i] + 12;
+        else if (strncmp(argv[i], "--spatial-split-budget=", 23) == 0)
+        {
+            char *end;
+            build_options.spatial_split_budget = strtod(argv[i] + 23, &end);
+            // NaN isn't below zero, and infinity can't bound duplication
+            if (*end != '\0' || !(build_options.spatial_split_budget >= 0)
+                || !isfinite(build_options.spatial_split_budget))
+                errx(1, "invalid spatial split budget: %s", argv[i] + 23);
+        }
+        else if (strncmp(argv[i], "--rebuild-threshold=", 20) == 0)
+        {
+            char *end;
+            build_options.rebuild_threshold = strtod(argv[i] + 20, &end);
+            // below 1, or NaN, frames would always or never be rebuilt
+            if (*end != '\0' || !(build_options.rebuild_threshold >= 1))
+                errx(1, "invalid rebuild threshold: %s", argv[i] + 20);
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            thread_count = cpu_parse_worker_count(argv[i] + 10);
+            if (thread_count == 0)
+                errx(1, "invalid thread count: %s", argv[i] + 10);
+        }
+        else if (strcmp(argv[i], "--pin-threads") == 0)
+            pin_threads = true;
+        else if (strncmp(argv[i], "--tile-size=", 12) == 0)
+        {
+            char *end;
+            tile_size = strtoul(argv[i] + 12, &end, 10);
+            if (*end != '\0' || tile_size == 0)
+                errx(1, "invalid tile size: %s", argv[i] + 12);
+        }
+    }
+
+    if (thread_count == 0)
+        thread_count = cpu_worker_count();
+
+    if (frame_count != 0 && (!bench || instance_count != 0))
+        errx(1, "--frames requires --bench, and doesn't support instances");
+
+    // sphere clouds are loaded instead of obj files
+    bool sphere_cloud = is_xyzr_file(argv[1]);
+    if (sphere_cloud && (instance_count != 0 || frame_count != 0))
+        errx(1, "sphere clouds support neither --instances nor --frames");
+
+    if (packet_width != 0 && tile_renderer == NULL)
+        errx(1, "--packets is only supported when shading");
+    if (sampler_type == SAMPLER_QUINCUNX && aa_spp > SAMPLER_QUINCUNX_COUNT)
+        errx(1, "the quincunx sampler has at most %d samples per pixel",
+             SAMPLER_QUINCUNX_COUNT);
+    if (whole_tile_renderer == render_shaded_shared
+        && (sampler_type != SAMPLER_QUINCUNX
+            || aa_spp != SAMPLER_QUINCUNX_COUNT))
+        errx(1, "--share-corners requires all samples of the quincunx "
+                "sampler");
+    if (bounce_settings.roulette
+        && bounce_settings.cutoff == BOUNCE_CUTOFF_NONE)
+        errx(1, "--russian-roulette requires a --bounce-cutoff");
+    if (adaptive_aa.min_spp > adaptive_aa.max_spp)
+        errx(1, "--min-spp can't be larger than --max-spp");
+
+    if (whole_tile_renderer != NULL
+        && (tile_renderer == NULL || packet_width != 0))
+        errx(1, "--share-corners, --wavefront and --adaptive are only "
+                "supported when shading, without packets");
+    if (packet_width != 0 && tile_size % packet_width != 0)
+        errx(1, "the tile size must be a multiple of the packet size");
+
+    // loading, building and rendering all run on the same threads
+    struct thread_pool *pool = thread_pool_create(thread_count, pin_threads);
+    build_options.pool = pool;
+
+    // when rendering a single copy of the obj file, its meshes and
+    // acceleration structure may be loaded from the cache
+    struct accel_cache *cache = NULL;
+    if (cache_dir != NULL && instance_count == 0 && !sphere_cloud && !bench)
+    {
+        double load_start = timer_now();
+        cache = accel_cache_load(&scene, cache_dir, argv[1], accel,
+                                 &build_options);
+        if (cache != NULL)
+            fprintf(stderr, "acceleration structure: %zu primitives "
+                    "loaded from the cache in %.3f ms\n",
+                    scene.prims.prim_count,
+                    (timer_now() - load_start) * 1e3);
     }
 
+    // either load the meshes right into the scene, or share them between
+    // instances
+    if (instance_count != 0)
+    {
+        struct object_group *group = load_obj_group(argv[1], &build_options);
+        if (group == NULL)
+            return 41;
+
+        place_instances(&scene, group, instance_count);
+        fprintf(stderr, "instances: %zu of %zu triangles\n", instance_count,
+                group->prims.prim_count);
+        object_group_put(group);
+    }
+    else if (sphere_cloud)
+    {
+        double load_start = timer_now();
+        struct sphere_cloud *cloud = load_xyzr(argv[1], &build_options);
+        if (cloud == NULL)
+            return 41;
+
+        object_vect_push(&scene.objects, &cloud->base);
+        frame_camera(&scene, &cloud->bounds);
+        fprintf(stderr, "sphere cloud: %zu spheres loaded in %.3f ms, "
+                "%.1f MiB\n", cloud->sphere_count,
+                (timer_now() - load_start) * 1e3,
+                sphere_cloud_memory(cloud) / (1024. * 1024.));
+    }
+    else if (cache == NULL && load_obj(&scene, argv[1]))
+        return 41;
+
+    // compare acceleration structures instead of rendering
+    if (bench)
+    {
+        if (frame_count == 0)
+        {
+            bench_triangles(BENCH_TRIANGLE_COUNT, BENCH_TRIANGLE_RAY_COUNT);
+            printf("\n");
+            bench_accels(&scene, &build_options, image->width,
+                         image->height);
+            printf("\n");
+            bench_packets(&scene, &build_options, image->width,
+                          image->height);
+        }
+        else
+        {
+            // compare refitting to rebuilding over an animation
+            struct turntable turntable;
+            turntable_init(&turntable, &scene, frame_count);
+            bench_refit(&scene, &build_options, accel, frame_count,
+                        turntable_animate, &turntable, image->width,
+                        image->height);
+            free(turntable.rest_vertices);
+        }
+
+        thread_pool_destroy(pool);
+        scene_destroy(&scene);
+        free_noise_map();
+        free(image);
+        return 0;
+    }
+
+    // build the acceleration structure
+    if (cache == NULL)
+    {
+        double build_start = timer_now();
+        scene_build_accel(&scene, accel, &build_options);
+        double build_time = timer_now() - build_start;
+        if (accel != SCENE_ACCEL_LINEAR)
+        {
+            size_t prim_count = scene.prims.prim_count;
+            fprintf(stderr,
+                    "acceleration structure: %zu primitives in %.3f ms "
+                    "(%.2f Mprims/s, %zu threads)\n",
+                    prim_count, build_time * 1e3,
+                    prim_count / build_time * 1e-6, pool->thread_count);
+        }
+
+        if (cache_dir != NULL && instance_count == 0 && !sphere_cloud
+            && accel != SCENE_ACCEL_LINEAR
+            && accel_cache_store(&scene, cache_dir, argv[1], &build_options))
+            warnx("the scene couldn't be cached");
+    }
+
+    print_mesh_memory(&scene);
+
     // render all pixels
-    handle_renderer(renderer, image, &scene);
+    sampler_init(&aa_sampler, sampler_type, 0);
+    if (whole_tile_renderer == render_adaptive)
+        adaptive_aa.pixel_spp = xcalloc(image->width * image->height,
+                                        sizeof(*adaptive_aa.pixel_spp));
+    handle_renderer(renderer, tile_renderer, packet_width,
+                    whole_tile_renderer, image, &scene, tile_size, pool);
+    thread_pool_destroy(pool);
+    sampler_destroy(&aa_sampler);
+
+    if (bounce_settings.path_count != 0)
+        fprintf(stderr, "reflections: %.3f bounces per camera path\n",
+                (double)bounce_settings.bounce_count
+                    / bounce_settings.path_count);
+
+    if (whole_tile_renderer == render_adaptive)
+    {
+        size_t pixel_count = image->width * image->height;
+        size_t sample_count = 0;
+        for (size_t i = 0; i < pixel_count; i++)
+            sample_count += adaptive_aa.pixel_spp[i];
+        fprintf(stderr, "adaptive antialiasing: %.2f samples per pixel, "
+                "%.2f with tile rings\n", (double)sample_count / pixel_count,
+                (double)(sample_count + adaptive_aa.ring_samples)
+                    / pixel_count);
+        free(adaptive_aa.pixel_spp);
+    }
 
     // write the rendered image to a bmp file
     FILE *fp = fopen(argv[2], "w");
@@ -434,6 +1769,7 @@ int main(int argc, char *argv[])
 
     // release resources
     scene_destroy(&scene);
+    accel_cache_close(cache);
     free_noise_map();
     free(image);
     return rc;
@@ -0,0 +1,637 @@
+#include "accel_cache.h"
+#include "mesh.h"
+#include "phong_material.h"
+#include "utils/align.h"
+#include "utils/alloc.h"
+#include "utils/hash.h"
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// must be bumped whenever the file layout or the output of builders change
+#define ACCEL_CACHE_VERSION 3
+
+static const char accel_cache_magic[8] = "RTACCEL";
+
+// sections are aligned on cache lines
+#define ACCEL_CACHE_ALIGN 64
+
+/*
+** The header of cache files. Sections are referred to using their offset
+** from the start of the file, so that files can be mapped anywhere.
+*/
+struct cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;
+    uint32_t vertex_size;
+    uint32_t padding;
+    // the hash of the obj file, its material libraries and build options
+    uint64_t key;
+    uint64_t file_size;
+
+    uint64_t material_count;
+    uint64_t mesh_count;
+    // the totals over all meshes
+    uint64_t vertex_count;
+    uint64_t face_count;
+    // the number of primitive indices, which is larger than the number of
+    // faces when leaves share faces
+    uint64_t ref_count;
+    uint64_t node_count;
+    double build_cost;
+
+    uint64_t material_offset;
+    uint64_t mesh_offset;
+    uint64_t vertex_offset;
+    uint64_t index_offset;
+    uint64_t face_material_offset;
+    uint64_t node_offset;
+    uint64_t prim_offset;
+};
+
+struct cache_material
+{
+    double surface_color[3];
+    double diffuse_Kn;
+    double spec_n;
+    double spec_Ks;
+    double ambient_intensity;
+};
+
+/*
+** The vertices, indices and face materials of meshes are stored one mesh
+** after the other. Indices are relative to the mesh, and face materials
+** refer to the materials of the file.
+*/
+struct cache_mesh
+{
+    uint64_t vertex_count;
+    uint64_t face_count;
+};
+
+static uint64_t hash_file(uint64_t hash, const char *path)
+{
+    // missing files hash differently from empty ones
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return hash_bytes(hash, "missing", 7);
+
+    char buf[BUFSIZ];
+    size_t size;
+    while ((size = fread(buf, 1, sizeof(buf), fp)) > 0)
+        hash = hash_bytes(hash, buf, size);
+    fclose(fp);
+    return hash;
+}
+
+/*
+** Hashes the material libraries referenced by the obj file. Those are looked
+** up next to the obj file, as the loader does.
+*/
+static uint64_t hash_material_libs(uint64_t hash, const char *obj_path)
+{
+    FILE *fp = fopen(obj_path, "r");
+    if (fp == NULL)
+        return hash;
+
+    char *dir_buf = strdup(obj_path);
+    const char *dir = dirname(dir_buf);
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, fp) != -1)
+    {
+        if (strncmp(line, "mtllib", 6) != 0 || (line[6] != ' '
+                                                 && line[6] != '\t'))
+            continue;
+
+        char *name = line + 7;
+        name += strspn(name, " \t");
+        name[strcspn(name, "\r\n")] = '\0';
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        hash = hash_bytes(hash, name, strlen(name));
+        hash = hash_file(hash, path);
+    }
+
+    free(line);
+    free(dir_buf);
+    fclose(fp);
+    return hash;
+}
+
+static uint64_t cache_key(const char *obj_path,
+                          const struct bvh_build_options *options)
+{
+    uint64_t hash = HASH_INIT;
+    uint32_t version = ACCEL_CACHE_VERSION;
+    hash = hash_bytes(hash, &version, sizeof(version));
+    // single and double precision builds lay out nodes differently, and
+    // keep separate files rather than overwriting each other's
+    uint32_t layout[2] = {sizeof(real), sizeof(struct bvh_node)};
+    hash = hash_bytes(hash, layout, sizeof(layout));
+    // the thread count doesn't change the tree, but the builder does
+    uint32_t builder = options->builder;
+    hash = hash_bytes(hash, &builder, sizeof(builder));
+    if (options->builder == BVH_BUILDER_SPATIAL)
+        hash = hash_bytes(hash, &options->spatial_split_budget,
+                          sizeof(options->spatial_split_budget));
+    hash = hash_file(hash, obj_path);
+    return hash_material_libs(hash, obj_path);
+}
+
+static void cache_path(char *path, size_t size, const char *cache_dir,
+                       uint64_t key)
+{
+    snprintf(path, size, "%s/%016" PRIx64 ".accel", cache_dir, key);
+}
+
+static bool section_valid(const struct cache_header *header, uint64_t offset,
+                          uint64_t count, size_t elem_size)
+{
+    if (offset % ACCEL_CACHE_ALIGN != 0 || offset > header->file_size)
+        return false;
+    return count <= (header->file_size - offset) / elem_size;
+}
+
+/*
+** Checks that a cache file is consistent, so that a corrupted or truncated
+** file can't cause out of bounds accesses.
+*/
+static bool cache_valid(const void *data, size_t size, uint64_t key)
+{
+    const struct cache_header *header = data;
+    if (size < sizeof(*header)
+        || memcmp(header->magic, accel_cache_magic, sizeof(header->magic))
+        || header->version != ACCEL_CACHE_VERSION
+        || header->node_size != sizeof(struct bvh_node)
+        || header->vertex_size != sizeof(struct vec3)
+        || header->key != key || header->file_size != size)
+        return false;
+
+    if (header->face_count == 0 || header->face_count > UINT32_MAX
+        || header->ref_count < header->face_count
+        || header->ref_count > UINT32_MAX || header->node_count == 0
+        || header->node_count > 2 * header->ref_count - 1
+        || header->face_count > UINT64_MAX / 3)
+        return false;
+
+    if (!section_valid(header, header->material_offset,
+                       header->material_count, sizeof(struct cache_material))
+        || !section_valid(header, header->mesh_offset, header->mesh_count,
+                          sizeof(struct cache_mesh))
+        || !section_valid(header, header->vertex_offset,
+                          header->vertex_count, sizeof(struct vec3))
+        || !section_valid(header, header->index_offset,
+                          3 * header->face_count, sizeof(uint32_t))
+        || !section_valid(header, header->face_material_offset,
+                          header->face_count, sizeof(uint32_t))
+        || !section_valid(header, header->node_offset, header->node_count,
+                          sizeof(struct bvh_node))
+        || !section_valid(header, header->prim_offset, header->ref_count,
+                          sizeof(uint32_t)))
+        return false;
+
+    const char *bytes = data;
+    const struct cache_mesh *meshes
+        = (const void *)(bytes + header->mesh_offset);
+    const uint32_t *indices = (const void *)(bytes + header->index_offset);
+    uint64_t vertex_count = 0;
+    uint64_t face_count = 0;
+    for (size_t i = 0; i < header->mesh_count; i++)
+    {
+        const struct cache_mesh *mesh = &meshes[i];
+        if (mesh->vertex_count > header->vertex_count - vertex_count
+            || mesh->face_count > header->face_count - face_count)
+            return false;
+
+        for (size_t index_i = 0; index_i < 3 * mesh->face_count; index_i++)
+            if (indices[3 * face_count + index_i] >= mesh->vertex_count)
+                return false;
+
+        vertex_count += mesh->vertex_count;
+        face_count += mesh->face_count;
+    }
+    if (vertex_count != header->vertex_count
+        || face_count != header->face_count)
+        return false;
+
+    const uint32_t *face_materials
+        = (const void *)(bytes + header->face_material_offset);
+    for (size_t i = 0; i < header->face_count; i++)
+        if (face_materials[i] >= header->material_count)
+            return false;
+
+    const uint32_t *prim_indices = (const void *)(bytes + header->prim_offset);
+    for (size_t i = 0; i < header->ref_count; i++)
+        if (prim_indices[i] >= header->face_count)
+            return false;
+
+    // children are always stored after their parent, which rules out cycles
+    // and allows computing depths in a single pass. traversals rely on the
+    // maximum depth
+    const struct bvh_node *nodes = (const void *)(bytes + header->node_offset);
+    uint8_t *depths = xcalloc(header->node_count, sizeof(*depths));
+    bool valid = true;
+    for (size_t i = 0; valid && i < header->node_count; i++)
+    {
+        const struct bvh_node *node = &nodes[i];
+        if (node->prim_count == 0)
+        {
+            valid = node->offset > i && node->offset < header->node_count - 1
+                    && depths[i] < BVH_MAX_DEPTH;
+            if (valid)
+                depths[node->offset] = depths[node->offset + 1]
+                    = depths[i] + 1;
+        }
+        else
+            valid = node->offset <= header->ref_count
+                    && node->prim_count <= header->ref_count - node->offset;
+    }
+    free(depths);
+    return valid;
+}
+
+static void cache_add_meshes(struct scene *scene, const char *bytes,
+                             const struct cache_header *header)
+{
+    const struct cache_material *cache_materials
+        = (const void *)(bytes + header->material_offset);
+    struct material **materials
+        = xcalloc(header->material_count, sizeof(*materials));
+    for (size_t i = 0; i < header->material_count; i++)
+    {
+        const struct cache_material *cache_mat = &cache_materials[i];
+        struct phong_material *mat = zalloc(sizeof(*mat));
+        phong_material_init(mat);
+        mat->surface_color = (struct dvec3){
+            cache_mat->surface_color[0],
+            cache_mat->surface_color[1],
+            cache_mat->surface_color[2],
+        };
+        mat->diffuse_Kn = cache_mat->diffuse_Kn;
+        mat->spec_n = cache_mat->spec_n;
+        mat->spec_Ks = cache_mat->spec_Ks;
+        mat->ambient_intensity = cache_mat->ambient_intensity;
+        materials[i] = &mat->base;
+    }
+
+    // all meshes share the materials of the file, as the loader does
+    const struct cache_mesh *cache_meshes
+        = (const void *)(bytes + header->mesh_offset);
+    const struct vec3 *vertices = (const void *)(bytes + header->vertex_offset);
+    const uint32_t *indices = (const void *)(bytes + header->index_offset);
+    const uint32_t *face_materials
+        = (const void *)(bytes + header->face_material_offset);
+    for (size_t i = 0; i < header->mesh_count; i++)
+    {
+        const struct cache_mesh *cache_mesh = &cache_meshes[i];
+        struct mesh *mesh
+            = mesh_create(cache_mesh->vertex_count, cache_mesh->face_count,
+                          materials, header->material_count);
+        memcpy(mesh->vertices, vertices,
+               mesh->vertex_count * sizeof(*mesh->vertices));
+        memcpy(mesh->indices, indices,
+               3 * mesh->face_count * sizeof(*mesh->indices));
+        memcpy(mesh->face_materials, face_materials,
+               mesh->face_count * sizeof(*mesh->face_materials));
+        object_vect_push(&scene->objects, &mesh->base);
+
+        vertices += mesh->vertex_count;
+        indices += 3 * mesh->face_count;
+        face_materials += mesh->face_count;
+    }
+
+    // release the reference counter of materials
+    for (size_t i = 0; i < header->material_count; i++)
+        material_put(materials[i]);
+    free(materials);
+}
+
+struct accel_cache *accel_cache_load(struct scene *scene,
+                                     const char *cache_dir,
+                                     const char *obj_path,
+                                     enum scene_accel accel,
+                                     const struct bvh_build_options *options)
+{
+    // primitive indices in the tree must match the order of the scene
+    assert(object_vect_size(&scene->objects) == 0);
+    if (accel == SCENE_ACCEL_LINEAR)
+        return NULL;
+
+    uint64_t key = cache_key(obj_path, options);
+    char path[PATH_MAX];
+    cache_path(path, sizeof(path), cache_dir, key);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // the mapping is private, so that refitting the tree doesn't write to
+    // the file
+    size_t size = st.st_size;
+    void *data
+        = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        warn("failed to map cache file %s", path);
+        return NULL;
+    }
+
+    if (!cache_valid(data, size, key))
+    {
+        warnx("ignoring invalid cache file %s", path);
+        munmap(data, size);
+        return NULL;
+    }
+
+    const struct cache_header *header = data;
+    char *bytes = data;
+    cache_add_meshes(scene, bytes, header);
+
+    struct bvh bvh = {
+        .nodes = (void *)(bytes + header->node_offset),
+        .node_count = header->node_count,
+        .prim_indices = (void *)(bytes + header->prim_offset),
+        .prim_count = header->face_count,
+        .ref_count = header->ref_count,
+        .build_cost = header->build_cost,
+        .borrowed = true,
+    };
+    scene_adopt_accel(scene, accel, &bvh);
+
+    struct accel_cache *cache = xalloc(sizeof(*cache));
+    cache->data = data;
+    cache->size = size;
+    return cache;
+}
+
+void accel_cache_close(struct accel_cache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    munmap(cache->data, cache->size);
+    free(cache);
+}
+
+/*
+** Returns the index of a material in the cache, adding it if needed.
+*/
+static uint32_t cache_material_index(struct phong_material ***materials,
+                                     size_t *material_count,
+                                     struct phong_material *mat)
+{
+    for (size_t i = *material_count; i-- > 0;)
+        if ((*materials)[i] == mat)
+            return i;
+
+    *materials
+        = xrealloc(*materials, (*material_count + 1) * sizeof(**materials));
+    (*materials)[*material_count] = mat;
+    return (*material_count)++;
+}
+
+static bool write_section(FILE *fp, const void *data, size_t size,
+                          uint64_t offset)
+{
+    static const char padding[ACCEL_CACHE_ALIGN] = {0};
+    size_t pos = ftell(fp);
+    assert(pos <= offset && offset - pos < ACCEL_CACHE_ALIGN);
+    return fwrite(padding, 1, offset - pos, fp) == offset - pos
+           && fwrite(data, 1, size, fp) == size;
+}
+
+/*
+** The buffers of all the meshes of a scene, one after the other.
+*/
+struct cache_buffers
+{
+    struct cache_mesh *meshes;
+    struct vec3 *vertices;
+    uint32_t *indices;
+    uint32_t *face_materials;
+    size_t vertex_count;
+    size_t face_count;
+};
+
+static void cache_buffers_destroy(struct cache_buffers *buffers)
+{
+    free(buffers->meshes);
+    free(buffers->vertices);
+    free(buffers->indices);
+    free(buffers->face_materials);
+}
+
+/*
+** Gathers the buffers of the meshes of the scene. Face materials are
+** translated to indices in materials, which are added as needed.
+** Returns false if the scene has anything but phong shaded meshes.
+*/
+static bool cache_gather_meshes(struct cache_buffers *buffers,
+                                struct phong_material ***materials,
+                                size_t *material_count, struct scene *scene)
+{
+    size_t mesh_count = object_vect_size(&scene->objects);
+    buffers->meshes = xcalloc(mesh_count, sizeof(*buffers->meshes));
+    buffers->vertex_count = 0;
+    buffers->face_count = 0;
+    for (size_t i = 0; i < mesh_count; i++)
+    {
+        struct object *obj = object_vect_get(&scene->objects, i);
+        if (obj->intersect != object_mesh_ray_intersect)
+            return false;
+
+        struct mesh *mesh = (struct mesh *)obj;
+        for (size_t mat_i = 0; mat_i < mesh->material_count; mat_i++)
+            if (mesh->materials[mat_i]->shade != phong_metarial_shade)
+                return false;
+
+        buffers->meshes[i].vertex_count = mesh->vertex_count;
+        buffers->meshes[i].face_count = mesh->face_count;
+        buffers->vertex_count += mesh->vertex_count;
+        buffers->face_count += mesh->face_count;
+    }
+
+    buffers->vertices
+        = xcalloc(buffers->vertex_count, sizeof(*buffers->vertices));
+    buffers->indices
+        = xcalloc(3 * buffers->face_count, sizeof(*buffers->indices));
+    buffers->face_materials
+        = xcalloc(buffers->face_count, sizeof(*buffers->face_materials));
+
+    struct vec3 *vertices = buffers->vertices;
+    uint32_t *indices = buffers->indices;
+    uint32_t *face_materials = buffers->face_materials;
+    for (size_t i = 0; i < mesh_count; i++)
+    {
+        struct mesh *mesh = (struct mesh *)object_vect_get(&scene->objects, i);
+        memcpy(vertices, mesh->vertices,
+               mesh->vertex_count * sizeof(*vertices));
+        memcpy(indices, mesh->indices, 3 * mesh->face_count * sizeof(*indices));
+        for (size_t face_i = 0; face_i < mesh->face_count; face_i++)
+        {
+            struct material *mat
+                = mesh->materials[mesh->face_materials[face_i]];
+            face_materials[face_i] = cache_material_index(
+                materials, material_count, (struct phong_material *)mat);
+        }
+
+        vertices += mesh->vertex_count;
+        indices += 3 * mesh->face_count;
+        face_materials += mesh->face_count;
+    }
+    return true;
+}
+
+int accel_cache_store(struct scene *scene, const char *cache_dir,
+                      const char *obj_path,
+                      const struct bvh_build_options *options)
+{
+    const struct bvh *bvh = &scene->bvh;
+    if (bvh->node_count == 0)
+        return -1;
+
+    // only scenes made of phong shaded meshes, as loaded from obj files, can
+    // be cached
+    struct cache_buffers buffers = {0};
+    struct phong_material **materials = NULL;
+    size_t material_count = 0;
+    if (!cache_gather_meshes(&buffers, &materials, &material_count, scene)
+        || bvh->prim_count != buffers.face_count)
+    {
+        cache_buffers_destroy(&buffers);
+        free(materials);
+        return -1;
+    }
+
+    struct cache_material *cache_materials
+        = xcalloc(material_count, sizeof(*cache_materials));
+    for (size_t i = 0; i < material_count; i++)
+    {
+        const struct phong_material *mat = materials[i];
+        cache_materials[i] = (struct cache_material){
+            .surface_color = {
+                mat->surface_color.x,
+                mat->surface_color.y,
+                mat->surface_color.z,
+            },
+            .diffuse_Kn = mat->diffuse_Kn,
+            .spec_n = mat->spec_n,
+            .spec_Ks = mat->spec_Ks,
+            .ambient_intensity = mat->ambient_intensity,
+        };
+    }
+    free(materials);
+
+    size_t mesh_count = object_vect_size(&scene->objects);
+    struct cache_header header = {
+        .version = ACCEL_CACHE_VERSION,
+        .node_size = sizeof(struct bvh_node),
+        .vertex_size = sizeof(struct vec3),
+        .key = cache_key(obj_path, options),
+        .material_count = material_count,
+        .mesh_count = mesh_count,
+        .vertex_count = buffers.vertex_count,
+        .face_count = buffers.face_count,
+        .ref_count = bvh->ref_count,
+        .node_count = bvh->node_count,
+        .build_cost = bvh->build_cost,
+    };
+    memcpy(header.magic, accel_cache_magic, sizeof(header.magic));
+
+    size_t material_size = material_count * sizeof(*cache_materials);
+    size_t mesh_size = mesh_count * sizeof(*buffers.meshes);
+    size_t vertex_size = buffers.vertex_count * sizeof(*buffers.vertices);
+    size_t index_size = 3 * buffers.face_count * sizeof(*buffers.indices);
+    size_t face_material_size
+        = buffers.face_count * sizeof(*buffers.face_materials);
+    size_t node_size = bvh->node_count * sizeof(*bvh->nodes);
+    size_t prim_size = bvh->ref_count * sizeof(*bvh->prim_indices);
+    header.material_offset = align_up(sizeof(header), ACCEL_CACHE_ALIGN);
+    header.mesh_offset = align_up(header.material_offset + material_size,
+                                  ACCEL_CACHE_ALIGN);
+    header.vertex_offset
+        = align_up(header.mesh_offset + mesh_size, ACCEL_CACHE_ALIGN);
+    header.index_offset
+        = align_up(header.vertex_offset + vertex_size, ACCEL_CACHE_ALIGN);
+    header.face_material_offset
+        = align_up(header.index_offset + index_size, ACCEL_CACHE_ALIGN);
+    header.node_offset
+        = align_up(header.face_material_offset + face_material_size,
+                   ACCEL_CACHE_ALIGN);
+    header.prim_offset
+        = align_up(header.node_offset + node_size, ACCEL_CACHE_ALIGN);
+    header.file_size = header.prim_offset + prim_size;
+
+    if (mkdir(cache_dir, 0777) == -1 && errno != EEXIST)
+        warn("failed to create cache directory %s", cache_dir);
+
+    // write to a temporary file first, so that concurrent runs never see a
+    // partially written cache file
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    cache_path(path, sizeof(path), cache_dir, header.key);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+
+    int rc = -1;
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL)
+        warn("failed to create cache file %s", tmp_path);
+    else
+    {
+        bool ok
+            = write_section(fp, &header, sizeof(header), 0)
+              && write_section(fp, cache_materials, material_size,
+                               header.material_offset)
+              && write_section(fp, buffers.meshes, mesh_size,
+                               header.mesh_offset)
+              && write_section(fp, buffers.vertices, vertex_size,
+                               header.vertex_offset)
+              && write_section(fp, buffers.indices, index_size,
+                               header.index_offset)
+              && write_section(fp, buffers.face_materials,
+                               face_material_size,
+                               header.face_material_offset)
+              && write_section(fp, bvh->nodes, node_size, header.node_offset)
+              && write_section(fp, bvh->prim_indices, prim_size,
+                               header.prim_offset);
+        if (fclose(fp) != 0)
+            ok = false;
+
+        if (ok && rename(tmp_path, path) == 0)
+            rc = 0;
+        else
+        {
+            warn("failed to write cache file %s", path);
+            unlink(tmp_path);
+        }
+    }
+
+    free(cache_materials);
+    cache_buffers_destroy(&buffers);
+    return rc;
+}
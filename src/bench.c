@@ -0,0 +1,524 @@
+#include "bench.h"
+#include "triangle.h"
+#include "triangle_block.h"
+#include "utils/alloc.h"
+#include "utils/cpu.h"
+#include "utils/timer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct bench_builder
+{
+    const char *name;
+    enum bvh_builder builder;
+};
+
+static const struct bench_builder bench_builders_list[] = {
+    {"binned", BVH_BUILDER_BINNED},
+    {"spatial", BVH_BUILDER_SPATIAL},
+};
+
+struct bench_accel
+{
+    const char *name;
+    enum scene_accel accel;
+};
+
+static const struct bench_accel bench_accels_list[] = {
+    {"bvh", SCENE_ACCEL_BVH},
+    {"bvh4", SCENE_ACCEL_BVH4},
+    {"bvh8", SCENE_ACCEL_BVH8},
+    {"qbvh", SCENE_ACCEL_QBVH},
+};
+
+static struct ray *bench_camera_rays(const struct scene *scene, size_t width,
+                                     size_t height)
+{
+    struct ray *rays = xcalloc(width * height, sizeof(*rays));
+    for (size_t y = 0; y < height; y++)
+        for (size_t x = 0; x < width; x++)
+            camera_cast_ray(&rays[y * width + x], &scene->camera,
+                            (double)x / width - 0.5, (double)y / height - 0.5);
+    return rays;
+}
+
+/*
+** Traces rays through the scene, and returns the time it took.
+*/
+static double bench_trace(struct scene *scene, const struct ray *rays,
+                          size_t ray_count)
+{
+    double trace_start = timer_now();
+    for (size_t ray_i = 0; ray_i < ray_count; ray_i++)
+    {
+        struct object_intersection inter;
+        scene_intersect_ray(&inter, scene, &rays[ray_i]);
+    }
+    return timer_now() - trace_start;
+}
+
+void bench_accels(struct scene *scene, const struct bvh_build_options *options,
+                  size_t width, size_t height)
+{
+    size_t ray_count = width * height;
+    struct ray *rays = bench_camera_rays(scene, width, height);
+
+    printf("%-8s %12s %12s %12s %10s %15s %14s\n", "accel", "build (ms)",
+           "nodes (KiB)", "trace (ms)", "Mrays/s", "any hit Mrays/s",
+           "hit distance");
+
+    size_t accel_count = sizeof(bench_accels_list) / sizeof(*bench_accels_list);
+    for (size_t i = 0; i < accel_count; i++)
+    {
+        const struct bench_accel *bench = &bench_accels_list[i];
+        if (bench->accel == SCENE_ACCEL_BVH8 && !cpu_has_avx())
+        {
+            printf("%-8s unsupported\n", bench->name);
+            continue;
+        }
+
+        double build_start = timer_now();
+        scene_build_accel(scene, bench->accel, options);
+        double build_time = timer_now() - build_start;
+
+        // the sum of hit distances makes sure all structures agree
+        double dist_sum = 0;
+        size_t hit_count = 0;
+        double trace_start = timer_now();
+        for (size_t ray_i = 0; ray_i < ray_count; ray_i++)
+        {
+            struct object_intersection inter;
+            double dist = scene_intersect_ray(&inter, scene, &rays[ray_i]);
+            if (!isinf(dist))
+            {
+                dist_sum += dist;
+                hit_count++;
+            }
+        }
+        double trace_time = timer_now() - trace_start;
+
+        // the same rays, as occlusion queries
+        size_t occluded_count = 0;
+        double occluded_start = timer_now();
+        for (size_t ray_i = 0; ray_i < ray_count; ray_i++)
+            occluded_count += scene_occluded(scene, &rays[ray_i], INFINITY);
+        double occluded_time = timer_now() - occluded_start;
+
+        printf("%-8s %12.3f %12.1f %12.3f %10.3f %15.3f %14.6f\n",
+               bench->name, build_time * 1e3,
+               scene_accel_node_memory(scene) / 1024., trace_time * 1e3,
+               ray_count / trace_time * 1e-6,
+               ray_count / occluded_time * 1e-6, dist_sum);
+        if (occluded_count != hit_count)
+            printf("%-8s %zu rays hit, but %zu are occluded\n", bench->name,
+                   hit_count, occluded_count);
+    }
+
+    // compare builders on the binary tree
+    printf("\n%-8s %12s %12s %12s %12s %10s\n", "builder", "build (ms)",
+           "nodes", "references", "duplication", "Mrays/s");
+    size_t builder_count
+        = sizeof(bench_builders_list) / sizeof(*bench_builders_list);
+    for (size_t i = 0; i < builder_count; i++)
+    {
+        const struct bench_builder *bench = &bench_builders_list[i];
+        struct bvh_build_options builder_options = *options;
+        builder_options.builder = bench->builder;
+
+        double build_start = timer_now();
+        scene_build_accel(scene, SCENE_ACCEL_BVH, &builder_options);
+        double build_time = timer_now() - build_start;
+        double trace_time = bench_trace(scene, rays, ray_count);
+
+        const struct bvh *bvh = &scene->bvh;
+        double duplication = bvh->prim_count
+            ? (double)(bvh->ref_count - bvh->prim_count) / bvh->prim_count
+            : 0;
+        printf("%-8s %12.3f %12zu %12zu %11.1f%% %10.3f\n", bench->name,
+               build_time * 1e3, bvh->node_count, bvh->ref_count,
+               duplication * 100, ray_count / trace_time * 1e-6);
+    }
+
+    free(rays);
+}
+
+/*
+** Traces camera rays through the scene by square tiles of packet_width
+** pixels, either as packets or one by one when packet_width is 1. Returns
+** the time it took, and stores the sum of hit distances in dist_sum.
+*/
+static double bench_trace_tiles(struct scene *scene, const struct ray *rays,
+                                size_t width, size_t height,
+                                size_t packet_width, double *dist_sum)
+{
+    struct ray packet[BVH_PACKET_MAX_SIZE];
+    struct object_intersection inters[BVH_PACKET_MAX_SIZE];
+    double dists[BVH_PACKET_MAX_SIZE];
+
+    *dist_sum = 0;
+    double trace_start = timer_now();
+    for (size_t min_y = 0; min_y < height; min_y += packet_width)
+        for (size_t min_x = 0; min_x < width; min_x += packet_width)
+        {
+            size_t ray_count = 0;
+            for (size_t y = min_y; y < min_y + packet_width && y < height; y++)
+                for (size_t x = min_x; x < min_x + packet_width && x < width;
+                     x++)
+                    packet[ray_count++] = rays[y * width + x];
+
+            if (packet_width == 1)
+                dists[0] = scene_intersect_ray(&inters[0], scene, &packet[0]);
+            else
+                scene_intersect_packet(inters, dists, scene, packet,
+                                       ray_count);
+
+            for (size_t i = 0; i < ray_count; i++)
+                if (!isinf(dists[i]))
+                    *dist_sum += dists[i];
+        }
+    return timer_now() - trace_start;
+}
+
+void bench_packets(struct scene *scene,
+                   const struct bvh_build_options *options, size_t width,
+                   size_t height)
+{
+    static const size_t packet_widths[] = {1, 4, 8};
+    size_t ray_count = width * height;
+    struct ray *rays = bench_camera_rays(scene, width, height);
+    scene_build_accel(scene, SCENE_ACCEL_BVH, options);
+
+    printf("%-8s %12s %10s %14s\n", "packet", "trace (ms)", "Mrays/s",
+           "hit distance");
+    for (size_t i = 0; i < sizeof(packet_widths) / sizeof(*packet_widths);
+         i++)
+    {
+        size_t packet_width = packet_widths[i];
+        double dist_sum;
+        double trace_time = bench_trace_tiles(scene, rays, width, height,
+                                              packet_width, &dist_sum);
+        char name[16];
+        if (packet_width == 1)
+            snprintf(name, sizeof(name), "none");
+        else
+            snprintf(name, sizeof(name), "%zux%zu", packet_width,
+                     packet_width);
+        printf("%-8s %12.3f %10.3f %14.6f\n", name, trace_time * 1e3,
+               ray_count / trace_time * 1e-6, dist_sum);
+    }
+
+    free(rays);
+}
+
+/*
+** A deterministic pseudo random generator, so that all runs of the
+** benchmark test the same triangles. Returns a number between -1 and 1.
+*/
+static double bench_random(uint64_t *state)
+{
+    // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (double)(*state >> 11) / (UINT64_C(1) << 52) - 1;
+}
+
+static struct vec3 bench_random_vec3(uint64_t *state, double scale)
+{
+    struct vec3 res = {
+        bench_random(state) * scale,
+        bench_random(state) * scale,
+        bench_random(state) * scale,
+    };
+    return res;
+}
+
+/*
+** The triangle test as it was before edges were precomputed, kept as a
+** baseline: the normal and the plane are derived from the points, and the
+** point of the plane hit by the ray is tested against each edge.
+*/
+static double bench_triangle_edges(const struct triangle *trian,
+                                   const struct ray *ray, double max_dist,
+                                   double *u, double *v)
+{
+    const struct vec3 *v0 = &trian->points[0];
+    const struct vec3 *v1 = &trian->points[1];
+    const struct vec3 *v2 = &trian->points[2];
+
+    struct vec3 a = vec3_sub(v1, v0);
+    struct vec3 b = vec3_sub(v2, v1);
+    struct vec3 c = vec3_sub(v0, v2);
+    struct vec3 n = vec3_cross(&a, &b);
+    if (vec3_dot(&ray->direction, &n) >= 0)
+        return INFINITY;
+
+    double D = -vec3_dot(&n, v0);
+    double t
+        = -(vec3_dot(&n, &ray->source) + D) / vec3_dot(&n, &ray->direction);
+    if (t < 0 || t >= max_dist)
+        return INFINITY;
+
+    struct vec3 P_off = vec3_mul(&ray->direction, t);
+    struct vec3 P = vec3_add(&ray->source, &P_off);
+    double n_norm = vec3_dot(&n, &n);
+    double tolerance = -0.0000001 * n_norm;
+
+    struct vec3 v0_to_p = vec3_sub(&P, v0);
+    struct vec3 v0_cross = vec3_cross(&a, &v0_to_p);
+    double w2 = vec3_dot(&v0_cross, &n);
+    if (w2 < tolerance)
+        return INFINITY;
+
+    struct vec3 v1_to_p = vec3_sub(&P, v1);
+    struct vec3 v1_cross = vec3_cross(&b, &v1_to_p);
+    double w0 = vec3_dot(&v1_cross, &n);
+    if (w0 < tolerance)
+        return INFINITY;
+
+    struct vec3 v2_to_p = vec3_sub(&P, v2);
+    struct vec3 v2_cross = vec3_cross(&c, &v2_to_p);
+    double w1 = vec3_dot(&v2_cross, &n);
+    if (w1 < tolerance)
+        return INFINITY;
+
+    *u = w1 / n_norm;
+    *v = w2 / n_norm;
+    (void)w0;
+    return t;
+}
+
+/*
+** The triangles of the benchmark, both as objects and packed into blocks.
+*/
+struct bench_triangle_set
+{
+    struct triangle **triangles;
+    size_t triangle_count;
+    struct triangle_block *blocks;
+    size_t block_count;
+};
+
+/*
+** Returns the distance to the closest triangle of the set hit by the ray,
+** or INFINITY.
+*/
+typedef double (*bench_triangle_f)(const struct bench_triangle_set *set,
+                                   const struct ray *ray);
+
+static double bench_triangle_set_edges(const struct bench_triangle_set *set,
+                                       const struct ray *ray)
+{
+    double best = INFINITY;
+    for (size_t i = 0; i < set->triangle_count; i++)
+    {
+        double u;
+        double v;
+        double dist
+            = bench_triangle_edges(set->triangles[i], ray, best, &u, &v);
+        if (dist < best)
+            best = dist;
+    }
+    return best;
+}
+
+static double bench_triangle_set_object(const struct bench_triangle_set *set,
+                                        const struct ray *ray)
+{
+    double best = INFINITY;
+    for (size_t i = 0; i < set->triangle_count; i++)
+    {
+        struct object_hit hit;
+        const struct object *obj = &set->triangles[i]->base;
+        double dist = obj->intersect(&hit, obj, 0, ray);
+        if (dist < best)
+            best = dist;
+    }
+    return best;
+}
+
+static double
+bench_triangle_set_precomputed(const struct bench_triangle_set *set,
+                               const struct ray *ray)
+{
+    double best = INFINITY;
+    for (size_t i = 0; i < set->triangle_count; i++)
+    {
+        double u;
+        double v;
+        double dist = triangle_ray_dist(set->triangles[i], ray, best, &u, &v);
+        if (dist < best)
+            best = dist;
+    }
+    return best;
+}
+
+static double bench_triangle_set_block(const struct bench_triangle_set *set,
+                                       const struct ray *ray)
+{
+    double best = INFINITY;
+    for (size_t i = 0; i < set->block_count; i++)
+    {
+        struct triangle_block_hit hit;
+        if (triangle_block_intersect(&set->blocks[i], 0,
+                                     TRIANGLE_BLOCK_WIDTH, ray, best, &hit))
+            best = hit.dist;
+    }
+    return best;
+}
+
+static double
+bench_triangle_set_block_avx(const struct bench_triangle_set *set,
+                             const struct ray *ray)
+{
+    double best = INFINITY;
+    for (size_t i = 0; i < set->block_count; i++)
+    {
+        struct triangle_block_hit hit;
+        if (triangle_block_intersect_avx(
+                &set->blocks[i], 0, TRIANGLE_BLOCK_WIDTH, ray, best, &hit))
+            best = hit.dist;
+    }
+    return best;
+}
+
+#define BENCH_STR_(X) #X
+#define BENCH_STR(X) BENCH_STR_(X)
+
+struct bench_triangle_kernel
+{
+    const char *name;
+    bench_triangle_f intersect;
+    bool needs_avx;
+};
+
+static const struct bench_triangle_kernel bench_triangle_kernels[] = {
+    {"edges", bench_triangle_set_edges, false},
+    {"object", bench_triangle_set_object, false},
+    {"precomputed", bench_triangle_set_precomputed, false},
+    {"block" BENCH_STR(TRIANGLE_BLOCK_WIDTH), bench_triangle_set_block, false},
+    {"block" BENCH_STR(TRIANGLE_BLOCK_WIDTH) " avx",
+     bench_triangle_set_block_avx, true},
+};
+
+// the triangles of the benchmark are never shaded
+static struct material bench_material = MATERIAL_STATIC_INIT(NULL);
+
+void bench_triangles(size_t triangle_count, size_t ray_count)
+{
+    uint64_t state = 0x9e3779b97f4a7c15;
+    struct bench_triangle_set set;
+    set.triangles = xcalloc(triangle_count, sizeof(*set.triangles));
+    set.triangle_count = triangle_count;
+    set.block_count
+        = (triangle_count + TRIANGLE_BLOCK_WIDTH - 1) / TRIANGLE_BLOCK_WIDTH;
+    set.blocks = xcalloc(set.block_count, sizeof(*set.blocks));
+    for (size_t i = 0; i < triangle_count; i++)
+    {
+        struct vec3 center = bench_random_vec3(&state, 1);
+        struct vec3 points[3];
+        for (size_t point_i = 0; point_i < 3; point_i++)
+        {
+            struct vec3 offset = bench_random_vec3(&state, 0.25);
+            points[point_i] = vec3_add(&center, &offset);
+        }
+        set.triangles[i] = triangle_create(points, &bench_material);
+
+        const struct vec3 *block_points[3] = {&points[0], &points[1],
+                                              &points[2]};
+        triangle_block_set(&set.blocks[i / TRIANGLE_BLOCK_WIDTH],
+                           i % TRIANGLE_BLOCK_WIDTH, block_points, i);
+    }
+
+    // rays start outside of the triangles, and go through them
+    struct ray *rays = xcalloc(ray_count, sizeof(*rays));
+    for (size_t i = 0; i < ray_count; i++)
+    {
+        struct vec3 source = bench_random_vec3(&state, 1);
+        vec3_normalize(&source);
+        source = vec3_mul(&source, 3);
+        struct vec3 target = bench_random_vec3(&state, 1);
+        struct vec3 direction = vec3_sub(&target, &source);
+        vec3_normalize(&direction);
+        rays[i].source = source;
+        rays[i].direction = direction;
+        ray_update_inv_direction(&rays[i]);
+    }
+
+    printf("%-12s %12s %12s %12s %14s\n", "kernel", "tests (M)", "time (ms)",
+           "Mtests/s", "hit distance");
+    size_t test_count = triangle_count * ray_count;
+    size_t kernel_count
+        = sizeof(bench_triangle_kernels) / sizeof(*bench_triangle_kernels);
+    for (size_t kernel_i = 0; kernel_i < kernel_count; kernel_i++)
+    {
+        const struct bench_triangle_kernel *kernel
+            = &bench_triangle_kernels[kernel_i];
+        if (kernel->needs_avx && !cpu_has_avx())
+            continue;
+
+        // the sum of the distances to the closest hits makes sure all
+        // kernels agree
+        double dist_sum = 0;
+        double start = timer_now();
+        for (size_t ray_i = 0; ray_i < ray_count; ray_i++)
+        {
+            double dist = kernel->intersect(&set, &rays[ray_i]);
+            if (!isinf(dist))
+                dist_sum += dist;
+        }
+        double time = timer_now() - start;
+        printf("%-12s %12.3f %12.3f %12.3f %14.6f\n", kernel->name,
+               test_count * 1e-6, time * 1e3, test_count / time * 1e-6,
+               dist_sum);
+    }
+
+    for (size_t i = 0; i < triangle_count; i++)
+        set.triangles[i]->base.free(&set.triangles[i]->base);
+    free(set.triangles);
+    free(set.blocks);
+    free(rays);
+}
+
+void bench_refit(struct scene *scene, const struct bvh_build_options *options,
+                 enum scene_accel accel, size_t frame_count,
+                 bench_animate_f animate, void *data, size_t width,
+                 size_t height)
+{
+    size_t ray_count = width * height;
+    struct ray *rays = bench_camera_rays(scene, width, height);
+
+    animate(scene, 0, data);
+    double build_start = timer_now();
+    scene_build_accel(scene, accel, options);
+    double build_time = timer_now() - build_start;
+    printf("initial build: %.3f ms, cost %.3f\n", build_time * 1e3,
+           scene->bvh.build_cost);
+
+    printf("%-8s %-8s %12s %12s %10s\n", "frame", "update", "update (ms)",
+           "cost growth", "Mrays/s");
+    for (size_t frame = 1; frame < frame_count; frame++)
+    {
+        animate(scene, frame, data);
+        double update_start = timer_now();
+        bool rebuilt = scene_update_accel(scene, options);
+        double update_time = timer_now() - update_start;
+        double cost_growth = bvh_sah_cost(&scene->bvh) / scene->bvh.build_cost;
+        double trace_time = bench_trace(scene, rays, ray_count);
+        printf("%-8zu %-8s %12.3f %12.3f %10.3f\n", frame,
+               rebuilt ? "rebuild" : "refit", update_time * 1e3, cost_growth,
+               ray_count / trace_time * 1e-6);
+    }
+
+    // compare the last frame to a tree built from scratch
+    build_start = timer_now();
+    scene_build_accel(scene, accel, options);
+    build_time = timer_now() - build_start;
+    double trace_time = bench_trace(scene, rays, ray_count);
+    printf("%-8s %-8s %12.3f %12.3f %10.3f\n", "last", "build",
+           build_time * 1e3, 1., ray_count / trace_time * 1e-6);
+
+    free(rays);
+}
@@ -0,0 +1,354 @@
+#include "bvh.h"
+#include "bvh_build.h"
+#include "utils/alloc.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+/*
+** The state of the sweep builder.
+*/
+struct build_ctx
+{
+    struct bvh *bvh;
+    struct bvh_build_ref *refs;
+    // scratch space for the sweep, holding the area of the right side
+    double *right_areas;
+};
+
+static int ref_compare_x(const void *a, const void *b)
+{
+    const struct bvh_build_ref *ra = a;
+    const struct bvh_build_ref *rb = b;
+    return (ra->center.x > rb->center.x) - (ra->center.x < rb->center.x);
+}
+
+static int ref_compare_y(const void *a, const void *b)
+{
+    const struct bvh_build_ref *ra = a;
+    const struct bvh_build_ref *rb = b;
+    return (ra->center.y > rb->center.y) - (ra->center.y < rb->center.y);
+}
+
+static int ref_compare_z(const void *a, const void *b)
+{
+    const struct bvh_build_ref *ra = a;
+    const struct bvh_build_ref *rb = b;
+    return (ra->center.z > rb->center.z) - (ra->center.z < rb->center.z);
+}
+
+static int (*const ref_compare[3])(const void *, const void *) = {
+    ref_compare_x,
+    ref_compare_y,
+    ref_compare_z,
+};
+
+void bvh_build_sort_refs(struct bvh_build_ref *refs, size_t count, int axis)
+{
+    qsort(refs, count, sizeof(*refs), ref_compare[axis]);
+}
+
+void bvh_build_refs_bounds(struct aabb *bounds, struct aabb *center_bounds,
+                           const struct bvh_build_ref *refs, size_t count)
+{
+    aabb_init_empty(bounds);
+    aabb_init_empty(center_bounds);
+    for (size_t i = 0; i < count; i++)
+    {
+        aabb_extend(bounds, &refs[i].bounds);
+        aabb_extend_point(center_bounds, &refs[i].center);
+    }
+}
+
+int bvh_build_largest_axis(const struct aabb *box)
+{
+    struct vec3 extent = vec3_sub(&box->max, &box->min);
+    int axis = 0;
+    if (extent.y > vec3_get(&extent, axis))
+        axis = 1;
+    if (extent.z > vec3_get(&extent, axis))
+        axis = 2;
+    return axis;
+}
+
+/*
+** Finds the split with the lowest cost along a given axis, by sweeping
+** over the references sorted by centroid. The references must already be
+** sorted along this axis. Returns the cost of the split, and stores the
+** number of references going to the left child in split_i.
+*/
+static double sweep_axis(struct build_ctx *ctx, size_t begin, size_t end,
+                         size_t *split_i)
+{
+    size_t count = end - begin;
+    struct bvh_build_ref *refs = &ctx->refs[begin];
+
+    // compute the area of all the possible right sides
+    struct aabb right;
+    aabb_init_empty(&right);
+    for (size_t i = count - 1; i > 0; i--)
+    {
+        aabb_extend(&right, &refs[i].bounds);
+        ctx->right_areas[i] = aabb_surface_area(&right);
+    }
+
+    // sweep from the left
+    struct aabb left;
+    aabb_init_empty(&left);
+    double best_cost = INFINITY;
+    for (size_t i = 1; i < count; i++)
+    {
+        aabb_extend(&left, &refs[i - 1].bounds);
+        double cost = aabb_surface_area(&left) * i
+                      + ctx->right_areas[i] * (count - i);
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            *split_i = i;
+        }
+    }
+
+    return best_cost;
+}
+
+static void build_node(struct build_ctx *ctx, size_t node_i, size_t begin,
+                       size_t end, size_t depth)
+{
+    struct bvh *bvh = ctx->bvh;
+    struct bvh_node *node = &bvh->nodes[node_i];
+    size_t count = end - begin;
+
+    struct aabb center_bounds;
+    bvh_build_refs_bounds(&node->bounds, &center_bounds, &ctx->refs[begin],
+                          count);
+
+    node->offset = begin;
+    node->prim_count = count;
+    if (count == 1)
+        return;
+
+    int best_axis = -1;
+    int sorted_axis = -1;
+    size_t best_split = count / 2;
+    double best_cost = INFINITY;
+    double node_area = aabb_surface_area(&node->bounds);
+
+    if (depth < BVH_MEDIAN_DEPTH && node_area > 0)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            size_t split_i = count / 2;
+            bvh_build_sort_refs(&ctx->refs[begin], count, axis);
+            sorted_axis = axis;
+            double cost = sweep_axis(ctx, begin, end, &split_i);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = split_i;
+            }
+        }
+
+        best_cost = BVH_TRAVERSAL_COST
+                    + BVH_INTERSECT_COST * best_cost / node_area;
+        if (bvh_build_make_leaf(count, best_cost))
+            return;
+    }
+    else if (count <= BVH_MAX_LEAF_SIZE)
+        return;
+
+    // median split along the largest axis of the centroids
+    if (best_axis == -1)
+        best_axis = bvh_build_largest_axis(&center_bounds);
+
+    if (best_axis != sorted_axis)
+        bvh_build_sort_refs(&ctx->refs[begin], count, best_axis);
+
+    size_t left_i = bvh->node_count;
+    bvh->node_count += 2;
+    node->offset = left_i;
+    node->prim_count = 0;
+
+    build_node(ctx, left_i, begin, begin + best_split, depth + 1);
+    build_node(ctx, left_i + 1, begin + best_split, end, depth + 1);
+}
+
+void bvh_build_sweep(struct bvh *bvh, struct bvh_build_ref *refs)
+{
+    struct build_ctx ctx = {
+        .bvh = bvh,
+        .refs = refs,
+        .right_areas = xcalloc(bvh->prim_count, sizeof(*ctx.right_areas)),
+    };
+
+    bvh->node_count = 1;
+    build_node(&ctx, 0, 0, bvh->prim_count, 0);
+    free(ctx.right_areas);
+}
+
+void bvh_build(struct bvh *bvh, const struct aabb *prim_bounds,
+               size_t prim_count, const struct bvh_build_options *options)
+{
+    bvh_build_split(bvh, prim_bounds, prim_count, options, NULL, NULL);
+}
+
+void bvh_build_split(struct bvh *bvh, const struct aabb *prim_bounds,
+                     size_t prim_count,
+                     const struct bvh_build_options *options,
+                     bvh_split_f split, void *data)
+{
+    bvh->prim_count = prim_count;
+    bvh->ref_count = 0;
+    bvh->node_count = 0;
+    bvh->nodes = NULL;
+    bvh->prim_indices = NULL;
+    bvh->build_cost = 0;
+    bvh->borrowed = false;
+    if (prim_count == 0)
+        return;
+
+    struct bvh_build_ref *refs = xcalloc(prim_count, sizeof(*refs));
+    for (size_t i = 0; i < prim_count; i++)
+    {
+        refs[i].bounds = prim_bounds[i];
+        refs[i].center = aabb_center(&prim_bounds[i]);
+        refs[i].prim = i;
+    }
+
+    if (options->builder == BVH_BUILDER_SPATIAL)
+        bvh_build_spatial(bvh, refs, options->spatial_split_budget, split,
+                          data);
+    else
+    {
+        // a binary tree with prim_count leaves has at most 2 * prim_count - 1
+        // nodes
+        bvh->nodes = xcalloc(2 * prim_count - 1, sizeof(*bvh->nodes));
+        if (options->builder == BVH_BUILDER_BINNED)
+            bvh_build_binned(bvh, refs, options->pool);
+        else
+            bvh_build_sweep(bvh, refs);
+
+        bvh->ref_count = prim_count;
+        bvh->prim_indices = xcalloc(prim_count, sizeof(*bvh->prim_indices));
+        for (size_t i = 0; i < prim_count; i++)
+            bvh->prim_indices[i] = refs[i].prim;
+    }
+    bvh->nodes = xrealloc(bvh->nodes, bvh->node_count * sizeof(*bvh->nodes));
+    bvh->prim_indices = xrealloc(
+        bvh->prim_indices, bvh->ref_count * sizeof(*bvh->prim_indices));
+
+    free(refs);
+    bvh->build_cost = bvh_sah_cost(bvh);
+}
+
+void bvh_destroy(struct bvh *bvh)
+{
+    if (bvh->borrowed)
+        return;
+
+    free(bvh->nodes);
+    free(bvh->prim_indices);
+}
+
+struct bvh_stack_entry
+{
+    uint32_t node;
+    double dist;
+};
+
+double bvh_intersect_node(const struct bvh *bvh, size_t root,
+                          const struct ray *ray, double max_dist,
+                          bvh_intersect_f intersect, void *data)
+{
+    double closest_dist = max_dist;
+    struct bvh_stack_entry stack[BVH_MAX_DEPTH + 1];
+    size_t stack_size = 0;
+
+    double root_dist
+        = aabb_ray_entry(&bvh->nodes[root].bounds, ray, closest_dist);
+    if (isinf(root_dist))
+        return closest_dist;
+
+    stack[stack_size++] = (struct bvh_stack_entry){root, root_dist};
+    while (stack_size > 0)
+    {
+        struct bvh_stack_entry entry = stack[--stack_size];
+        // a closer hit may have been found since this node was pushed
+        if (entry.dist > closest_dist)
+            continue;
+
+        const struct bvh_node *node = &bvh->nodes[entry.node];
+        if (node->prim_count != 0)
+        {
+            double dist = intersect(data, &bvh->prim_indices[node->offset],
+                                    node->prim_count, ray);
+            if (dist < closest_dist)
+                closest_dist = dist;
+            continue;
+        }
+
+        // visit the closest child first, by pushing it last
+        uint32_t near = node->offset;
+        uint32_t far = node->offset + 1;
+        double near_dist
+            = aabb_ray_entry(&bvh->nodes[near].bounds, ray, closest_dist);
+        double far_dist
+            = aabb_ray_entry(&bvh->nodes[far].bounds, ray, closest_dist);
+        if (far_dist < near_dist)
+        {
+            uint32_t tmp_node = near;
+            near = far;
+            far = tmp_node;
+
+            double tmp_dist = near_dist;
+            near_dist = far_dist;
+            far_dist = tmp_dist;
+        }
+
+        if (!isinf(far_dist))
+            stack[stack_size++] = (struct bvh_stack_entry){far, far_dist};
+        if (!isinf(near_dist))
+            stack[stack_size++] = (struct bvh_stack_entry){near, near_dist};
+    }
+
+    return closest_dist;
+}
+
+double bvh_intersect(const struct bvh *bvh, const struct ray *ray,
+                     bvh_intersect_f intersect, void *data)
+{
+    if (bvh->node_count == 0)
+        return INFINITY;
+    return bvh_intersect_node(bvh, 0, ray, INFINITY, intersect, data);
+}
+
+bool bvh_occluded(const struct bvh *bvh, const struct ray *ray,
+                  double max_dist, bvh_occluded_f occluded, void *data)
+{
+    if (bvh->node_count == 0)
+        return false;
+
+    // as any hit will do, nodes are visited in no particular order
+    uint32_t stack[BVH_MAX_DEPTH + 1];
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0)
+    {
+        const struct bvh_node *node = &bvh->nodes[stack[--stack_size]];
+        if (isinf(aabb_ray_entry(&node->bounds, ray, max_dist)))
+            continue;
+
+        if (node->prim_count != 0)
+        {
+            if (occluded(data, &bvh->prim_indices[node->offset],
+                         node->prim_count, ray, max_dist))
+                return true;
+            continue;
+        }
+
+        stack[stack_size++] = node->offset + 1;
+        stack[stack_size++] = node->offset;
+    }
+
+    return false;
+}
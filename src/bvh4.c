@@ -0,0 +1,41 @@
+#include "bvh4.h"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/*
+** Tests the four children of a node at once, using SSE.
+*/
+static inline unsigned bvh4_intersect_children(const struct bvh4_node *node,
+                                               const struct bvh_wide_ray *ray,
+                                               float max_dist, float *dists)
+{
+#ifdef __SSE__
+    __m128 tmin = _mm_setzero_ps();
+    __m128 tmax = _mm_set1_ps(max_dist);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // pick the planes the ray goes through first
+        int near = ray->inv_direction[axis] < 0;
+        __m128 source = _mm_set1_ps(ray->source[axis]);
+        __m128 inv_dir = _mm_set1_ps(ray->inv_direction[axis]);
+        __m128 near_planes = _mm_loadu_ps(node->bounds[near][axis]);
+        __m128 far_planes = _mm_loadu_ps(node->bounds[1 - near][axis]);
+        __m128 tnear = _mm_mul_ps(_mm_sub_ps(near_planes, source), inv_dir);
+        __m128 tfar = _mm_mul_ps(_mm_sub_ps(far_planes, source), inv_dir);
+        tmin = _mm_max_ps(tmin, tnear);
+        tmax = _mm_min_ps(tmax, tfar);
+    }
+
+    _mm_storeu_ps(dists, tmin);
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+    return bvh_wide_intersect_boxes(&node->bounds[0][0][0], 4, ray, max_dist,
+                                    dists);
+#endif
+}
+
+#define BVHW_NAME bvh4
+#define BVHW_WIDTH 4
+#include "bvh_wide.defs"
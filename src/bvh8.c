@@ -0,0 +1,46 @@
+#include "bvh8.h"
+
+// the vectorized box test requires AVX, which isn't enabled by default.
+// callers must check that the processor supports it before using this tree
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC target("avx")
+#define BVH8_AVX
+#include <immintrin.h>
+#endif
+
+/*
+** Tests the eight children of a node at once, using AVX.
+*/
+static inline unsigned bvh8_intersect_children(const struct bvh8_node *node,
+                                               const struct bvh_wide_ray *ray,
+                                               float max_dist, float *dists)
+{
+#ifdef BVH8_AVX
+    __m256 tmin = _mm256_setzero_ps();
+    __m256 tmax = _mm256_set1_ps(max_dist);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // pick the planes the ray goes through first
+        int near = ray->inv_direction[axis] < 0;
+        __m256 source = _mm256_set1_ps(ray->source[axis]);
+        __m256 inv_dir = _mm256_set1_ps(ray->inv_direction[axis]);
+        __m256 near_planes = _mm256_loadu_ps(node->bounds[near][axis]);
+        __m256 far_planes = _mm256_loadu_ps(node->bounds[1 - near][axis]);
+        __m256 tnear
+            = _mm256_mul_ps(_mm256_sub_ps(near_planes, source), inv_dir);
+        __m256 tfar = _mm256_mul_ps(_mm256_sub_ps(far_planes, source), inv_dir);
+        tmin = _mm256_max_ps(tmin, tnear);
+        tmax = _mm256_min_ps(tmax, tfar);
+    }
+
+    _mm256_storeu_ps(dists, tmin);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+#else
+    return bvh_wide_intersect_boxes(&node->bounds[0][0][0], 8, ray, max_dist,
+                                    dists);
+#endif
+}
+
+#define BVHW_NAME bvh8
+#define BVHW_WIDTH 8
+#include "bvh_wide.defs"
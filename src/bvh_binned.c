@@ -0,0 +1,216 @@
+#include "bvh.h"
+#include "bvh_build.h"
+#include "utils/alloc.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// the number of candidate split positions per axis is BVH_BIN_COUNT - 1.
+// small nodes use fewer bins, as there are fewer possible splits anyway
+#define BVH_BIN_COUNT 32
+#define BVH_MIN_BIN_COUNT 4
+
+struct bin
+{
+    struct aabb bounds;
+    size_t count;
+};
+
+struct binned_ctx
+{
+    struct bvh_build_ref *refs;
+    // the bounds of each node, as numbered by bvh_build_parallel
+    struct aabb *bounds;
+};
+
+static inline size_t bin_index(const struct bvh_build_ref *ref, int axis,
+                               double min, double scale, size_t bin_count)
+{
+    size_t i = (vec3_get(&ref->center, axis) - min) * scale;
+    return i < bin_count ? i : bin_count - 1;
+}
+
+/*
+** Finds the cheapest split along an axis, given its bins. Returns its cost,
+** and stores the first bin of the right side in split_bin.
+*/
+static double sweep_bins(const struct bin *bins, size_t bin_count,
+                         size_t *split_bin)
+{
+    // compute the area and primitive count of all the possible right sides
+    double right_areas[BVH_BIN_COUNT];
+    size_t right_counts[BVH_BIN_COUNT];
+    struct aabb right;
+    aabb_init_empty(&right);
+    size_t right_count = 0;
+    for (size_t i = bin_count - 1; i > 0; i--)
+    {
+        aabb_extend(&right, &bins[i].bounds);
+        right_count += bins[i].count;
+        right_areas[i] = aabb_surface_area(&right);
+        right_counts[i] = right_count;
+    }
+
+    // sweep from the left
+    struct aabb left;
+    aabb_init_empty(&left);
+    size_t left_count = 0;
+    double best_cost = INFINITY;
+    for (size_t i = 1; i < bin_count; i++)
+    {
+        aabb_extend(&left, &bins[i - 1].bounds);
+        left_count += bins[i - 1].count;
+        if (left_count == 0 || right_counts[i] == 0)
+            continue;
+
+        double cost = aabb_surface_area(&left) * left_count
+                      + right_areas[i] * right_counts[i];
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            *split_bin = i;
+        }
+    }
+
+    return best_cost;
+}
+
+/*
+** Computes the bounds of a node, and splits its references in two.
+** Returns the number of references moved to the left side, or zero if the
+** node should be a leaf.
+*/
+static size_t split_node(struct aabb *bounds, struct bvh_build_ref *refs,
+                         size_t count, size_t depth)
+{
+    struct aabb center_bounds;
+    bvh_build_refs_bounds(bounds, &center_bounds, refs, count);
+    if (count == 1)
+        return 0;
+
+    double node_area = aabb_surface_area(bounds);
+    if (depth < BVH_MEDIAN_DEPTH && node_area > 0)
+    {
+        size_t bin_count = count < BVH_MIN_BIN_COUNT ? BVH_MIN_BIN_COUNT
+                           : count < BVH_BIN_COUNT ? count : BVH_BIN_COUNT;
+
+        // bin references along all axes in a single pass
+        struct bin bins[3][BVH_BIN_COUNT];
+        double mins[3];
+        double scales[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            mins[axis] = vec3_get(&center_bounds.min, axis);
+            double extent = vec3_get(&center_bounds.max, axis) - mins[axis];
+            scales[axis] = extent > 0 ? bin_count / extent : 0;
+            for (size_t i = 0; i < bin_count; i++)
+            {
+                aabb_init_empty(&bins[axis][i].bounds);
+                bins[axis][i].count = 0;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                size_t bin_i = bin_index(&refs[i], axis, mins[axis],
+                                         scales[axis], bin_count);
+                struct bin *bin = &bins[axis][bin_i];
+                aabb_extend(&bin->bounds, &refs[i].bounds);
+                bin->count++;
+            }
+        }
+
+        int best_axis = -1;
+        size_t best_bin = 0;
+        double best_cost = INFINITY;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            // all the centers are in the same bin along this axis
+            if (scales[axis] == 0)
+                continue;
+
+            size_t split_bin = 0;
+            double cost = sweep_bins(bins[axis], bin_count, &split_bin);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = split_bin;
+            }
+        }
+
+        // all the centers are at the same place, there's nothing to bin
+        if (best_axis == -1)
+        {
+            if (count <= BVH_MAX_LEAF_SIZE)
+                return 0;
+            return count / 2;
+        }
+
+        best_cost = BVH_TRAVERSAL_COST
+                    + BVH_INTERSECT_COST * best_cost / node_area;
+        if (bvh_build_make_leaf(count, best_cost))
+            return 0;
+
+        // move the references of the left bins to the front
+        double min = mins[best_axis];
+        double scale = scales[best_axis];
+        size_t left = 0;
+        size_t right = count;
+        while (left < right)
+        {
+            if (bin_index(&refs[left], best_axis, min, scale, bin_count)
+                < best_bin)
+            {
+                left++;
+                continue;
+            }
+
+            right--;
+            struct bvh_build_ref tmp = refs[left];
+            refs[left] = refs[right];
+            refs[right] = tmp;
+        }
+        return left;
+    }
+
+    if (count <= BVH_MAX_LEAF_SIZE)
+        return 0;
+
+    // median split along the largest axis of the centroids
+    bvh_build_sort_refs(refs, count, bvh_build_largest_axis(&center_bounds));
+    return count / 2;
+}
+
+static size_t binned_split(void *data, size_t node_i, size_t begin,
+                           size_t end, size_t depth)
+{
+    struct binned_ctx *ctx = data;
+    return split_node(&ctx->bounds[node_i], &ctx->refs[begin], end - begin,
+                      depth);
+}
+
+void bvh_build_binned(struct bvh *bvh, struct bvh_build_ref *refs,
+                      struct thread_pool *pool)
+{
+    struct binned_ctx ctx = {
+        .refs = refs,
+        .bounds = xcalloc(2 * bvh->prim_count - 1, sizeof(*ctx.bounds)),
+    };
+    size_t node_count;
+    struct bvh_build_node *nodes = bvh_build_parallel(
+        bvh->prim_count, pool, binned_split, &ctx, &node_count);
+
+    for (size_t i = 0; i < node_count; i++)
+        bvh->nodes[i] = (struct bvh_node){
+            .bounds = ctx.bounds[nodes[i].src],
+            .offset = nodes[i].offset,
+            .prim_count = nodes[i].count,
+        };
+    bvh->node_count = node_count;
+
+    free(nodes);
+    free(ctx.bounds);
+}
@@ -0,0 +1,227 @@
+#include "bvh.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+// rays go on alone once less than this fraction of the packet is left
+#define BVH_PACKET_DIVERGENCE 4
+
+/*
+** Bounds of the sources and inverse directions of the rays of a packet,
+** which allow testing whether all of them miss a box at once. They use the
+** precision of geometry, as aabb_ray_entry does.
+** This is only possible when the directions of all rays have the same
+** signs, so that they all enter boxes through the same planes.
+*/
+struct bvh_packet_bounds
+{
+    bool coherent;
+    // whether the inverse direction is negative, for each axis
+    bool negative[3];
+    real source_min[3];
+    real source_max[3];
+    real inv_min[3];
+    real inv_max[3];
+};
+
+static inline real bvh_packet_min(real a, real b)
+{
+    return a < b ? a : b;
+}
+
+static inline real bvh_packet_max(real a, real b)
+{
+    return a > b ? a : b;
+}
+
+static void bvh_packet_bounds_init(struct bvh_packet_bounds *bounds,
+                                   const struct ray *rays, size_t ray_count)
+{
+    bounds->coherent = true;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        real first_inv = vec3_get(&rays[0].inv_direction, axis);
+        bounds->negative[axis] = first_inv < 0;
+        bounds->source_min[axis] = INFINITY;
+        bounds->source_max[axis] = -INFINITY;
+        bounds->inv_min[axis] = INFINITY;
+        bounds->inv_max[axis] = -INFINITY;
+        for (size_t i = 0; i < ray_count; i++)
+        {
+            real source = vec3_get(&rays[i].source, axis);
+            real inv_dir = vec3_get(&rays[i].inv_direction, axis);
+            // rays parallel to a plane make slab distances infinite or NaN
+            if (!isfinite(inv_dir) || (inv_dir < 0) != bounds->negative[axis])
+                bounds->coherent = false;
+
+            bounds->source_min[axis]
+                = bvh_packet_min(bounds->source_min[axis], source);
+            bounds->source_max[axis]
+                = bvh_packet_max(bounds->source_max[axis], source);
+            bounds->inv_min[axis]
+                = bvh_packet_min(bounds->inv_min[axis], inv_dir);
+            bounds->inv_max[axis]
+                = bvh_packet_max(bounds->inv_max[axis], inv_dir);
+        }
+    }
+}
+
+/*
+** Returns the lowest or highest distance from any source to a plane along
+** any direction. As rounding preserves order, it also bounds the distances
+** computed by aabb_ray_entry for each ray.
+*/
+static real bvh_packet_plane_dist(const struct bvh_packet_bounds *bounds,
+                                  int axis, real plane, bool highest)
+{
+    real offsets[2] = {
+        plane - bounds->source_max[axis],
+        plane - bounds->source_min[axis],
+    };
+    real res = highest ? -INFINITY : INFINITY;
+    for (size_t i = 0; i < 2; i++)
+    {
+        real near = offsets[i] * bounds->inv_min[axis];
+        real far = offsets[i] * bounds->inv_max[axis];
+        if (highest)
+            res = bvh_packet_max(res, bvh_packet_max(near, far));
+        else
+            res = bvh_packet_min(res, bvh_packet_min(near, far));
+    }
+    return res;
+}
+
+/*
+** Returns true if no ray of the packet can hit the box.
+*/
+static bool bvh_packet_misses(const struct bvh_packet_bounds *bounds,
+                              const struct aabb *box)
+{
+    if (!bounds->coherent)
+        return false;
+
+    real tmin = -INFINITY;
+    real tmax = INFINITY;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        real near = vec3_get(&box->min, axis);
+        real far = vec3_get(&box->max, axis);
+        if (bounds->negative[axis])
+        {
+            real tmp = near;
+            near = far;
+            far = tmp;
+        }
+
+        tmin = bvh_packet_max(
+            tmin, bvh_packet_plane_dist(bounds, axis, near, false));
+        tmax = bvh_packet_min(
+            tmax, bvh_packet_plane_dist(bounds, axis, far, true));
+    }
+    return tmax < 0 || tmin > tmax;
+}
+
+struct bvh_packet_stack_entry
+{
+    uint32_t node;
+    // the rays which hit the parent of the node
+    uint64_t active;
+};
+
+void bvh_intersect_packet(const struct bvh *bvh, const struct ray *rays,
+                          size_t ray_count, double *dists,
+                          bvh_intersect_f intersect, void *const *ray_data)
+{
+    assert(ray_count <= BVH_PACKET_MAX_SIZE);
+    for (size_t i = 0; i < ray_count; i++)
+        dists[i] = INFINITY;
+    if (bvh->node_count == 0 || ray_count == 0)
+        return;
+
+    struct bvh_packet_bounds bounds;
+    bvh_packet_bounds_init(&bounds, rays, ray_count);
+    size_t min_active = ray_count / BVH_PACKET_DIVERGENCE;
+
+    struct bvh_packet_stack_entry stack[BVH_MAX_DEPTH + 1];
+    size_t stack_size = 0;
+    uint64_t all_rays = ray_count == 64 ? UINT64_MAX
+                                        : (UINT64_C(1) << ray_count) - 1;
+    stack[stack_size++] = (struct bvh_packet_stack_entry){0, all_rays};
+    while (stack_size > 0)
+    {
+        struct bvh_packet_stack_entry entry = stack[--stack_size];
+        const struct bvh_node *node = &bvh->nodes[entry.node];
+        if (bvh_packet_misses(&bounds, &node->bounds))
+            continue;
+
+        // nodes are entered as soon as a ray hits them, and rays before it
+        // are dropped
+        uint64_t active = entry.active;
+        while (active != 0)
+        {
+            unsigned i = __builtin_ctzll(active);
+            if (!isinf(aabb_ray_entry(&node->bounds, &rays[i], dists[i])))
+                break;
+            active &= active - 1;
+        }
+        if (active == 0)
+            continue;
+
+        // too few rays are left to share the cost of visiting nodes
+        if ((size_t)__builtin_popcountll(active) < min_active)
+        {
+            for (; active != 0; active &= active - 1)
+            {
+                unsigned i = __builtin_ctzll(active);
+                dists[i] = bvh_intersect_node(bvh, entry.node, &rays[i],
+                                              dists[i], intersect,
+                                              ray_data[i]);
+            }
+            continue;
+        }
+
+        if (node->prim_count != 0)
+        {
+            // only test primitives against the rays which hit the leaf. the
+            // first active ray is known to hit it
+            uint64_t first_ray = active & -active;
+            uint64_t hits = first_ray;
+            for (uint64_t mask = active ^ first_ray; mask != 0;
+                 mask &= mask - 1)
+            {
+                unsigned i = __builtin_ctzll(mask);
+                if (!isinf(aabb_ray_entry(&node->bounds, &rays[i], dists[i])))
+                    hits |= UINT64_C(1) << i;
+            }
+
+            const uint32_t *prims = &bvh->prim_indices[node->offset];
+            for (uint64_t mask = hits; mask != 0; mask &= mask - 1)
+            {
+                unsigned i = __builtin_ctzll(mask);
+                double dist = intersect(ray_data[i], prims, node->prim_count,
+                                        &rays[i]);
+                if (dist < dists[i])
+                    dists[i] = dist;
+            }
+            continue;
+        }
+
+        // visit the child closest to the first active ray first
+        unsigned first = __builtin_ctzll(active);
+        uint32_t near = node->offset;
+        uint32_t far = node->offset + 1;
+        double near_dist = aabb_ray_entry(&bvh->nodes[near].bounds,
+                                          &rays[first], dists[first]);
+        double far_dist = aabb_ray_entry(&bvh->nodes[far].bounds,
+                                         &rays[first], dists[first]);
+        if (far_dist < near_dist)
+        {
+            uint32_t tmp = near;
+            near = far;
+            far = tmp;
+        }
+
+        stack[stack_size++] = (struct bvh_packet_stack_entry){far, active};
+        stack[stack_size++] = (struct bvh_packet_stack_entry){near, active};
+    }
+}
@@ -0,0 +1,224 @@
+#include "bvh_build.h"
+#include "thread_pool.h"
+#include "utils/alloc.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// the top levels of the tree are split until there's this many subtrees per
+// thread, which are then built in parallel. having more subtrees than
+// threads helps balancing the load
+#define BVH_TASKS_PER_THREAD 4
+
+// subtrees smaller than this aren't worth splitting in the top levels
+#define BVH_MIN_TASK_SIZE 1024
+
+/*
+** A subtree built by a single thread.
+** Each task owns a contiguous range of nodes, large enough to hold any tree
+** over its primitives.
+*/
+struct build_task
+{
+    uint32_t node;
+    size_t begin;
+    size_t end;
+    size_t depth;
+
+    // the next free node in the range owned by the task
+    size_t next_node;
+};
+
+struct build_ctx
+{
+    bvh_build_split_node_f split;
+    void *data;
+
+    // nodes as they are built, with unused ranges left between subtrees
+    struct bvh_build_node *nodes;
+
+    struct build_task *tasks;
+    size_t task_count;
+
+    // the next task to be picked up by a thread
+    size_t next_task;
+    pthread_mutex_t lock;
+};
+
+static void build_subtree(struct build_ctx *ctx, size_t node_i, size_t begin,
+                          size_t end, size_t depth, size_t *next_node)
+{
+    struct bvh_build_node *node = &ctx->nodes[node_i];
+    size_t split = ctx->split(ctx->data, node_i, begin, end, depth);
+
+    node->offset = begin;
+    node->count = end - begin;
+    if (split == 0)
+        return;
+
+    size_t left_i = *next_node;
+    *next_node += 2;
+    node->offset = left_i;
+    node->count = 0;
+
+    build_subtree(ctx, left_i, begin, begin + split, depth + 1, next_node);
+    build_subtree(ctx, left_i + 1, begin + split, end, depth + 1, next_node);
+}
+
+static int task_compare_size(const void *a, const void *b)
+{
+    const struct build_task *ta = a;
+    const struct build_task *tb = b;
+    size_t size_a = ta->end - ta->begin;
+    size_t size_b = tb->end - tb->begin;
+    // sort by decreasing size
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+/*
+** Splits the top levels of the tree, until there are enough subtrees to
+** keep all threads busy.
+*/
+static void split_top_levels(struct build_ctx *ctx, size_t prim_count,
+                             size_t max_tasks)
+{
+    size_t next_node = 1;
+    ctx->tasks[0] = (struct build_task){
+        .node = 0,
+        .begin = 0,
+        .end = prim_count,
+        .depth = 0,
+    };
+    ctx->task_count = 1;
+
+    while (ctx->task_count < max_tasks)
+    {
+        // split the largest task
+        struct build_task *task = &ctx->tasks[0];
+        for (size_t i = 1; i < ctx->task_count; i++)
+            if (ctx->tasks[i].end - ctx->tasks[i].begin
+                > task->end - task->begin)
+                task = &ctx->tasks[i];
+
+        if (task->end - task->begin < BVH_MIN_TASK_SIZE)
+            break;
+
+        struct bvh_build_node *node = &ctx->nodes[task->node];
+        size_t split = ctx->split(ctx->data, task->node, task->begin,
+                                  task->end, task->depth);
+        // large tasks never end up as leaves
+        assert(split != 0);
+
+        node->offset = next_node;
+        node->count = 0;
+        next_node += 2;
+
+        struct build_task left = {
+            .node = node->offset,
+            .begin = task->begin,
+            .end = task->begin + split,
+            .depth = task->depth + 1,
+        };
+        struct build_task right = {
+            .node = node->offset + 1,
+            .begin = task->begin + split,
+            .end = task->end,
+            .depth = task->depth + 1,
+        };
+        *task = left;
+        ctx->tasks[ctx->task_count++] = right;
+    }
+
+    // give each subtree its own range of nodes
+    for (size_t i = 0; i < ctx->task_count; i++)
+    {
+        struct build_task *task = &ctx->tasks[i];
+        task->next_node = next_node;
+        next_node += 2 * (task->end - task->begin) - 2;
+    }
+
+    // start with the largest subtrees, so that threads end at the same time
+    qsort(ctx->tasks, ctx->task_count, sizeof(*ctx->tasks), task_compare_size);
+}
+
+static void build_worker(void *data, size_t thread_i)
+{
+    (void)thread_i;
+    struct build_ctx *ctx = data;
+    while (true)
+    {
+        pthread_mutex_lock(&ctx->lock);
+        size_t task_i = ctx->next_task++;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (task_i >= ctx->task_count)
+            break;
+
+        struct build_task *task = &ctx->tasks[task_i];
+        build_subtree(ctx, task->node, task->begin, task->end, task->depth,
+                      &task->next_node);
+    }
+}
+
+/*
+** Copies the tree to dst in depth first order, which removes the unused
+** nodes left between subtrees.
+*/
+static void compact_node(struct bvh_build_node *dst, size_t *dst_count,
+                         const struct bvh_build_node *src, size_t src_i,
+                         size_t dst_i)
+{
+    struct bvh_build_node *node = &dst[dst_i];
+    *node = src[src_i];
+    node->src = src_i;
+    if (node->count != 0)
+        return;
+
+    size_t left_i = *dst_count;
+    *dst_count += 2;
+    node->offset = left_i;
+
+    compact_node(dst, dst_count, src, src[src_i].offset, left_i);
+    compact_node(dst, dst_count, src, src[src_i].offset + 1, left_i + 1);
+}
+
+struct bvh_build_node *bvh_build_parallel(size_t prim_count,
+                                          struct thread_pool *pool,
+                                          bvh_build_split_node_f split,
+                                          void *data, size_t *node_count)
+{
+    size_t thread_count = pool != NULL ? pool->thread_count : 1;
+    size_t max_tasks = 1;
+    if (thread_count > 1)
+        max_tasks = thread_count * BVH_TASKS_PER_THREAD;
+
+    // a binary tree with prim_count leaves has at most 2 * prim_count - 1
+    // nodes
+    size_t max_nodes = 2 * prim_count - 1;
+    struct build_ctx ctx = {
+        .split = split,
+        .data = data,
+        .nodes = xcalloc(max_nodes, sizeof(*ctx.nodes)),
+        .tasks = xcalloc(max_tasks, sizeof(*ctx.tasks)),
+        .next_task = 0,
+    };
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    split_top_levels(&ctx, prim_count, max_tasks);
+
+    if (pool != NULL)
+        thread_pool_run(pool, build_worker, &ctx);
+    else
+        build_worker(&ctx, 0);
+
+    pthread_mutex_destroy(&ctx.lock);
+    free(ctx.tasks);
+
+    struct bvh_build_node *nodes = xcalloc(max_nodes, sizeof(*nodes));
+    *node_count = 1;
+    compact_node(nodes, node_count, ctx.nodes, 0, 0);
+    free(ctx.nodes);
+    return xrealloc(nodes, *node_count * sizeof(*nodes));
+}
@@ -0,0 +1,162 @@
+#include "bvh.h"
+#include "bvh_build.h"
+#include "thread_pool.h"
+#include "utils/alloc.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// the top levels of the tree are expanded until there's this many subtrees
+// per thread, which are then refitted in parallel
+#define BVH_REFIT_TASKS_PER_THREAD 4
+
+struct refit_ctx
+{
+    struct bvh *bvh;
+    const struct aabb *prim_bounds;
+
+    // the roots of the subtrees refitted in parallel
+    uint32_t *subtrees;
+    size_t subtree_count;
+
+    // the next subtree to be picked up by a thread
+    size_t next_subtree;
+    pthread_mutex_t lock;
+};
+
+static void refit_subtree(const struct refit_ctx *ctx, uint32_t node_i)
+{
+    struct bvh *bvh = ctx->bvh;
+    struct bvh_node *node = &bvh->nodes[node_i];
+    aabb_init_empty(&node->bounds);
+
+    if (node->prim_count != 0)
+    {
+        for (size_t i = 0; i < node->prim_count; i++)
+        {
+            uint32_t prim = bvh->prim_indices[node->offset + i];
+            aabb_extend(&node->bounds, &ctx->prim_bounds[prim]);
+        }
+        return;
+    }
+
+    refit_subtree(ctx, node->offset);
+    refit_subtree(ctx, node->offset + 1);
+    aabb_extend(&node->bounds, &bvh->nodes[node->offset].bounds);
+    aabb_extend(&node->bounds, &bvh->nodes[node->offset + 1].bounds);
+}
+
+static void refit_worker(void *data, size_t thread_i)
+{
+    (void)thread_i;
+    struct refit_ctx *ctx = data;
+    while (true)
+    {
+        pthread_mutex_lock(&ctx->lock);
+        size_t subtree_i = ctx->next_subtree++;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (subtree_i >= ctx->subtree_count)
+            break;
+
+        refit_subtree(ctx, ctx->subtrees[subtree_i]);
+    }
+}
+
+/*
+** Expands the top levels of the tree breadth first, until there are enough
+** subtrees to keep all threads busy. The expanded nodes are stored in top,
+** parents first, and their count is returned.
+*/
+static size_t split_top_levels(struct refit_ctx *ctx, uint32_t *top,
+                               size_t max_subtrees)
+{
+    const struct bvh_node *nodes = ctx->bvh->nodes;
+    size_t top_count = 0;
+    ctx->subtrees[0] = 0;
+    ctx->subtree_count = 1;
+
+    while (ctx->subtree_count < max_subtrees)
+    {
+        // replace all the inner nodes by their children
+        size_t count = ctx->subtree_count;
+        for (size_t i = 0; i < count; i++)
+        {
+            const struct bvh_node *node = &nodes[ctx->subtrees[i]];
+            if (node->prim_count != 0)
+                continue;
+
+            top[top_count++] = ctx->subtrees[i];
+            ctx->subtrees[i] = node->offset;
+            ctx->subtrees[ctx->subtree_count++] = node->offset + 1;
+        }
+
+        // only leaves are left
+        if (ctx->subtree_count == count)
+            break;
+    }
+    return top_count;
+}
+
+void bvh_refit(struct bvh *bvh, const struct aabb *prim_bounds,
+               struct thread_pool *pool)
+{
+    if (bvh->node_count == 0)
+        return;
+
+    size_t thread_count = pool != NULL ? pool->thread_count : 1;
+    size_t max_subtrees = 1;
+    if (thread_count > 1)
+        max_subtrees = thread_count * BVH_REFIT_TASKS_PER_THREAD;
+
+    // each round at most doubles the number of subtrees, and expands fewer
+    // nodes than there are subtrees
+    struct refit_ctx ctx = {
+        .bvh = bvh,
+        .prim_bounds = prim_bounds,
+        .subtrees = xcalloc(2 * max_subtrees, sizeof(*ctx.subtrees)),
+        .next_subtree = 0,
+    };
+    uint32_t *top = xcalloc(2 * max_subtrees, sizeof(*top));
+    size_t top_count = split_top_levels(&ctx, top, max_subtrees);
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    if (pool != NULL)
+        thread_pool_run(pool, refit_worker, &ctx);
+    else
+        refit_worker(&ctx, 0);
+
+    pthread_mutex_destroy(&ctx.lock);
+
+    // children of top nodes are either subtrees or top nodes expanded later
+    for (size_t i = top_count; i-- > 0;)
+    {
+        struct bvh_node *node = &bvh->nodes[top[i]];
+        node->bounds = bvh->nodes[node->offset].bounds;
+        aabb_extend(&node->bounds, &bvh->nodes[node->offset + 1].bounds);
+    }
+
+    free(top);
+    free(ctx.subtrees);
+}
+
+double bvh_sah_cost(const struct bvh *bvh)
+{
+    if (bvh->node_count == 0)
+        return 0;
+
+    double cost = 0;
+    for (size_t i = 0; i < bvh->node_count; i++)
+    {
+        const struct bvh_node *node = &bvh->nodes[i];
+        double area = aabb_surface_area(&node->bounds);
+        if (node->prim_count == 0)
+            cost += BVH_TRAVERSAL_COST * area;
+        else
+            cost += BVH_INTERSECT_COST * node->prim_count * area;
+    }
+
+    double root_area = aabb_surface_area(&bvh->nodes[0].bounds);
+    return root_area > 0 ? cost / root_area : 0;
+}
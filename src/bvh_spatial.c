@@ -0,0 +1,520 @@
+#include "bvh.h"
+#include "bvh_build.h"
+#include "utils/alloc.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+** A builder allowing references to be split at spatial planes, as described
+** in "Spatial Splits in Bounding Volume Hierarchies" (Stich et al., 2009).
+** Primitives straddling a split plane are referenced by both children, with
+** bounds clipped to their side. Large primitives which overlap many others
+** then no longer force all nodes around them to overlap.
+*/
+
+#define SBVH_BIN_COUNT 32
+
+// spatial splits are only considered when the children of the best object
+// split overlap by more than this fraction of the area of the root
+#define SBVH_OVERLAP_RATIO 1e-5
+
+struct sbvh_ctx
+{
+    struct bvh *bvh;
+    size_t node_capacity;
+
+    // the primitive indices of leaves, which may reference the same
+    // primitive multiple times
+    uint32_t *prim_indices;
+    size_t ref_count;
+    size_t ref_capacity;
+
+    // the total number of references may not exceed max_refs, which bounds
+    // duplication. ref_total counts all the references created so far
+    size_t ref_total;
+    size_t max_refs;
+
+    double root_area;
+    bvh_split_f split;
+    void *data;
+};
+
+struct object_bin
+{
+    struct aabb bounds;
+    size_t count;
+};
+
+struct spatial_bin
+{
+    struct aabb bounds;
+    // the number of references starting and ending in this bin
+    size_t enter;
+    size_t exit;
+};
+
+/*
+** The best split found for a node.
+*/
+struct sbvh_split
+{
+    double cost;
+    int axis;
+    bool spatial;
+    // the first bin of the right child, for object splits
+    size_t bin;
+    // the split plane, for spatial splits
+    double pos;
+};
+
+static void aabb_clip(struct aabb *box, const struct aabb *clip)
+{
+    vec3_update_max_components(&box->min, &clip->min);
+    vec3_update_min_components(&box->max, &clip->max);
+}
+
+static bool aabb_is_empty(const struct aabb *box)
+{
+    return box->min.x > box->max.x || box->min.y > box->max.y
+           || box->min.z > box->max.z;
+}
+
+static void vec3_set(struct vec3 *v, int axis, double x)
+{
+    if (axis == 0)
+        v->x = x;
+    else if (axis == 1)
+        v->y = x;
+    else
+        v->z = x;
+}
+
+/*
+** Splits a reference at a plane, and stores the bounds of both sides.
+*/
+static void split_ref(const struct sbvh_ctx *ctx,
+                      const struct bvh_build_ref *ref, int axis, double pos,
+                      struct aabb *left, struct aabb *right)
+{
+    if (ctx->split != NULL)
+        ctx->split(ctx->data, ref->prim, axis, pos, left, right);
+    else
+    {
+        *left = ref->bounds;
+        *right = ref->bounds;
+    }
+
+    // the reference may already be clipped
+    aabb_clip(left, &ref->bounds);
+    aabb_clip(right, &ref->bounds);
+    struct vec3 *left_max = &left->max;
+    struct vec3 *right_min = &right->min;
+    if (vec3_get(left_max, axis) > pos)
+        vec3_set(left_max, axis, pos);
+    if (vec3_get(right_min, axis) < pos)
+        vec3_set(right_min, axis, pos);
+}
+
+static size_t object_bin_index(const struct bvh_build_ref *ref, int axis,
+                               double min, double scale)
+{
+    size_t i = (vec3_get(&ref->center, axis) - min) * scale;
+    return i < SBVH_BIN_COUNT ? i : SBVH_BIN_COUNT - 1;
+}
+
+/*
+** Finds the best object split, using binned centroids. Also stores the
+** bounds of both children in left and right.
+*/
+static void find_object_split(struct sbvh_split *best,
+                              const struct bvh_build_ref *refs, size_t count,
+                              const struct aabb *center_bounds,
+                              struct aabb *best_left, struct aabb *best_right)
+{
+    best->cost = INFINITY;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double min = vec3_get(&center_bounds->min, axis);
+        double extent = vec3_get(&center_bounds->max, axis) - min;
+        if (extent <= 0)
+            continue;
+
+        struct object_bin bins[SBVH_BIN_COUNT];
+        for (size_t i = 0; i < SBVH_BIN_COUNT; i++)
+        {
+            aabb_init_empty(&bins[i].bounds);
+            bins[i].count = 0;
+        }
+
+        double scale = SBVH_BIN_COUNT / extent;
+        for (size_t i = 0; i < count; i++)
+        {
+            struct object_bin *bin
+                = &bins[object_bin_index(&refs[i], axis, min, scale)];
+            aabb_extend(&bin->bounds, &refs[i].bounds);
+            bin->count++;
+        }
+
+        struct aabb rights[SBVH_BIN_COUNT];
+        size_t right_counts[SBVH_BIN_COUNT];
+        aabb_init_empty(&rights[SBVH_BIN_COUNT - 1]);
+        for (size_t i = SBVH_BIN_COUNT - 1; i > 0; i--)
+        {
+            if (i < SBVH_BIN_COUNT - 1)
+                rights[i] = rights[i + 1];
+            aabb_extend(&rights[i], &bins[i].bounds);
+            right_counts[i] = bins[i].count
+                              + (i < SBVH_BIN_COUNT - 1 ? right_counts[i + 1]
+                                                        : 0);
+        }
+
+        struct aabb left;
+        aabb_init_empty(&left);
+        size_t left_count = 0;
+        for (size_t i = 1; i < SBVH_BIN_COUNT; i++)
+        {
+            aabb_extend(&left, &bins[i - 1].bounds);
+            left_count += bins[i - 1].count;
+            if (left_count == 0 || right_counts[i] == 0)
+                continue;
+
+            double cost = aabb_surface_area(&left) * left_count
+                          + aabb_surface_area(&rights[i]) * right_counts[i];
+            if (cost < best->cost)
+            {
+                *best = (struct sbvh_split){
+                    .cost = cost,
+                    .axis = axis,
+                    .spatial = false,
+                    .bin = i,
+                };
+                *best_left = left;
+                *best_right = rights[i];
+            }
+        }
+    }
+}
+
+/*
+** Finds the best spatial split, by binning the parts of references falling
+** in each slab of the node.
+*/
+static void find_spatial_split(struct sbvh_split *best,
+                               const struct sbvh_ctx *ctx,
+                               const struct bvh_build_ref *refs, size_t count,
+                               const struct aabb *bounds)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double min = vec3_get(&bounds->min, axis);
+        double extent = vec3_get(&bounds->max, axis) - min;
+        if (extent <= 0)
+            continue;
+
+        struct spatial_bin bins[SBVH_BIN_COUNT];
+        for (size_t i = 0; i < SBVH_BIN_COUNT; i++)
+        {
+            aabb_init_empty(&bins[i].bounds);
+            bins[i].enter = 0;
+            bins[i].exit = 0;
+        }
+
+        double bin_size = extent / SBVH_BIN_COUNT;
+        double scale = SBVH_BIN_COUNT / extent;
+        for (size_t i = 0; i < count; i++)
+        {
+            const struct bvh_build_ref *ref = &refs[i];
+            size_t first = (vec3_get(&ref->bounds.min, axis) - min) * scale;
+            size_t last = (vec3_get(&ref->bounds.max, axis) - min) * scale;
+            first = first < SBVH_BIN_COUNT ? first : SBVH_BIN_COUNT - 1;
+            last = last < SBVH_BIN_COUNT ? last : SBVH_BIN_COUNT - 1;
+
+            // chop the reference into the bins it overlaps
+            struct bvh_build_ref rest = *ref;
+            for (size_t bin_i = first; bin_i < last; bin_i++)
+            {
+                struct aabb left;
+                struct aabb right;
+                split_ref(ctx, &rest, axis, min + (bin_i + 1) * bin_size,
+                          &left, &right);
+                if (!aabb_is_empty(&left))
+                    aabb_extend(&bins[bin_i].bounds, &left);
+                rest.bounds = right;
+            }
+            if (!aabb_is_empty(&rest.bounds))
+                aabb_extend(&bins[last].bounds, &rest.bounds);
+            bins[first].enter++;
+            bins[last].exit++;
+        }
+
+        struct aabb rights[SBVH_BIN_COUNT];
+        size_t right_counts[SBVH_BIN_COUNT];
+        aabb_init_empty(&rights[SBVH_BIN_COUNT - 1]);
+        for (size_t i = SBVH_BIN_COUNT - 1; i > 0; i--)
+        {
+            if (i < SBVH_BIN_COUNT - 1)
+                rights[i] = rights[i + 1];
+            aabb_extend(&rights[i], &bins[i].bounds);
+            right_counts[i] = bins[i].exit
+                              + (i < SBVH_BIN_COUNT - 1 ? right_counts[i + 1]
+                                                        : 0);
+        }
+
+        struct aabb left;
+        aabb_init_empty(&left);
+        size_t left_count = 0;
+        for (size_t i = 1; i < SBVH_BIN_COUNT; i++)
+        {
+            aabb_extend(&left, &bins[i - 1].bounds);
+            left_count += bins[i - 1].enter;
+            if (left_count == 0 || right_counts[i] == 0)
+                continue;
+
+            double cost = aabb_surface_area(&left) * left_count
+                          + aabb_surface_area(&rights[i]) * right_counts[i];
+            if (cost < best->cost)
+                *best = (struct sbvh_split){
+                    .cost = cost,
+                    .axis = axis,
+                    .spatial = true,
+                    .pos = min + i * bin_size,
+                };
+        }
+    }
+}
+
+static void push_ref(struct bvh_build_ref **refs, size_t *count,
+                     size_t *capacity, const struct bvh_build_ref *ref)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        *refs = xrealloc(*refs, *capacity * sizeof(**refs));
+    }
+    (*refs)[(*count)++] = *ref;
+}
+
+/*
+** Moves references to the left or right array, depending on the split.
+** References straddling a spatial split plane go to both sides.
+*/
+static void partition_refs(struct sbvh_ctx *ctx,
+                           const struct sbvh_split *split,
+                           const struct bvh_build_ref *refs, size_t count,
+                           const struct aabb *center_bounds,
+                           struct bvh_build_ref **left, size_t *left_count,
+                           struct bvh_build_ref **right, size_t *right_count)
+{
+    size_t left_capacity = 0;
+    size_t right_capacity = 0;
+    *left = NULL;
+    *right = NULL;
+    *left_count = 0;
+    *right_count = 0;
+
+    double min = vec3_get(&center_bounds->min, split->axis);
+    double extent = vec3_get(&center_bounds->max, split->axis) - min;
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct bvh_build_ref *ref = &refs[i];
+        if (!split->spatial)
+        {
+            if (object_bin_index(ref, split->axis, min,
+                                 SBVH_BIN_COUNT / extent)
+                < split->bin)
+                push_ref(left, left_count, &left_capacity, ref);
+            else
+                push_ref(right, right_count, &right_capacity, ref);
+            continue;
+        }
+
+        if (vec3_get(&ref->bounds.max, split->axis) <= split->pos)
+        {
+            push_ref(left, left_count, &left_capacity, ref);
+            continue;
+        }
+
+        if (vec3_get(&ref->bounds.min, split->axis) >= split->pos)
+        {
+            push_ref(right, right_count, &right_capacity, ref);
+            continue;
+        }
+
+        struct bvh_build_ref left_ref = *ref;
+        struct bvh_build_ref right_ref = *ref;
+        split_ref(ctx, ref, split->axis, split->pos, &left_ref.bounds,
+                  &right_ref.bounds);
+        bool left_empty = aabb_is_empty(&left_ref.bounds);
+        bool right_empty = aabb_is_empty(&right_ref.bounds);
+        if (left_empty && right_empty)
+            // rounding errors in clipping shouldn't lose primitives
+            push_ref(left, left_count, &left_capacity, ref);
+        if (!left_empty)
+        {
+            left_ref.center = aabb_center(&left_ref.bounds);
+            push_ref(left, left_count, &left_capacity, &left_ref);
+        }
+        if (!right_empty)
+        {
+            right_ref.center = aabb_center(&right_ref.bounds);
+            push_ref(right, right_count, &right_capacity, &right_ref);
+        }
+    }
+}
+
+static void make_leaf(struct sbvh_ctx *ctx, struct bvh_node *node,
+                      const struct bvh_build_ref *refs, size_t count)
+{
+    if (ctx->ref_count + count > ctx->ref_capacity)
+    {
+        while (ctx->ref_count + count > ctx->ref_capacity)
+            ctx->ref_capacity *= 2;
+        ctx->prim_indices = xrealloc(
+            ctx->prim_indices, ctx->ref_capacity * sizeof(*ctx->prim_indices));
+    }
+
+    node->offset = ctx->ref_count;
+    node->prim_count = count;
+    for (size_t i = 0; i < count; i++)
+        ctx->prim_indices[ctx->ref_count++] = refs[i].prim;
+}
+
+/*
+** Builds the subtree of a node. The node takes ownership of refs.
+*/
+static void build_node(struct sbvh_ctx *ctx, size_t node_i,
+                       struct bvh_build_ref *refs, size_t count, size_t depth)
+{
+    struct bvh_node *node = &ctx->bvh->nodes[node_i];
+    struct aabb center_bounds;
+    bvh_build_refs_bounds(&node->bounds, &center_bounds, refs, count);
+
+    struct bvh_build_ref *left;
+    struct bvh_build_ref *right;
+    size_t left_count = 0;
+    size_t right_count = 0;
+    double node_area = aabb_surface_area(&node->bounds);
+    if (count > 1 && depth < BVH_MEDIAN_DEPTH && node_area > 0)
+    {
+        struct sbvh_split split;
+        struct aabb object_left;
+        struct aabb object_right;
+        find_object_split(&split, refs, count, &center_bounds, &object_left,
+                          &object_right);
+
+        // only look for spatial splits when children would overlap a lot,
+        // and the duplication budget isn't exhausted
+        struct aabb overlap = object_left;
+        aabb_clip(&overlap, &object_right);
+        double overlap_area
+            = aabb_is_empty(&overlap) ? 0 : aabb_surface_area(&overlap);
+        if (ctx->ref_total < ctx->max_refs
+            && overlap_area > SBVH_OVERLAP_RATIO * ctx->root_area)
+            find_spatial_split(&split, ctx, refs, count, &node->bounds);
+
+        double cost = BVH_TRAVERSAL_COST
+                      + BVH_INTERSECT_COST * split.cost / node_area;
+        if (!isinf(split.cost) && !bvh_build_make_leaf(count, cost))
+        {
+            partition_refs(ctx, &split, refs, count, &center_bounds, &left,
+                           &left_count, &right, &right_count);
+
+            // splits which don't separate anything, or go over budget, are
+            // replaced by a median split
+            size_t new_refs = left_count + right_count - count;
+            if (left_count == 0 || right_count == 0
+                || ctx->ref_total + new_refs > ctx->max_refs)
+            {
+                free(left);
+                free(right);
+                left_count = 0;
+                right_count = 0;
+            }
+            else
+                ctx->ref_total += new_refs;
+        }
+        else if (count <= BVH_MAX_LEAF_SIZE)
+        {
+            make_leaf(ctx, node, refs, count);
+            free(refs);
+            return;
+        }
+    }
+
+    if (left_count == 0)
+    {
+        if (count <= BVH_MAX_LEAF_SIZE)
+        {
+            make_leaf(ctx, node, refs, count);
+            free(refs);
+            return;
+        }
+
+        // median split along the largest axis of the centroids
+        bvh_build_sort_refs(refs, count,
+                            bvh_build_largest_axis(&center_bounds));
+        left_count = count / 2;
+        right_count = count - left_count;
+        left = xcalloc(left_count, sizeof(*left));
+        right = xcalloc(right_count, sizeof(*right));
+        for (size_t i = 0; i < left_count; i++)
+            left[i] = refs[i];
+        for (size_t i = 0; i < right_count; i++)
+            right[i] = refs[left_count + i];
+    }
+    free(refs);
+
+    struct bvh *bvh = ctx->bvh;
+    if (bvh->node_count + 2 > ctx->node_capacity)
+    {
+        ctx->node_capacity *= 2;
+        bvh->nodes
+            = xrealloc(bvh->nodes, ctx->node_capacity * sizeof(*bvh->nodes));
+    }
+
+    size_t left_i = bvh->node_count;
+    bvh->node_count += 2;
+    node = &bvh->nodes[node_i];
+    node->offset = left_i;
+    node->prim_count = 0;
+
+    build_node(ctx, left_i, left, left_count, depth + 1);
+    build_node(ctx, left_i + 1, right, right_count, depth + 1);
+}
+
+void bvh_build_spatial(struct bvh *bvh, struct bvh_build_ref *refs,
+                       double budget, bvh_split_f split, void *data)
+{
+    struct sbvh_ctx ctx = {
+        .bvh = bvh,
+        .node_capacity = 2 * bvh->prim_count - 1,
+        .ref_capacity = bvh->prim_count,
+        .ref_total = bvh->prim_count,
+        .split = split,
+        .data = data,
+    };
+    ctx.prim_indices = xcalloc(ctx.ref_capacity, sizeof(*ctx.prim_indices));
+
+    // leaves reference at most 2^32 primitives. the limit is clamped before
+    // converting it, as large budgets don't fit in a size_t
+    double max_refs = bvh->prim_count + bvh->prim_count * budget;
+    ctx.max_refs = max_refs <= UINT32_MAX ? (size_t)max_refs : UINT32_MAX;
+
+    bvh->nodes = xcalloc(ctx.node_capacity, sizeof(*bvh->nodes));
+    bvh->node_count = 1;
+
+    // the builder takes ownership of its references
+    struct bvh_build_ref *root_refs = xcalloc(bvh->prim_count, sizeof(*refs));
+    for (size_t i = 0; i < bvh->prim_count; i++)
+        root_refs[i] = refs[i];
+
+    struct aabb center_bounds;
+    bvh_build_refs_bounds(&bvh->nodes[0].bounds, &center_bounds, refs,
+                          bvh->prim_count);
+    ctx.root_area = aabb_surface_area(&bvh->nodes[0].bounds);
+    build_node(&ctx, 0, root_refs, bvh->prim_count, 0);
+
+    bvh->prim_indices = ctx.prim_indices;
+    bvh->ref_count = ctx.ref_count;
+}
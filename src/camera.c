@@ -24,4 +24,5 @@ void camera_cast_ray(struct ray *ray, const struct camera *camera, double cam_x,
         = vec3_add(&vantage_point_offset, &camera->center);
     ray->direction = vec3_sub(&ray->source, &vantage_point);
     vec3_normalize(&ray->direction);
+    ray_update_inv_direction(ray);
 }
@@ -0,0 +1,204 @@
+#include "compiled_prims.h"
+#include "mesh.h"
+#include "utils/alloc.h"
+#include "utils/cpu.h"
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+static enum compiled_prim_type compiled_prim_type(const struct object *obj)
+{
+    if (obj->intersect == object_sphere_ray_intersect)
+        return COMPILED_PRIM_SPHERE;
+    if (obj->intersect == object_triangle_ray_intersect)
+        return COMPILED_PRIM_TRIANGLE;
+    if (obj->intersect == object_mesh_ray_intersect)
+        return COMPILED_PRIM_MESH_FACE;
+    return COMPILED_PRIM_OBJECT;
+}
+
+/*
+** Returns which meshes of the map get their faces copied, by object index.
+** Meshes are picked in the order of objects, as long as their faces fit in
+** what is left of the budget.
+*/
+static bool *compiled_prims_copied_meshes(const struct prim_map *map)
+{
+    size_t object_count = object_vect_size(map->objects);
+    bool *copied = xcalloc(object_count, sizeof(*copied));
+    size_t budget = COMPILED_PRIMS_MESH_COPY_BUDGET;
+    for (size_t i = 0; i < object_count; i++)
+    {
+        const struct object *obj = object_vect_get(map->objects, i);
+        if (compiled_prim_type(obj) != COMPILED_PRIM_MESH_FACE)
+            continue;
+
+        size_t face_count = ((const struct mesh *)obj)->face_count;
+        if (face_count > budget)
+            continue;
+
+        copied[i] = true;
+        budget -= face_count;
+    }
+    return copied;
+}
+
+static size_t compiled_prims_block_count(const struct compiled_prims *prims)
+{
+    return (prims->triangle_count + TRIANGLE_BLOCK_WIDTH - 1)
+           / TRIANGLE_BLOCK_WIDTH;
+}
+
+/*
+** Gives the next free slot of its type to a primitive, if it doesn't have
+** one yet.
+*/
+static void compiled_prims_place(struct compiled_prims *prims,
+                                 const struct prim_map *map,
+                                 const bool *copied, size_t prim)
+{
+    if (prims->refs[prim] != UINT32_MAX)
+        return;
+
+    size_t obj_prim;
+    const struct object *obj = prim_map_get(map, prim, &obj_prim);
+    enum compiled_prim_type type = compiled_prim_type(obj);
+    size_t index = prim;
+    // faces of meshes within the budget are copied along with their edges,
+    // which saves computing them on every test
+    if (type == COMPILED_PRIM_MESH_FACE && copied[map->prim_objects[prim]])
+        type = COMPILED_PRIM_TRIANGLE;
+
+    if (type == COMPILED_PRIM_SPHERE)
+        index = prims->sphere_count++;
+    else if (type == COMPILED_PRIM_TRIANGLE)
+        index = prims->triangle_count++;
+
+    if (index > COMPILED_PRIM_INDEX_MASK)
+        errx(1, "too many primitives of the same type");
+    prims->refs[prim] = (uint32_t)type << COMPILED_PRIM_TYPE_SHIFT | index;
+}
+
+void compiled_prims_build(struct compiled_prims *prims,
+                          const struct prim_map *map, const uint32_t *order,
+                          size_t order_count)
+{
+    prims->prim_count = map->prim_count;
+    prims->refs = xcalloc(map->prim_count, sizeof(*prims->refs));
+    for (size_t i = 0; i < map->prim_count; i++)
+        prims->refs[i] = UINT32_MAX;
+
+    bool *copied = compiled_prims_copied_meshes(map);
+    prims->sphere_count = 0;
+    prims->triangle_count = 0;
+    for (size_t i = 0; i < order_count; i++)
+        compiled_prims_place(prims, map, copied, order[i]);
+    for (size_t i = 0; i < map->prim_count; i++)
+        compiled_prims_place(prims, map, copied, i);
+    free(copied);
+
+    prims->spheres = xcalloc(prims->sphere_count, sizeof(*prims->spheres));
+    // unused lanes of the last block are left with null edges
+    prims->triangle_blocks = xcalloc(compiled_prims_block_count(prims),
+                                     sizeof(*prims->triangle_blocks));
+    prims->intersect_block = cpu_has_avx() ? triangle_block_intersect_avx
+                                           : triangle_block_intersect;
+    compiled_prims_update(prims, map);
+}
+
+void compiled_prims_update(struct compiled_prims *prims,
+                           const struct prim_map *map)
+{
+    for (size_t prim = 0; prim < prims->prim_count; prim++)
+    {
+        uint32_t ref = prims->refs[prim];
+        uint32_t index = ref & COMPILED_PRIM_INDEX_MASK;
+        size_t obj_prim;
+        const struct object *obj = prim_map_get(map, prim, &obj_prim);
+        switch ((enum compiled_prim_type)(ref >> COMPILED_PRIM_TYPE_SHIFT))
+        {
+        case COMPILED_PRIM_SPHERE:
+        {
+            const struct sphere *sphere = (const struct sphere *)obj;
+            prims->spheres[index] = (struct compiled_sphere){
+                .center = sphere->center,
+                .radius = sphere->radius,
+            };
+            break;
+        }
+        case COMPILED_PRIM_TRIANGLE:
+        {
+            struct triangle_block *block
+                = &prims->triangle_blocks[index / TRIANGLE_BLOCK_WIDTH];
+            size_t lane = index % TRIANGLE_BLOCK_WIDTH;
+            if (obj->intersect == object_mesh_ray_intersect)
+            {
+                const struct mesh *mesh = (const struct mesh *)obj;
+                struct vec3 edges[2];
+                const struct vec3 *v0 = mesh_face_edges(mesh, obj_prim, edges);
+                triangle_block_set_edges(block, lane, v0, &edges[0],
+                                         &edges[1], prim);
+                break;
+            }
+
+            const struct triangle *source = (const struct triangle *)obj;
+            triangle_block_set_edges(block, lane, &source->points[0],
+                                     &source->edges[0], &source->edges[1],
+                                     prim);
+            break;
+        }
+        case COMPILED_PRIM_MESH_FACE:
+        case COMPILED_PRIM_OBJECT:
+            break;
+        }
+    }
+}
+
+void compiled_prims_destroy(struct compiled_prims *prims)
+{
+    free(prims->refs);
+    free(prims->spheres);
+    free(prims->triangle_blocks);
+    *prims = (struct compiled_prims){0};
+}
+
+size_t compiled_prims_memory(const struct compiled_prims *prims)
+{
+    return prims->prim_count * sizeof(*prims->refs)
+           + prims->sphere_count * sizeof(*prims->spheres)
+           + compiled_prims_block_count(prims)
+                 * sizeof(*prims->triangle_blocks);
+}
+
+bool compiled_prims_intersect_triangles(const struct compiled_prims *prims,
+                                        size_t first, size_t count,
+                                        const struct ray *ray,
+                                        double max_dist,
+                                        struct triangle_block_hit *hit)
+{
+    bool found = false;
+    size_t end = first + count;
+    // leaves may start anywhere in a block, and span the next one
+    for (size_t i = first; i < end;)
+    {
+        size_t block_i = i / TRIANGLE_BLOCK_WIDTH;
+        size_t block_start = block_i * TRIANGLE_BLOCK_WIDTH;
+        size_t lane_end = end - block_start;
+        if (lane_end > TRIANGLE_BLOCK_WIDTH)
+            lane_end = TRIANGLE_BLOCK_WIDTH;
+
+        struct triangle_block_hit block_hit;
+        if (prims->intersect_block(&prims->triangle_blocks[block_i],
+                                   i - block_start, lane_end, ray, max_dist,
+                                   &block_hit)
+            && (!found || block_hit.dist < hit->dist
+                || (block_hit.dist == hit->dist && block_hit.prim < hit->prim)))
+        {
+            *hit = block_hit;
+            found = true;
+        }
+        i = block_start + TRIANGLE_BLOCK_WIDTH;
+    }
+    return found;
+}
@@ -0,0 +1,111 @@
+#include "mesh.h"
+#include "triangle.h"
+#include "utils/alloc.h"
+
+#include <stdlib.h>
+
+struct mesh *mesh_create(size_t vertex_count, size_t face_count,
+                         struct material **materials, size_t material_count)
+{
+    struct mesh *mesh = zalloc(sizeof(*mesh));
+    object_init(&mesh->base, object_mesh_ray_intersect, object_mesh_resolve,
+                object_mesh_occluded, object_mesh_bounds, object_mesh_split,
+                mesh_free);
+    mesh->base.prim_count = face_count;
+
+    mesh->vertices = xcalloc(vertex_count, sizeof(*mesh->vertices));
+    mesh->vertex_count = vertex_count;
+    mesh->indices = xcalloc(3 * face_count, sizeof(*mesh->indices));
+    mesh->face_materials = xcalloc(face_count, sizeof(*mesh->face_materials));
+    mesh->face_count = face_count;
+
+    mesh->materials = xcalloc(material_count, sizeof(*mesh->materials));
+    mesh->material_count = material_count;
+    for (size_t i = 0; i < material_count; i++)
+        mesh->materials[i] = material_get(materials[i]);
+    return mesh;
+}
+
+double object_mesh_ray_intersect(struct object_hit *hit,
+                                 const struct object *obj, size_t prim,
+                                 const struct ray *ray)
+{
+    const struct mesh *mesh = (const struct mesh *)obj;
+    struct vec3 edges[2];
+    const struct vec3 *v0 = mesh_face_edges(mesh, prim, edges);
+    return triangle_intersect(v0, &edges[0], &edges[1], ray, INFINITY,
+                              &hit->u, &hit->v);
+}
+
+void object_mesh_resolve(struct object_intersection *inter,
+                         const struct object *obj, size_t prim,
+                         const struct ray *ray, double dist,
+                         const struct object_hit *hit)
+{
+    const struct mesh *mesh = (const struct mesh *)obj;
+    struct vec3 edges[2];
+    mesh_face_edges(mesh, prim, edges);
+
+    struct vec3 point_offset = vec3_mul(&ray->direction, dist);
+    inter->location.point = vec3_add(&ray->source, &point_offset);
+    inter->location.normal = vec3_cross(&edges[0], &edges[1]);
+    vec3_normalize(&inter->location.normal);
+    inter->location.u = hit->u;
+    inter->location.v = hit->v;
+    inter->material = mesh->materials[mesh->face_materials[prim]];
+}
+
+bool object_mesh_occluded(const struct object *obj, size_t prim,
+                          const struct ray *ray, double max_dist)
+{
+    const struct mesh *mesh = (const struct mesh *)obj;
+    struct vec3 edges[2];
+    const struct vec3 *v0 = mesh_face_edges(mesh, prim, edges);
+    double u;
+    double v;
+    return !isinf(
+        triangle_intersect(v0, &edges[0], &edges[1], ray, max_dist, &u, &v));
+}
+
+void object_mesh_bounds(struct aabb *bounds, const struct object *obj,
+                        size_t prim)
+{
+    const struct mesh *mesh = (const struct mesh *)obj;
+    aabb_init_empty(bounds);
+    for (size_t i = 0; i < 3; i++)
+        aabb_extend_point(bounds, &mesh->vertices[mesh->indices[3 * prim + i]]);
+}
+
+void object_mesh_split(const struct object *obj, size_t prim, int axis,
+                       double pos, struct aabb *left, struct aabb *right)
+{
+    const struct mesh *mesh = (const struct mesh *)obj;
+    const uint32_t *indices = &mesh->indices[3 * prim];
+    const struct vec3 *points[3] = {
+        &mesh->vertices[indices[0]],
+        &mesh->vertices[indices[1]],
+        &mesh->vertices[indices[2]],
+    };
+    triangle_split(points, axis, pos, left, right);
+}
+
+size_t mesh_memory(const struct mesh *mesh)
+{
+    return sizeof(*mesh) + mesh->vertex_count * sizeof(*mesh->vertices)
+           + mesh->face_count
+                 * (3 * sizeof(*mesh->indices)
+                    + sizeof(*mesh->face_materials))
+           + mesh->material_count * sizeof(*mesh->materials);
+}
+
+void mesh_free(struct object *obj)
+{
+    struct mesh *mesh = (struct mesh *)obj;
+    for (size_t i = 0; i < mesh->material_count; i++)
+        material_put(mesh->materials[i]);
+    free(mesh->materials);
+    free(mesh->vertices);
+    free(mesh->indices);
+    free(mesh->face_materials);
+    free(mesh);
+}
@@ -2,12 +2,13 @@
 #include "normal_material.h"
 #include "phong_material.h"
 #include "scene.h"
-#include "triangle.h"
+#include "mesh.h"
 #include "utils/alloc.h"
 #include "utils/evect.h"
 
 #include <err.h>
 #include <libgen.h>
+#include <stdint.h>
 
 #define TINYOBJ_LOADER_C_IMPLEMENTATION
 #include "tinyobj_loader_c.h"
@@ -85,7 +86,110 @@ static void get_file_data(const char *filename, const int is_mtl,
 #undef GVECT_NAME
 #undef GVECT_TYPE
 
-int load_obj(struct scene *scene, const char *filename)
+/*
+** The state shared by shape conversions.
+*/
+struct shape_converter
+{
+    const tinyobj_attrib_t *attrib;
+    // the index in the current mesh of each vertex of the file, or
+    // UINT32_MAX if the mesh doesn't use it
+    uint32_t *vertex_map;
+    // the index in the file of each vertex of the current mesh
+    uint32_t *mesh_vertices;
+    struct material **materials;
+    size_t material_count;
+};
+
+/*
+** Converts polygons face_begin to face_end of the file to a mesh, whose
+** vertex indices start at index_begin. Polygons are split into triangle
+** fans. Returns NULL if a polygon has no material or refers to a vertex
+** the file doesn't have, and stores why in error.
+*/
+static struct mesh *convert_shape(struct shape_converter *conv,
+                                  size_t face_begin, size_t face_end,
+                                  size_t index_begin, const char **error)
+{
+    const tinyobj_attrib_t *attrib = conv->attrib;
+    size_t index_i = index_begin;
+    for (size_t face_i = face_begin; face_i < face_end; face_i++)
+    {
+        int mat_id = attrib->material_ids[face_i];
+        if (mat_id < 0 || (size_t)mat_id >= conv->material_count)
+        {
+            *error = "faces without materials aren't supported";
+            return NULL;
+        }
+
+        // indices are used to index the vertex map below
+        size_t face_size = attrib->face_num_verts[face_i];
+        for (size_t node_i = 0; node_i < face_size; node_i++)
+        {
+            int v_idx = attrib->faces[index_i++].v_idx;
+            if (v_idx < 0 || (size_t)v_idx >= attrib->num_vertices)
+            {
+                *error = "face vertex index out of range";
+                return NULL;
+            }
+        }
+    }
+
+    // number the vertices of the shape in the order they're used
+    size_t vertex_count = 0;
+    size_t triangle_count = 0;
+    index_i = index_begin;
+    for (size_t face_i = face_begin; face_i < face_end; face_i++)
+    {
+        size_t face_size = attrib->face_num_verts[face_i];
+        if (face_size >= 3)
+            triangle_count += face_size - 2;
+
+        for (size_t node_i = 0; node_i < face_size; node_i++)
+        {
+            int v_idx = attrib->faces[index_i++].v_idx;
+            if (conv->vertex_map[v_idx] != UINT32_MAX)
+                continue;
+            conv->vertex_map[v_idx] = vertex_count;
+            conv->mesh_vertices[vertex_count++] = v_idx;
+        }
+    }
+
+    struct mesh *mesh = mesh_create(vertex_count, triangle_count,
+                                    conv->materials, conv->material_count);
+    for (size_t i = 0; i < vertex_count; i++)
+    {
+        const float *vertex = &attrib->vertices[3 * conv->mesh_vertices[i]];
+        mesh->vertices[i] = (struct vec3){vertex[0], vertex[1], vertex[2]};
+    }
+
+    size_t triangle_i = 0;
+    index_i = index_begin;
+    for (size_t face_i = face_begin; face_i < face_end; face_i++)
+    {
+        const tinyobj_vertex_index_t *face = &attrib->faces[index_i];
+        size_t face_size = attrib->face_num_verts[face_i];
+        index_i += face_size;
+        for (size_t node_i = 2; node_i < face_size; node_i++)
+        {
+            uint32_t *indices = &mesh->indices[3 * triangle_i];
+            indices[0] = conv->vertex_map[face[0].v_idx];
+            indices[1] = conv->vertex_map[face[node_i - 1].v_idx];
+            indices[2] = conv->vertex_map[face[node_i].v_idx];
+            mesh->face_materials[triangle_i++] = attrib->material_ids[face_i];
+        }
+    }
+
+    // other shapes may use the same vertices
+    for (size_t i = 0; i < vertex_count; i++)
+        conv->vertex_map[conv->mesh_vertices[i]] = UINT32_MAX;
+    return mesh;
+}
+
+/*
+** Converts the shapes of an obj file to meshes, and adds them to objects.
+*/
+static int load_obj_objects(struct object_vect *objects, const char *filename)
 {
     tinyobj_attrib_t attrib;
     tinyobj_shape_t *shapes = NULL;
@@ -93,8 +197,10 @@ int load_obj(struct scene *scene, const char *filename)
     tinyobj_material_t *materials = NULL;
     size_t num_materials;
 
+    // polygons are triangulated when converting shapes, as the loader's
+    // triangulation breaks the face ranges of shapes
     int rc;
-    unsigned int flags = TINYOBJ_FLAG_TRIANGULATE;
+    unsigned int flags = 0;
 
     rc = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials,
                            &num_materials, filename, get_file_data, flags);
@@ -119,30 +225,58 @@ int load_obj(struct scene *scene, const char *filename)
         phong_material_vect_push(&conv_materials, shape_material);
     }
 
-    // convert faces
-    for (size_t face_i = 0; face_i < attrib.num_face_num_verts; face_i++)
+    // all meshes share the same materials
+    struct material **mesh_materials
+        = xcalloc(num_materials, sizeof(*mesh_materials));
+    for (size_t i = 0; i < num_materials; i++)
+        mesh_materials[i] = &phong_material_vect_get(&conv_materials, i)->base;
+
+    // convert shapes to meshes, which only hold the vertices they use
+    struct shape_converter conv = {
+        .attrib = &attrib,
+        .vertex_map = xcalloc(attrib.num_vertices, sizeof(*conv.vertex_map)),
+        .mesh_vertices
+        = xcalloc(attrib.num_vertices, sizeof(*conv.mesh_vertices)),
+        .materials = mesh_materials,
+        .material_count = num_materials,
+    };
+    for (size_t i = 0; i < attrib.num_vertices; i++)
+        conv.vertex_map[i] = UINT32_MAX;
+
+    // shapes are ranges of faces, in order
+    size_t face_i = 0;
+    size_t index_i = 0;
+    for (size_t shape_i = 0; shape_i < num_shapes; shape_i++)
     {
-        assert(attrib.face_num_verts[face_i] == 3);
-        int mat_id = attrib.material_ids[face_i];
-        struct phong_material *mat
-            = phong_material_vect_get(&conv_materials, mat_id);
+        const tinyobj_shape_t *shape = &shapes[shape_i];
+        size_t face_end = shape->face_offset + shape->length;
+        if (face_end > attrib.num_face_num_verts)
+            face_end = attrib.num_face_num_verts;
+        if (shape->face_offset < face_i || face_end <= shape->face_offset)
+            continue;
 
-        size_t face_off = face_i * 3;
-        struct vec3 points[3];
+        for (; face_i < shape->face_offset; face_i++)
+            index_i += attrib.face_num_verts[face_i];
 
-        for (size_t node_i = 0; node_i < 3; node_i++)
+        const char *error;
+        struct mesh *mesh
+            = convert_shape(&conv, face_i, face_end, index_i, &error);
+        if (mesh == NULL)
         {
-            tinyobj_vertex_index_t node_idx = attrib.faces[face_off + node_i];
-            size_t node_vertex_offset = 3 * node_idx.v_idx;
-            points[node_i].x = attrib.vertices[node_vertex_offset + 0];
-            points[node_i].y = attrib.vertices[node_vertex_offset + 1];
-            points[node_i].z = attrib.vertices[node_vertex_offset + 2];
+            warnx("%s: %s", error, filename);
+            rc = TINYOBJ_ERROR_INVALID_PARAMETER;
+            break;
         }
+        object_vect_push(objects, &mesh->base);
 
-        struct triangle *trian = triangle_create(points, &mat->base);
-        object_vect_push(&scene->objects, &trian->base);
+        for (; face_i < face_end; face_i++)
+            index_i += attrib.face_num_verts[face_i];
     }
 
+    free(conv.mesh_vertices);
+    free(conv.vertex_map);
+    free(mesh_materials);
+
     // release the reference counter of materials
     for (size_t i = 0; i < num_materials; i++)
     {
@@ -157,5 +291,24 @@ int load_obj(struct scene *scene, const char *filename)
     tinyobj_attrib_free(&attrib);
     tinyobj_shapes_free(shapes, num_shapes);
     tinyobj_materials_free(materials, num_materials);
-    return 0;
+    return rc == TINYOBJ_SUCCESS ? 0 : -1;
+}
+
+int load_obj(struct scene *scene, const char *filename)
+{
+    return load_obj_objects(&scene->objects, filename);
+}
+
+struct object_group *load_obj_group(const char *filename,
+                                    const struct bvh_build_options *options)
+{
+    struct object_group *group = object_group_create();
+    if (load_obj_objects(&group->objects, filename))
+    {
+        object_group_put(group);
+        return NULL;
+    }
+
+    object_group_build(group, options);
+    return group;
 }
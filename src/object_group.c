@@ -0,0 +1,283 @@
+#include "object_group.h"
+#include "utils/alloc.h"
+
+#include <err.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+static void object_group_free(struct object_group *group)
+{
+    for (size_t i = 0; i < object_vect_size(&group->objects); i++)
+    {
+        struct object *obj = object_vect_get(&group->objects, i);
+        if (obj->free)
+            obj->free(obj);
+    }
+
+    object_vect_destroy(&group->objects);
+    prim_map_destroy(&group->prims);
+    compiled_prims_destroy(&group->compiled);
+    bvh4_destroy(&group->bvh4);
+    bvh_destroy(&group->bvh);
+    free(group);
+}
+
+struct object_group *object_group_create(void)
+{
+    struct object_group *group = zalloc(sizeof(*group));
+    // this cast is safe as refcnt is the first field of object_group
+    ref_init(&group->refcnt, (refcnt_free_f)object_group_free);
+    object_vect_init(&group->objects, 42);
+    aabb_init_empty(&group->bounds);
+    return group;
+}
+
+void object_group_build(struct object_group *group,
+                        const struct bvh_build_options *options)
+{
+    bvh4_destroy(&group->bvh4);
+    bvh_destroy(&group->bvh);
+    compiled_prims_destroy(&group->compiled);
+    prim_map_destroy(&group->prims);
+
+    // hits only have room for a single level of nesting
+    for (size_t i = 0; i < object_vect_size(&group->objects); i++)
+        if (object_vect_get(&group->objects, i)->intersect
+            == object_instance_ray_intersect)
+            errx(1, "groups can't contain instances");
+
+    prim_map_build(&group->prims, &group->objects);
+    struct aabb *bounds = prim_map_bounds(&group->prims, &group->bounds);
+    bvh_build_split(&group->bvh, bounds, group->prims.prim_count, options,
+                    prim_map_split, &group->prims);
+    compiled_prims_build(&group->compiled, &group->prims,
+                         group->bvh.prim_indices, group->bvh.ref_count);
+    bvh4_build(&group->bvh4, &group->bvh);
+    free(bounds);
+}
+
+/*
+** The state of a closest hit query in a group.
+*/
+struct group_intersect_ctx
+{
+    const struct object_group *group;
+    struct object_hit *closest_hit;
+    double closest_dist;
+};
+
+static double group_intersect_prim(void *data, size_t prim,
+                                   const struct ray *ray)
+{
+    struct group_intersect_ctx *ctx = data;
+    struct object_hit hit;
+    double intersection_dist = compiled_prims_intersect(
+        &ctx->group->compiled, &ctx->group->prims, prim, ray, &hit);
+    if (isinf(intersection_dist) || intersection_dist > ctx->closest_dist)
+        return intersection_dist;
+
+    // break ties using the primitive index, as the scene does
+    if (intersection_dist == ctx->closest_dist
+        && prim > ctx->closest_hit->inner_prim)
+        return intersection_dist;
+
+    ctx->closest_dist = intersection_dist;
+    ctx->closest_hit->u = hit.u;
+    ctx->closest_hit->v = hit.v;
+    ctx->closest_hit->inner_prim = prim;
+    return intersection_dist;
+}
+
+static double group_intersect_leaf(void *data, const uint32_t *prims,
+                                   size_t prim_count, const struct ray *ray)
+{
+    struct group_intersect_ctx *ctx = data;
+    const struct compiled_prims *compiled = &ctx->group->compiled;
+
+    // leaves of consecutive triangles are tested a block at a time
+    size_t first;
+    if (!compiled_prims_triangle_run(compiled, prims, prim_count, &first))
+    {
+        double closest_dist = INFINITY;
+        for (size_t i = 0; i < prim_count; i++)
+        {
+            double dist = group_intersect_prim(ctx, prims[i], ray);
+            if (dist < closest_dist)
+                closest_dist = dist;
+        }
+        return closest_dist;
+    }
+
+    // only look for hits up to the closest one so far, included, as a hit
+    // at the same distance may still win the tie
+    double max_dist = nextafter(ctx->closest_dist, INFINITY);
+    struct triangle_block_hit hit;
+    if (!compiled_prims_intersect_triangles(compiled, first, prim_count, ray,
+                                            max_dist, &hit))
+        return INFINITY;
+
+    if (hit.dist > ctx->closest_dist
+        || (hit.dist == ctx->closest_dist
+            && hit.prim > ctx->closest_hit->inner_prim))
+        return hit.dist;
+
+    ctx->closest_dist = hit.dist;
+    ctx->closest_hit->u = hit.u;
+    ctx->closest_hit->v = hit.v;
+    ctx->closest_hit->inner_prim = hit.prim;
+    return hit.dist;
+}
+
+double object_group_intersect(struct object_hit *hit,
+                              const struct object_group *group,
+                              const struct ray *ray)
+{
+    hit->inner_prim = SIZE_MAX;
+    struct group_intersect_ctx ctx = {
+        .group = group,
+        .closest_hit = hit,
+        .closest_dist = INFINITY,
+    };
+    hit->inner_dist
+        = bvh4_intersect(&group->bvh4, ray, group_intersect_leaf, &ctx);
+    return hit->inner_dist;
+}
+
+void object_group_resolve(struct object_intersection *inter,
+                          const struct object_group *group,
+                          const struct ray *ray, const struct object_hit *hit)
+{
+    size_t obj_prim;
+    struct object *obj = prim_map_get(&group->prims, hit->inner_prim,
+                                      &obj_prim);
+    obj->resolve(inter, obj, obj_prim, ray, hit->inner_dist, hit);
+}
+
+static bool group_occluded_prim(void *data, size_t prim,
+                                const struct ray *ray, double max_dist)
+{
+    const struct object_group *group = data;
+    return compiled_prims_occluded(&group->compiled, &group->prims, prim, ray,
+                                   max_dist);
+}
+
+static bool group_occluded_leaf(void *data, const uint32_t *prims,
+                                size_t prim_count, const struct ray *ray,
+                                double max_dist)
+{
+    const struct object_group *group = data;
+    size_t first;
+    if (compiled_prims_triangle_run(&group->compiled, prims, prim_count,
+                                    &first))
+    {
+        struct triangle_block_hit hit;
+        return compiled_prims_intersect_triangles(
+            &group->compiled, first, prim_count, ray, max_dist, &hit);
+    }
+
+    for (size_t i = 0; i < prim_count; i++)
+        if (group_occluded_prim(data, prims[i], ray, max_dist))
+            return true;
+    return false;
+}
+
+bool object_group_occluded(const struct object_group *group,
+                           const struct ray *ray, double max_dist)
+{
+    // the callback doesn't modify the group, but takes a non const pointer
+    return bvh4_occluded(&group->bvh4, ray, max_dist, group_occluded_leaf,
+                         (struct object_group *)group);
+}
+
+/*
+** Brings a ray to the coordinate system of the instanced group, and returns
+** the factor from distances along the scene's ray to distances along this
+** one.
+*/
+static double instance_object_ray(struct ray *object_ray,
+                                  const struct instance *instance,
+                                  const struct ray *ray)
+{
+    // primitives expect normalized directions, so distances along the
+    // object space ray have to be scaled back
+    object_ray->source = transform_point(&instance->to_object, &ray->source);
+    object_ray->direction
+        = transform_vector(&instance->to_object, &ray->direction);
+    double scale = vec3_length(&object_ray->direction);
+    object_ray->direction = vec3_mul(&object_ray->direction, 1 / scale);
+    ray_update_inv_direction(object_ray);
+    return scale;
+}
+
+double object_instance_ray_intersect(struct object_hit *hit,
+                                     const struct object *obj, size_t prim,
+                                     const struct ray *ray)
+{
+    (void)prim;
+    const struct instance *instance = (const struct instance *)obj;
+
+    struct ray object_ray;
+    double scale = instance_object_ray(&object_ray, instance, ray);
+    double dist = object_group_intersect(hit, instance->group, &object_ray);
+    return dist / scale;
+}
+
+void object_instance_resolve(struct object_intersection *inter,
+                             const struct object *obj, size_t prim,
+                             const struct ray *ray, double dist,
+                             const struct object_hit *hit)
+{
+    (void)prim;
+    const struct instance *instance = (const struct instance *)obj;
+
+    struct ray object_ray;
+    instance_object_ray(&object_ray, instance, ray);
+    object_group_resolve(inter, instance->group, &object_ray, hit);
+
+    struct vec3 point_offset = vec3_mul(&ray->direction, dist);
+    inter->location.point = vec3_add(&ray->source, &point_offset);
+    inter->location.normal
+        = transform_normal(&instance->to_object, &inter->location.normal);
+    vec3_normalize(&inter->location.normal);
+}
+
+bool object_instance_occluded(const struct object *obj, size_t prim,
+                              const struct ray *ray, double max_dist)
+{
+    (void)prim;
+    const struct instance *instance = (const struct instance *)obj;
+    struct ray object_ray;
+    double scale = instance_object_ray(&object_ray, instance, ray);
+    return object_group_occluded(instance->group, &object_ray,
+                                 max_dist * scale);
+}
+
+void object_instance_bounds(struct aabb *bounds, const struct object *obj,
+                            size_t prim)
+{
+    (void)prim;
+    const struct instance *instance = (const struct instance *)obj;
+    transform_aabb(bounds, &instance->to_world, &instance->group->bounds);
+}
+
+void instance_free(struct object *obj)
+{
+    struct instance *instance = (struct instance *)obj;
+    object_group_put(instance->group);
+    free(instance);
+}
+
+struct instance *instance_create(struct object_group *group,
+                                 const struct transform *transform)
+{
+    struct instance *instance = zalloc(sizeof(*instance));
+    object_init(&instance->base, object_instance_ray_intersect,
+                object_instance_resolve, object_instance_occluded,
+                object_instance_bounds, NULL, instance_free);
+    instance->to_world = *transform;
+    if (!transform_invert(&instance->to_object, transform))
+        errx(1, "instance transforms must be invertible");
+    instance->group = object_group_get(group);
+    return instance;
+}
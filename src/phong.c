@@ -1,52 +1,86 @@
 #include "phong_material.h"
 #include "scene.h"
 
-struct vec3 phong_metarial_shade(const struct material *base_material,
-                                 const struct intersection *inter,
-                                 const struct scene *scene,
-                                 const struct ray *ray)
+// shadow rays start a bit away from the surface, so that it doesn't shadow
+// itself because of rounding errors
+#define SHADOW_RAY_OFFSET 0.01
+
+/*
+** Returns whether the light reaches a point, by casting a shadow ray towards
+** the light.
+*/
+static bool phong_light_visible(const struct scene *scene,
+                                const struct intersection *inter)
+{
+    struct ray shadow_ray;
+    shadow_ray.direction = scene->light_direction;
+    vec3_neg(&shadow_ray.direction);
+    ray_update_inv_direction(&shadow_ray);
+    struct vec3 off = vec3_mul(&shadow_ray.direction, SHADOW_RAY_OFFSET);
+    shadow_ray.source = vec3_add(&inter->point, &off);
+
+    // the light is directional, so anything along the ray blocks it
+    return !scene_occluded(scene, &shadow_ray, INFINITY);
+}
+
+struct dvec3 phong_metarial_shade(const struct material *base_material,
+                                  const struct intersection *inter,
+                                  const struct scene *scene,
+                                  const struct ray *ray)
 {
     const struct phong_material *mat
         = (const struct phong_material *)base_material;
 
+    // shading is always computed using doubles, whatever the precision of
+    // geometry
+    struct dvec3 normal = vec3_to_dvec3(&inter->normal);
+    struct dvec3 light_direction = vec3_to_dvec3(&scene->light_direction);
+    struct dvec3 ray_direction = vec3_to_dvec3(&ray->direction);
+
     // a coefficient teaking how much diffuse light to add
-    struct vec3 light = vec3_mul(&scene->light_color, scene->light_intensity);
-    struct vec3 diffuse_light_color = vec3_mul_vec(&light, &mat->surface_color);
+    struct dvec3 light = dvec3_mul(&scene->light_color, scene->light_intensity);
+    struct dvec3 diffuse_light_color
+        = dvec3_mul_vec(&light, &mat->surface_color);
 
     // compute the diffuse lighting contribution by applying the cosine
     // law
-    double diffuse_intensity
-        = -vec3_dot(&inter->normal, &scene->light_direction);
+    double diffuse_intensity = -dvec3_dot(&normal, &light_direction);
     if (diffuse_intensity < 0)
         diffuse_intensity = 0;
 
-    struct vec3 diffuse_contribution
-        = vec3_mul(&diffuse_light_color, diffuse_intensity * mat->diffuse_Kn);
+    // surfaces facing away from the light or in the shadow of other objects
+    // only get ambient light
+    bool lit = diffuse_intensity > 0 && phong_light_visible(scene, inter);
+    if (!lit)
+        diffuse_intensity = 0;
+
+    struct dvec3 diffuse_contribution
+        = dvec3_mul(&diffuse_light_color, diffuse_intensity * mat->diffuse_Kn);
 
     // compute the specular reflection contribution
 
-    struct vec3 light_reflection_dir
-        = vec3_reflect(&scene->light_direction, &inter->normal);
-    struct vec3 specular_contribution = {0};
+    struct dvec3 light_reflection_dir
+        = dvec3_reflect(&light_direction, &normal);
+    struct dvec3 specular_contribution = {0};
     // computes how much the reflection goes in the direction of the
     // camera
     double light_reflection_proj
-        = -vec3_dot(&light_reflection_dir, &ray->direction);
-    if (light_reflection_proj < 0.0)
+        = -dvec3_dot(&light_reflection_dir, &ray_direction);
+    if (light_reflection_proj < 0.0 || !lit)
         light_reflection_proj = 0.0;
     else
     {
         double spec_coeff
             = pow(light_reflection_proj, mat->spec_n) * mat->spec_Ks;
-        specular_contribution = vec3_mul(&scene->light_color, spec_coeff);
+        specular_contribution = dvec3_mul(&scene->light_color, spec_coeff);
     }
 
-    struct vec3 ambient_contribution
-        = vec3_mul(&mat->surface_color, mat->ambient_intensity);
+    struct dvec3 ambient_contribution
+        = dvec3_mul(&mat->surface_color, mat->ambient_intensity);
 
-    struct vec3 pix_color = {0};
-    pix_color = vec3_add(&pix_color, &ambient_contribution);
-    pix_color = vec3_add(&pix_color, &diffuse_contribution);
-    pix_color = vec3_add(&pix_color, &specular_contribution);
+    struct dvec3 pix_color = {0};
+    pix_color = dvec3_add(&pix_color, &ambient_contribution);
+    pix_color = dvec3_add(&pix_color, &diffuse_contribution);
+    pix_color = dvec3_add(&pix_color, &specular_contribution);
     return pix_color;
 }
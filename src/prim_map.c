@@ -0,0 +1,72 @@
+#include "prim_map.h"
+#include "utils/alloc.h"
+
+#include <err.h>
+#include <math.h>
+#include <stdlib.h>
+
+void prim_map_build(struct prim_map *map, struct object_vect *objects)
+{
+    size_t object_count = object_vect_size(objects);
+    size_t prim_count = 0;
+    for (size_t i = 0; i < object_count; i++)
+        prim_count += object_vect_get(objects, i)->prim_count;
+
+    // trees refer to primitives using 32 bit indices
+    if (prim_count > UINT32_MAX)
+        errx(1, "too many primitives: %zu", prim_count);
+
+    map->objects = objects;
+    map->prim_count = prim_count;
+    map->prim_objects = xcalloc(prim_count, sizeof(*map->prim_objects));
+    map->object_prims = xcalloc(object_count, sizeof(*map->object_prims));
+
+    size_t prim = 0;
+    for (size_t i = 0; i < object_count; i++)
+    {
+        map->object_prims[i] = prim;
+        size_t obj_prim_count = object_vect_get(objects, i)->prim_count;
+        for (size_t obj_prim = 0; obj_prim < obj_prim_count; obj_prim++)
+            map->prim_objects[prim++] = i;
+    }
+}
+
+void prim_map_destroy(struct prim_map *map)
+{
+    free(map->prim_objects);
+    free(map->object_prims);
+    map->prim_objects = NULL;
+    map->object_prims = NULL;
+    map->prim_count = 0;
+}
+
+struct aabb *prim_map_bounds(const struct prim_map *map, struct aabb *bounds)
+{
+    struct aabb *prim_bounds
+        = xcalloc(map->prim_count, sizeof(*prim_bounds));
+    aabb_init_empty(bounds);
+    for (size_t i = 0; i < map->prim_count; i++)
+    {
+        size_t obj_prim;
+        struct object *obj = prim_map_get(map, i, &obj_prim);
+        obj->bounds(&prim_bounds[i], obj, obj_prim);
+        aabb_extend(bounds, &prim_bounds[i]);
+    }
+    return prim_bounds;
+}
+
+void prim_map_split(void *data, size_t prim, int axis, double pos,
+                    struct aabb *left, struct aabb *right)
+{
+    size_t obj_prim;
+    struct object *obj = prim_map_get(data, prim, &obj_prim);
+    if (obj->split != NULL)
+    {
+        obj->split(obj, obj_prim, axis, pos, left, right);
+        return;
+    }
+
+    left->min = (struct vec3){-INFINITY, -INFINITY, -INFINITY};
+    left->max = (struct vec3){INFINITY, INFINITY, INFINITY};
+    *right = *left;
+}
@@ -155,13 +155,13 @@ struct rgb_pixel get_procedural_pixel(struct scene *scene,
 /* Do the samoe thing that the precedent function, but do not convert into a
 ** color
 */
-struct vec3 get_procedural_pixel_vec(struct scene *scene,
-                                     struct rgb_image *image, size_t x,
-                                     size_t y)
+struct dvec3 get_procedural_pixel_vec(struct scene *scene,
+                                      struct rgb_image *image, size_t x,
+                                      size_t y)
 {
     float noise = noise_map[y * image->width + x];
-    struct vec3 pix = {.x = scene->light_color.x * noise * 0.05,
-                       .y = scene->light_color.y * noise * 0.05,
-                       .z = scene->light_color.z * noise * 0.05};
+    struct dvec3 pix = {.x = scene->light_color.x * noise * 0.05,
+                        .y = scene->light_color.y * noise * 0.05,
+                        .z = scene->light_color.z * noise * 0.05};
     return pix;
 }
@@ -0,0 +1,197 @@
+#include "qbvh.h"
+#include "utils/alloc.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define QBVH_MIN_EXPONENT -126
+#define QBVH_MAX_EXPONENT 127
+
+/*
+** Returns 2^exponent, by building the float directly.
+*/
+static inline float qbvh_scale(int8_t exponent)
+{
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float res;
+    memcpy(&res, &bits, sizeof(res));
+    return res;
+}
+
+static inline float qbvh_plane(float origin, float scale, uint8_t q)
+{
+    return origin + (float)q * scale;
+}
+
+static bool bvh4_child_empty(const struct bvh4_node *node, size_t child_i)
+{
+    return node->bounds[0][0][child_i] > node->bounds[1][0][child_i];
+}
+
+/*
+** Tries to quantize the children bounds along an axis, using a given grid
+** step. Quantized boxes must contain the original ones, once dequantized
+** in single precision.
+*/
+static bool quantize_axis(struct qbvh_node *dst, const struct bvh4_node *src,
+                          int axis, float origin, int8_t exponent)
+{
+    float scale = qbvh_scale(exponent);
+    for (size_t i = 0; i < QBVH_WIDTH; i++)
+    {
+        if (bvh4_child_empty(src, i))
+            continue;
+
+        float min = src->bounds[0][axis][i];
+        float max = src->bounds[1][axis][i];
+
+        double q_min = floor((min - origin) / scale);
+        uint8_t qmin = q_min < 0 ? 0 : q_min > 255 ? 255 : q_min;
+        while (qmin > 0 && qbvh_plane(origin, scale, qmin) > min)
+            qmin--;
+
+        double q_max = ceil((max - origin) / scale);
+        uint8_t qmax = q_max < 0 ? 0 : q_max > 255 ? 255 : q_max;
+        while (qmax < 255 && qbvh_plane(origin, scale, qmax) < max)
+            qmax++;
+        if (qbvh_plane(origin, scale, qmax) < max)
+            return false;
+
+        dst->qbounds[0][axis][i] = qmin;
+        dst->qbounds[1][axis][i] = qmax;
+    }
+    return true;
+}
+
+static void quantize_node(struct qbvh_node *dst, const struct bvh4_node *src)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float origin = INFINITY;
+        float max = -INFINITY;
+        for (size_t i = 0; i < QBVH_WIDTH; i++)
+        {
+            if (bvh4_child_empty(src, i))
+                continue;
+            origin = fminf(origin, src->bounds[0][axis][i]);
+            max = fmaxf(max, src->bounds[1][axis][i]);
+        }
+
+        // the smallest power of two which spans the node in 255 steps
+        double extent = (double)max - origin;
+        int exponent = QBVH_MIN_EXPONENT;
+        if (extent > 0)
+            exponent = ceil(log2(extent / 255));
+        if (exponent < QBVH_MIN_EXPONENT)
+            exponent = QBVH_MIN_EXPONENT;
+
+        // rounding may require a slightly coarser grid
+        while (!quantize_axis(dst, src, axis, origin, exponent)
+               && exponent < QBVH_MAX_EXPONENT)
+            exponent++;
+
+        dst->origin[axis] = origin;
+        dst->exponent[axis] = exponent;
+    }
+
+    for (size_t i = 0; i < QBVH_WIDTH; i++)
+    {
+        dst->child[i] = src->child[i];
+        dst->prim_count[i] = src->prim_count[i];
+        if (!bvh4_child_empty(src, i))
+            continue;
+
+        // empty children have their min above their max, so they're
+        // never hit
+        for (int axis = 0; axis < 3; axis++)
+        {
+            dst->qbounds[0][axis][i] = 1;
+            dst->qbounds[1][axis][i] = 0;
+        }
+    }
+}
+
+void qbvh_build(struct qbvh *tree, const struct bvh4 *bvh4)
+{
+    tree->nodes = NULL;
+    tree->node_count = bvh4->node_count;
+    tree->prim_indices = bvh4->prim_indices;
+    if (tree->node_count == 0)
+        return;
+
+    tree->nodes = xaligned_alloc(__alignof__(struct qbvh_node),
+                                 tree->node_count * sizeof(*tree->nodes));
+    for (size_t i = 0; i < tree->node_count; i++)
+        quantize_node(&tree->nodes[i], &bvh4->nodes[i]);
+}
+
+void qbvh_destroy(struct qbvh *tree)
+{
+    free(tree->nodes);
+}
+
+/*
+** Dequantizes and tests the four children of a node at once, using SSE2.
+*/
+static inline unsigned qbvh_intersect_children(const struct qbvh_node *node,
+                                               const struct bvh_wide_ray *ray,
+                                               float max_dist, float *dists)
+{
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128 tmin = _mm_setzero_ps();
+    __m128 tmax = _mm_set1_ps(max_dist);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // pick the planes the ray goes through first
+        int near = ray->inv_direction[axis] < 0;
+        __m128 origin = _mm_set1_ps(node->origin[axis]);
+        __m128 scale = _mm_set1_ps(qbvh_scale(node->exponent[axis]));
+        __m128 source = _mm_set1_ps(ray->source[axis]);
+        __m128 inv_dir = _mm_set1_ps(ray->inv_direction[axis]);
+
+        // widen the 8 bit offsets to floats
+        int32_t qnear;
+        int32_t qfar;
+        memcpy(&qnear, node->qbounds[near][axis], sizeof(qnear));
+        memcpy(&qfar, node->qbounds[1 - near][axis], sizeof(qfar));
+        __m128i qnear_i = _mm_unpacklo_epi8(_mm_cvtsi32_si128(qnear), zero);
+        __m128i qfar_i = _mm_unpacklo_epi8(_mm_cvtsi32_si128(qfar), zero);
+        __m128 qnear_f = _mm_cvtepi32_ps(_mm_unpacklo_epi16(qnear_i, zero));
+        __m128 qfar_f = _mm_cvtepi32_ps(_mm_unpacklo_epi16(qfar_i, zero));
+
+        __m128 near_planes = _mm_add_ps(origin, _mm_mul_ps(qnear_f, scale));
+        __m128 far_planes = _mm_add_ps(origin, _mm_mul_ps(qfar_f, scale));
+        __m128 tnear = _mm_mul_ps(_mm_sub_ps(near_planes, source), inv_dir);
+        __m128 tfar = _mm_mul_ps(_mm_sub_ps(far_planes, source), inv_dir);
+        tmin = _mm_max_ps(tmin, tnear);
+        tmax = _mm_min_ps(tmax, tfar);
+    }
+
+    _mm_storeu_ps(dists, tmin);
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+    float bounds[2][3][QBVH_WIDTH];
+    for (int side = 0; side < 2; side++)
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float scale = qbvh_scale(node->exponent[axis]);
+            for (size_t i = 0; i < QBVH_WIDTH; i++)
+                bounds[side][axis][i] = qbvh_plane(
+                    node->origin[axis], scale, node->qbounds[side][axis][i]);
+        }
+
+    return bvh_wide_intersect_boxes(&bounds[0][0][0], QBVH_WIDTH, ray,
+                                    max_dist, dists);
+#endif
+}
+
+#define BVHW_NAME qbvh
+#define BVHW_WIDTH QBVH_WIDTH
+#include "bvh_wide_traverse.defs"
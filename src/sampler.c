@@ -0,0 +1,317 @@
+#include "sampler.h"
+#include "utils/alloc.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// the width of the gaussian which measures how clustered blue noise is
+#define BLUE_NOISE_SIGMA 1.5
+
+const double sampler_quincunx[SAMPLER_QUINCUNX_COUNT][2] = {
+    {0, 0},
+    {-0.5, -0.5},
+    {-0.5, 0.5},
+    {0.5, -0.5},
+    {0.5, 0.5},
+};
+
+/*
+** A 32 bits integer hash with good avalanche, from Chris Wellons' hash
+** prospector.
+*/
+static uint32_t hash_u32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= UINT32_C(0x7feb352d);
+    x ^= x >> 15;
+    x *= UINT32_C(0x846ca68b);
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hash_combine(uint32_t seed, uint32_t value)
+{
+    return hash_u32(seed ^ (value + UINT32_C(0x9e3779b9) + (seed << 6)
+                            + (seed >> 2)));
+}
+
+static uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & UINT32_C(0x00ff00ff)) << 8) | ((x & UINT32_C(0xff00ff00)) >> 8);
+    x = ((x & UINT32_C(0x0f0f0f0f)) << 4) | ((x & UINT32_C(0xf0f0f0f0)) >> 4);
+    x = ((x & UINT32_C(0x33333333)) << 2) | ((x & UINT32_C(0xcccccccc)) >> 2);
+    x = ((x & UINT32_C(0x55555555)) << 1) | ((x & UINT32_C(0xaaaaaaaa)) >> 1);
+    return x;
+}
+
+/*
+** Owen scrambling flips each bit depending on a hash of the bits above it.
+** The Laine-Karras permutation does that for lower bits depending on
+** higher ones, so bits are reversed around it, as described in "Practical
+** Hash-based Owen Scrambling", Burley 2020.
+*/
+static uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * UINT32_C(0x6c50b47c);
+    x ^= x * UINT32_C(0xb82f1e52);
+    x ^= x * UINT32_C(0xc7afe638);
+    x ^= x * UINT32_C(0x8d22f6e6);
+    return reverse_bits(x);
+}
+
+/*
+** The first two dimensions of the Sobol sequence, as 32 bits fractions:
+** the van der Corput sequence, and the dimension with the x + 1 primitive
+** polynomial, whose direction numbers are all one.
+*/
+static void sobol_2d(uint32_t index, uint32_t *u, uint32_t *v)
+{
+    *u = reverse_bits(index);
+    *v = 0;
+    for (uint32_t dir = UINT32_C(1) << 31; index != 0; index >>= 1)
+    {
+        if (index & 1)
+            *v ^= dir;
+        dir ^= dir >> 1;
+    }
+}
+
+/*
+** Returns an Owen scrambled Sobol point in [0, 1) squared. The index is
+** scrambled as well, so that the first points of different seeds aren't
+** the same stratum.
+*/
+static void sobol_owen(uint32_t index, uint32_t seed, double *u, double *v)
+{
+    uint32_t bits_u;
+    uint32_t bits_v;
+    index = owen_scramble(index, hash_combine(seed, 0));
+    sobol_2d(index, &bits_u, &bits_v);
+    bits_u = owen_scramble(bits_u, hash_combine(seed, 1));
+    bits_v = owen_scramble(bits_v, hash_combine(seed, 2));
+
+    // keep 24 bits, which doubles hold exactly, and which can't round to 1
+    *u = (bits_u >> 8) * 0x1p-24;
+    *v = (bits_v >> 8) * 0x1p-24;
+}
+
+static double radical_inverse(uint32_t index, uint32_t base)
+{
+    double inv_base = 1. / base;
+    double scale = inv_base;
+    double result = 0;
+    for (; index != 0; index /= base)
+    {
+        result += (index % base) * scale;
+        scale *= inv_base;
+    }
+    return result;
+}
+
+static double wrap_unit(double value)
+{
+    return value >= 1 ? value - 1 : value;
+}
+
+static double hash_unit(uint32_t hash)
+{
+    return (hash >> 8) * 0x1p-24;
+}
+
+/*
+** Toggles a point of a blue noise mask, updating the energy of all pixels,
+** which is the sum of the kernel over the distances to all points.
+*/
+static void blue_noise_toggle(bool *points, double *energy,
+                              const double *kernel, size_t i, bool set)
+{
+    size_t size = SAMPLER_BLUE_NOISE_SIZE;
+    size_t x = i % size;
+    size_t y = i / size;
+    double sign = set ? 1 : -1;
+    points[i] = set;
+    for (size_t j_y = 0; j_y < size; j_y++)
+    {
+        size_t dy = (j_y + size - y) % size;
+        for (size_t j_x = 0; j_x < size; j_x++)
+        {
+            size_t dx = (j_x + size - x) % size;
+            energy[j_y * size + j_x] += sign * kernel[dy * size + dx];
+        }
+    }
+}
+
+/*
+** Returns the point with the highest energy, that is the tightest cluster,
+** or the pixel without a point with the lowest energy, the largest void.
+*/
+static size_t blue_noise_find(const bool *points, const double *energy,
+                              bool cluster)
+{
+    size_t count = SAMPLER_BLUE_NOISE_SIZE * SAMPLER_BLUE_NOISE_SIZE;
+    size_t best = count;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (points[i] != cluster)
+            continue;
+        if (best == count || (cluster ? energy[i] > energy[best]
+                                      : energy[i] < energy[best]))
+            best = i;
+    }
+    assert(best != count);
+    return best;
+}
+
+/*
+** Generates a blue noise mask using the void and cluster method, as
+** described by Ulichney in 1993: pixels get ranked by how far they are
+** from pixels of lower rank, on a torus, so that the mask tiles.
+*/
+static float *blue_noise_generate(uint32_t seed)
+{
+    size_t size = SAMPLER_BLUE_NOISE_SIZE;
+    size_t count = size * size;
+    double *kernel = xcalloc(count, sizeof(*kernel));
+    for (size_t y = 0; y < size; y++)
+        for (size_t x = 0; x < size; x++)
+        {
+            double dx = x < size - x ? x : size - x;
+            double dy = y < size - y ? y : size - y;
+            kernel[y * size + x] = exp(-(dx * dx + dy * dy)
+                                       / (2 * BLUE_NOISE_SIGMA
+                                          * BLUE_NOISE_SIGMA));
+        }
+
+    // start from a tenth of the pixels, picked at random
+    bool *points = xcalloc(count, sizeof(*points));
+    double *energy = xcalloc(count, sizeof(*energy));
+    size_t initial_count = count / 10;
+    for (size_t placed = 0, i = 0; placed < initial_count; i++)
+    {
+        size_t pixel = hash_combine(seed, i) % count;
+        if (points[pixel])
+            continue;
+        blue_noise_toggle(points, energy, kernel, pixel, true);
+        placed++;
+    }
+
+    // move points from the tightest cluster to the largest void, until
+    // the point moved would stay in place
+    for (size_t moves = 0; moves < count; moves++)
+    {
+        size_t cluster = blue_noise_find(points, energy, true);
+        blue_noise_toggle(points, energy, kernel, cluster, false);
+        size_t hole = blue_noise_find(points, energy, false);
+        blue_noise_toggle(points, energy, kernel, hole, true);
+        if (hole == cluster)
+            break;
+    }
+
+    bool *initial_points = xcalloc(count, sizeof(*initial_points));
+    double *initial_energy = xcalloc(count, sizeof(*initial_energy));
+    for (size_t i = 0; i < count; i++)
+    {
+        initial_points[i] = points[i];
+        initial_energy[i] = energy[i];
+    }
+
+    // the initial points get the lowest ranks, tightest clusters last
+    size_t *ranks = xcalloc(count, sizeof(*ranks));
+    for (size_t rank = initial_count; rank-- > 0;)
+    {
+        size_t cluster = blue_noise_find(points, energy, true);
+        blue_noise_toggle(points, energy, kernel, cluster, false);
+        ranks[cluster] = rank;
+    }
+
+    // other pixels get higher ranks, largest voids first
+    for (size_t rank = initial_count; rank < count; rank++)
+    {
+        size_t hole = blue_noise_find(initial_points, initial_energy, false);
+        blue_noise_toggle(initial_points, initial_energy, kernel, hole, true);
+        ranks[hole] = rank;
+    }
+
+    float *mask = xcalloc(count, sizeof(*mask));
+    for (size_t i = 0; i < count; i++)
+        mask[i] = (ranks[i] + 0.5f) / count;
+
+    free(ranks);
+    free(initial_energy);
+    free(initial_points);
+    free(energy);
+    free(points);
+    free(kernel);
+    return mask;
+}
+
+void sampler_init(struct sampler *sampler, enum sampler_type type,
+                  uint32_t seed)
+{
+    *sampler = (struct sampler){
+        .type = type,
+        .seed = seed,
+    };
+
+    if (type == SAMPLER_BLUE_NOISE)
+        for (size_t i = 0; i < 2; i++)
+            sampler->blue_noise[i]
+                = blue_noise_generate(hash_combine(seed, 3 + i));
+}
+
+void sampler_offset(const struct sampler *sampler, size_t x, size_t y,
+                    size_t index, double *dx, double *dy)
+{
+    if (sampler->type == SAMPLER_QUINCUNX)
+    {
+        assert(index < SAMPLER_QUINCUNX_COUNT);
+        *dx = sampler_quincunx[index][0];
+        *dy = sampler_quincunx[index][1];
+        return;
+    }
+
+    uint32_t pixel_seed = hash_combine(hash_combine(sampler->seed, x), y);
+    double u;
+    double v;
+    switch (sampler->type)
+    {
+    case SAMPLER_HALTON:
+        u = radical_inverse(index, 2);
+        v = radical_inverse(index, 3);
+        u = wrap_unit(u + hash_unit(hash_combine(pixel_seed, 0)));
+        v = wrap_unit(v + hash_unit(hash_combine(pixel_seed, 1)));
+        break;
+    case SAMPLER_SOBOL:
+        sobol_owen(index, pixel_seed, &u, &v);
+        break;
+    case SAMPLER_BLUE_NOISE:
+    {
+        size_t mask_i = (y % SAMPLER_BLUE_NOISE_SIZE) * SAMPLER_BLUE_NOISE_SIZE
+                        + x % SAMPLER_BLUE_NOISE_SIZE;
+        sobol_owen(index, sampler->seed, &u, &v);
+        u = wrap_unit(u + sampler->blue_noise[0][mask_i]);
+        v = wrap_unit(v + sampler->blue_noise[1][mask_i]);
+        break;
+    }
+    default:
+        u = 0.5;
+        v = 0.5;
+        break;
+    }
+
+    *dx = u - 0.5;
+    *dy = v - 0.5;
+}
+
+void sampler_destroy(struct sampler *sampler)
+{
+    free(sampler->blue_noise[0]);
+    free(sampler->blue_noise[1]);
+    sampler->blue_noise[0] = NULL;
+    sampler->blue_noise[1] = NULL;
+}
@@ -1,4 +1,374 @@
 #include "scene.h"
+#include "utils/alloc.h"
+#include "utils/cpu.h"
+
+#include <err.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+static void scene_destroy_wide_accel(struct scene *scene)
+{
+    bvh4_destroy(&scene->bvh4);
+    bvh8_destroy(&scene->bvh8);
+    qbvh_destroy(&scene->qbvh);
+    scene->bvh4 = (struct bvh4){0};
+    scene->bvh8 = (struct bvh8){0};
+    scene->qbvh = (struct qbvh){0};
+}
+
+/*
+** Builds the wide tree used by the current accel, from the binary tree.
+*/
+static void scene_build_wide_accel(struct scene *scene)
+{
+    enum scene_accel accel = scene->accel;
+    if (accel == SCENE_ACCEL_BVH4)
+        bvh4_build(&scene->bvh4, &scene->bvh);
+    else if (accel == SCENE_ACCEL_BVH8)
+        bvh8_build(&scene->bvh8, &scene->bvh);
+    else if (accel == SCENE_ACCEL_QBVH)
+    {
+        // the quantized tree is built from the 4 wide tree, which isn't
+        // needed afterwards
+        bvh4_build(&scene->bvh4, &scene->bvh);
+        qbvh_build(&scene->qbvh, &scene->bvh4);
+        bvh4_destroy(&scene->bvh4);
+        scene->bvh4 = (struct bvh4){0};
+    }
+}
+
+/*
+** Releases the current acceleration structure, and switches to another one.
+*/
+static void scene_reset_accel(struct scene *scene, enum scene_accel accel)
+{
+    prim_map_destroy(&scene->prims);
+    prim_map_build(&scene->prims, &scene->objects);
+    compiled_prims_destroy(&scene->compiled);
+    bvh_destroy(&scene->bvh);
+    scene->bvh = (struct bvh){0};
+    scene_destroy_wide_accel(scene);
+    scene->accel = accel;
+
+    if (accel == SCENE_ACCEL_BVH8 && !cpu_has_avx())
+        errx(1, "the bvh8 acceleration structure requires AVX support");
+}
+
+void scene_build_accel(struct scene *scene, enum scene_accel accel,
+                       const struct bvh_build_options *options)
+{
+    scene_reset_accel(scene, accel);
+    if (accel == SCENE_ACCEL_LINEAR)
+    {
+        compiled_prims_build(&scene->compiled, &scene->prims, NULL, 0);
+        return;
+    }
+
+    struct aabb scene_bounds;
+    struct aabb *bounds = prim_map_bounds(&scene->prims, &scene_bounds);
+    bvh_build_split(&scene->bvh, bounds, scene->prims.prim_count, options,
+                    prim_map_split, &scene->prims);
+    free(bounds);
+
+    // primitives are stored in the order leaves reference them
+    compiled_prims_build(&scene->compiled, &scene->prims,
+                         scene->bvh.prim_indices, scene->bvh.ref_count);
+
+    // wide trees are built from the binary tree
+    scene_build_wide_accel(scene);
+}
+
+void scene_adopt_accel(struct scene *scene, enum scene_accel accel,
+                       const struct bvh *bvh)
+{
+    scene_reset_accel(scene, accel);
+    scene->bvh = *bvh;
+    compiled_prims_build(&scene->compiled, &scene->prims,
+                         scene->bvh.prim_indices, scene->bvh.ref_count);
+    scene_build_wide_accel(scene);
+}
+
+bool scene_update_accel(struct scene *scene,
+                        const struct bvh_build_options *options)
+{
+    compiled_prims_update(&scene->compiled, &scene->prims);
+    if (scene->accel == SCENE_ACCEL_LINEAR)
+        return false;
+
+    struct aabb scene_bounds;
+    struct aabb *bounds = prim_map_bounds(&scene->prims, &scene_bounds);
+    bvh_refit(&scene->bvh, bounds, options->pool);
+
+    bool rebuild = bvh_sah_cost(&scene->bvh)
+                   > scene->bvh.build_cost * options->rebuild_threshold;
+    if (rebuild)
+    {
+        bvh_destroy(&scene->bvh);
+        bvh_build_split(&scene->bvh, bounds, scene->prims.prim_count,
+                        options, prim_map_split, &scene->prims);
+        compiled_prims_destroy(&scene->compiled);
+        compiled_prims_build(&scene->compiled, &scene->prims,
+                             scene->bvh.prim_indices, scene->bvh.ref_count);
+    }
+    free(bounds);
+
+    scene_destroy_wide_accel(scene);
+    scene_build_wide_accel(scene);
+    return rebuild;
+}
+
+size_t scene_accel_node_memory(const struct scene *scene)
+{
+    switch (scene->accel)
+    {
+    case SCENE_ACCEL_BVH:
+        return scene->bvh.node_count * sizeof(*scene->bvh.nodes);
+    case SCENE_ACCEL_BVH4:
+        return scene->bvh4.node_count * sizeof(*scene->bvh4.nodes);
+    case SCENE_ACCEL_BVH8:
+        return scene->bvh8.node_count * sizeof(*scene->bvh8.nodes);
+    case SCENE_ACCEL_QBVH:
+        return scene->qbvh.node_count * sizeof(*scene->qbvh.nodes);
+    case SCENE_ACCEL_LINEAR:
+        break;
+    }
+    return 0;
+}
+
+/*
+** The state of a closest hit query, shared by the primitive intersection
+** callbacks.
+*/
+struct intersect_ctx
+{
+    struct scene *scene;
+    struct scene_hit *closest_hit;
+    double closest_dist;
+};
+
+static double intersect_prim(void *data, size_t prim, const struct ray *ray)
+{
+    struct intersect_ctx *ctx = data;
+    struct object_hit hit;
+    // if there's no intersection between the ray and this primitive, skip it
+    double intersection_dist = compiled_prims_intersect(
+        &ctx->scene->compiled, &ctx->scene->prims, prim, ray, &hit);
+    if (isinf(intersection_dist) || intersection_dist > ctx->closest_dist)
+        return intersection_dist;
+
+    // break ties using the primitive index, so that the result doesn't
+    // depend on the order primitives are tested in
+    if (intersection_dist == ctx->closest_dist
+        && prim > ctx->closest_hit->prim)
+        return intersection_dist;
+
+    ctx->closest_dist = intersection_dist;
+    ctx->closest_hit->prim = prim;
+    ctx->closest_hit->hit = hit;
+    return intersection_dist;
+}
+
+static double intersect_leaf(void *data, const uint32_t *prims,
+                             size_t prim_count, const struct ray *ray)
+{
+    struct intersect_ctx *ctx = data;
+    const struct compiled_prims *compiled = &ctx->scene->compiled;
+
+    // leaves of consecutive triangles are tested a block at a time
+    size_t first;
+    if (!compiled_prims_triangle_run(compiled, prims, prim_count, &first))
+    {
+        double closest_dist = INFINITY;
+        for (size_t i = 0; i < prim_count; i++)
+        {
+            double dist = intersect_prim(ctx, prims[i], ray);
+            if (dist < closest_dist)
+                closest_dist = dist;
+        }
+        return closest_dist;
+    }
+
+    // only look for hits up to the closest one so far, included, as a hit
+    // at the same distance may still win the tie
+    double max_dist = nextafter(ctx->closest_dist, INFINITY);
+    struct triangle_block_hit hit;
+    if (!compiled_prims_intersect_triangles(compiled, first, prim_count, ray,
+                                            max_dist, &hit))
+        return INFINITY;
+
+    if (hit.dist > ctx->closest_dist
+        || (hit.dist == ctx->closest_dist && hit.prim > ctx->closest_hit->prim))
+        return hit.dist;
+
+    ctx->closest_dist = hit.dist;
+    ctx->closest_hit->prim = hit.prim;
+    ctx->closest_hit->hit.u = hit.u;
+    ctx->closest_hit->hit.v = hit.v;
+    return hit.dist;
+}
+
+double scene_intersect_hit(struct scene_hit *closest_hit, struct scene *scene,
+                           const struct ray *ray)
+{
+    // we will now try to find the closest object in the scene
+    // intersecting this ray
+    closest_hit->prim = SIZE_MAX;
+    struct intersect_ctx ctx = {
+        .scene = scene,
+        .closest_hit = closest_hit,
+        .closest_dist = INFINITY,
+    };
+
+    switch (scene->accel)
+    {
+    case SCENE_ACCEL_BVH:
+        return bvh_intersect(&scene->bvh, ray, intersect_leaf, &ctx);
+    case SCENE_ACCEL_BVH4:
+        return bvh4_intersect(&scene->bvh4, ray, intersect_leaf, &ctx);
+    case SCENE_ACCEL_BVH8:
+        return bvh8_intersect(&scene->bvh8, ray, intersect_leaf, &ctx);
+    case SCENE_ACCEL_QBVH:
+        return qbvh_intersect(&scene->qbvh, ray, intersect_leaf, &ctx);
+    case SCENE_ACCEL_LINEAR:
+        break;
+    }
+
+    for (size_t i = 0; i < scene->prims.prim_count; i++)
+        intersect_prim(&ctx, i, ray);
+
+    return ctx.closest_dist;
+}
+
+void scene_resolve_hit(struct object_intersection *intersection,
+                       const struct scene *scene, const struct ray *ray,
+                       double dist, const struct scene_hit *hit)
+{
+    size_t obj_prim;
+    struct object *obj = prim_map_get(&scene->prims, hit->prim, &obj_prim);
+    obj->resolve(intersection, obj, obj_prim, ray, dist, &hit->hit);
+}
+
+double scene_intersect_ray(struct object_intersection *closest_intersection,
+                           struct scene *scene, const struct ray *ray)
+{
+    struct scene_hit hit;
+    double dist = scene_intersect_hit(&hit, scene, ray);
+    if (!isinf(dist))
+        scene_resolve_hit(closest_intersection, scene, ray, dist, &hit);
+    return dist;
+}
+
+void scene_intersect_packet_hits(struct scene_hit *hits, double *dists,
+                                 struct scene *scene, const struct ray *rays,
+                                 size_t ray_count)
+{
+    // only the binary tree has a packet traversal
+    if (scene->accel != SCENE_ACCEL_BVH || ray_count == 0
+        || ray_count > BVH_PACKET_MAX_SIZE)
+    {
+        for (size_t i = 0; i < ray_count; i++)
+            dists[i] = scene_intersect_hit(&hits[i], scene, &rays[i]);
+        return;
+    }
+
+    struct intersect_ctx ctxs[BVH_PACKET_MAX_SIZE];
+    void *ray_data[BVH_PACKET_MAX_SIZE];
+    for (size_t i = 0; i < ray_count; i++)
+    {
+        hits[i].prim = SIZE_MAX;
+        ctxs[i] = (struct intersect_ctx){
+            .scene = scene,
+            .closest_hit = &hits[i],
+            .closest_dist = INFINITY,
+        };
+        ray_data[i] = &ctxs[i];
+    }
+
+    bvh_intersect_packet(&scene->bvh, rays, ray_count, dists, intersect_leaf,
+                         ray_data);
+}
+
+void scene_intersect_packet(struct object_intersection *intersections,
+                            double *dists, struct scene *scene,
+                            const struct ray *rays, size_t ray_count)
+{
+    // packets are at most that large, so that hits fit on the stack
+    if (ray_count > BVH_PACKET_MAX_SIZE)
+    {
+        for (size_t i = 0; i < ray_count; i++)
+            dists[i] = scene_intersect_ray(&intersections[i], scene, &rays[i]);
+        return;
+    }
+
+    struct scene_hit hits[BVH_PACKET_MAX_SIZE];
+    scene_intersect_packet_hits(hits, dists, scene, rays, ray_count);
+    for (size_t i = 0; i < ray_count; i++)
+        if (!isinf(dists[i]))
+            scene_resolve_hit(&intersections[i], scene, &rays[i], dists[i],
+                              &hits[i]);
+}
+
+static bool occluded_prim(void *data, size_t prim, const struct ray *ray,
+                          double max_dist)
+{
+    const struct scene *scene = data;
+    return compiled_prims_occluded(&scene->compiled, &scene->prims, prim, ray,
+                                   max_dist);
+}
+
+static bool occluded_leaf(void *data, const uint32_t *prims,
+                          size_t prim_count, const struct ray *ray,
+                          double max_dist)
+{
+    const struct scene *scene = data;
+    size_t first;
+    if (compiled_prims_triangle_run(&scene->compiled, prims, prim_count,
+                                    &first))
+    {
+        struct triangle_block_hit hit;
+        return compiled_prims_intersect_triangles(
+            &scene->compiled, first, prim_count, ray, max_dist, &hit);
+    }
+
+    for (size_t i = 0; i < prim_count; i++)
+        if (occluded_prim(data, prims[i], ray, max_dist))
+            return true;
+    return false;
+}
+
+bool scene_occluded(const struct scene *scene, const struct ray *ray,
+                    double max_dist)
+{
+    // the callback doesn't modify the scene, but takes a non const pointer
+    void *data = (struct scene *)scene;
+
+    switch (scene->accel)
+    {
+    case SCENE_ACCEL_BVH:
+        return bvh_occluded(&scene->bvh, ray, max_dist, occluded_leaf, data);
+    case SCENE_ACCEL_BVH4:
+        return bvh4_occluded(&scene->bvh4, ray, max_dist, occluded_leaf, data);
+    case SCENE_ACCEL_BVH8:
+        return bvh8_occluded(&scene->bvh8, ray, max_dist, occluded_leaf, data);
+    case SCENE_ACCEL_QBVH:
+        return qbvh_occluded(&scene->qbvh, ray, max_dist, occluded_leaf, data);
+    case SCENE_ACCEL_LINEAR:
+        break;
+    }
+
+    for (size_t i = 0; i < scene->prims.prim_count; i++)
+        if (occluded_prim(data, i, ray, max_dist))
+            return true;
+    return false;
+}
+
+void scene_add_instance(struct scene *scene, struct object_group *group,
+                        const struct transform *transform)
+{
+    struct instance *instance = instance_create(group, transform);
+    object_vect_push(&scene->objects, &instance->base);
+}
 
 void scene_destroy(struct scene *scene)
 {
@@ -10,4 +380,10 @@ void scene_destroy(struct scene *scene)
     }
 
     object_vect_destroy(&scene->objects);
+    prim_map_destroy(&scene->prims);
+    compiled_prims_destroy(&scene->compiled);
+    bvh4_destroy(&scene->bvh4);
+    bvh8_destroy(&scene->bvh8);
+    qbvh_destroy(&scene->qbvh);
+    bvh_destroy(&scene->bvh);
 }
@@ -2,49 +2,50 @@
 
 #include <stdlib.h>
 
-static double sphere_ray_intersect(struct intersection *intersection,
-                                   const struct sphere *sphere,
+double object_sphere_ray_intersect(struct object_hit *hit,
+                                   const struct object *obj, size_t prim,
                                    const struct ray *ray)
 {
-    struct vec3 hypothenuse = vec3_sub(&sphere->center, &ray->source);
-    double hyp_len = vec3_length(&hypothenuse);
-    double projection = vec3_dot(&hypothenuse, &ray->direction);
-    if (projection < 0)
-        return INFINITY;
-
-    double d = sqrt(hyp_len * hyp_len - projection * projection);
-    if (d > sphere->radius)
-        return INFINITY;
-
-    double radius = sphere->radius;
-    double m = sqrt(radius * radius - d * d);
-    double t0 = projection - m;
-    double t1 = projection + m;
-
-    double t = t0;
-    if (t < 0.)
-        t = t1;
+    (void)hit;
+    (void)prim;
+    const struct sphere *sphere = (const struct sphere *)obj;
+    return sphere_intersect(&sphere->center, sphere->radius, ray);
+}
 
-    // intersection point = ray->source + ray->direction * t
-    struct vec3 point_offset = vec3_mul(&ray->direction, t);
-    intersection->point = vec3_add(&ray->source, &point_offset);
-    intersection->normal = vec3_sub(&intersection->point, &sphere->center);
-    vec3_normalize(&intersection->normal);
-    // compute intersection coord / normal
-    return t;
+void object_sphere_resolve(struct object_intersection *inter,
+                           const struct object *obj, size_t prim,
+                           const struct ray *ray, double dist,
+                           const struct object_hit *hit)
+{
+    (void)prim;
+    (void)hit;
+    const struct sphere *sphere = (const struct sphere *)obj;
+    // intersection point = ray->source + ray->direction * dist
+    struct vec3 point_offset = vec3_mul(&ray->direction, dist);
+    inter->location.point = vec3_add(&ray->source, &point_offset);
+    inter->location.normal = vec3_sub(&inter->location.point, &sphere->center);
+    vec3_normalize(&inter->location.normal);
+    inter->location.u = 0;
+    inter->location.v = 0;
+    inter->material = sphere->material;
 }
 
-double object_sphere_ray_intersect(struct object_intersection *inter,
-                                   const struct object *obj,
-                                   const struct ray *ray)
+bool object_sphere_occluded(const struct object *obj, size_t prim,
+                            const struct ray *ray, double max_dist)
 {
+    (void)prim;
     const struct sphere *sphere = (const struct sphere *)obj;
-    double inter_dis = sphere_ray_intersect(&inter->location, sphere, ray);
-    if (isinf(inter_dis))
-        return inter_dis;
+    return sphere_intersect(&sphere->center, sphere->radius, ray) < max_dist;
+}
 
-    inter->material = sphere->material;
-    return inter_dis;
+void object_sphere_bounds(struct aabb *bounds, const struct object *obj,
+                          size_t prim)
+{
+    (void)prim;
+    const struct sphere *sphere = (const struct sphere *)obj;
+    struct vec3 radius = {sphere->radius, sphere->radius, sphere->radius};
+    bounds->min = vec3_sub(&sphere->center, &radius);
+    bounds->max = vec3_add(&sphere->center, &radius);
 }
 
 void sphere_free(struct object *obj)
@@ -0,0 +1,741 @@
+#include "sphere_cloud.h"
+#include "bvh_build.h"
+#include "utils/alloc.h"
+
+#include <err.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct sphere_cloud *sphere_cloud_create(struct material *mat)
+{
+    struct sphere_cloud *cloud = zalloc(sizeof(*cloud));
+    object_init(&cloud->base, object_sphere_cloud_ray_intersect,
+                object_sphere_cloud_resolve, object_sphere_cloud_occluded,
+                object_sphere_cloud_bounds, NULL, sphere_cloud_free);
+    aabb_init_empty(&cloud->bounds);
+    cloud->material = material_get(mat);
+    return cloud;
+}
+
+void sphere_cloud_reserve(struct sphere_cloud *cloud, size_t capacity)
+{
+    if (capacity < cloud->sphere_count)
+        capacity = cloud->sphere_count;
+
+    // the padding past the last sphere is kept empty
+    size_t size = (capacity + SPHERE_CLOUD_LANES - 1) * sizeof(float);
+    float **arrays[4] = {&cloud->x, &cloud->y, &cloud->z, &cloud->radius};
+    for (size_t i = 0; i < 4; i++)
+    {
+        *arrays[i] = xrealloc(*arrays[i], size);
+        memset(*arrays[i] + cloud->sphere_count, 0,
+               (capacity + SPHERE_CLOUD_LANES - 1 - cloud->sphere_count)
+                   * sizeof(float));
+    }
+    cloud->capacity = capacity;
+}
+
+void sphere_cloud_push(struct sphere_cloud *cloud, float x, float y, float z,
+                       float radius)
+{
+    if (cloud->sphere_count == cloud->capacity)
+        sphere_cloud_reserve(cloud, cloud->capacity ? cloud->capacity * 2 : 64);
+
+    size_t i = cloud->sphere_count++;
+    cloud->x[i] = x;
+    cloud->y[i] = y;
+    cloud->z[i] = z;
+    cloud->radius[i] = radius;
+}
+
+// subtrees with this many spheres or less are collapsed into leaves
+#define SPHERE_CLOUD_LEAF_SIZE (2 * SPHERE_CLOUD_LANES)
+
+// the number of candidate split positions per axis is
+// SPHERE_CLOUD_BIN_COUNT - 1
+#define SPHERE_CLOUD_BIN_COUNT 32
+
+/*
+** Converts a distance or coordinate to single precision, rounding it down or
+** up.
+*/
+static float sphere_cloud_round(double value, bool up)
+{
+    float res = value;
+    if (up && res < value)
+        res = nextafterf(res, INFINITY);
+    else if (!up && res > value)
+        res = nextafterf(res, -INFINITY);
+    return res;
+}
+
+/*
+** Single precision bounds, as stored in nodes.
+*/
+struct sphere_cloud_box
+{
+    float min[3];
+    float max[3];
+};
+
+static void sphere_cloud_box_init_empty(struct sphere_cloud_box *box)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        box->min[axis] = INFINITY;
+        box->max[axis] = -INFINITY;
+    }
+}
+
+static void sphere_cloud_box_extend(struct sphere_cloud_box *box,
+                                    const struct sphere_cloud_box *other)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (other->min[axis] < box->min[axis])
+            box->min[axis] = other->min[axis];
+        if (other->max[axis] > box->max[axis])
+            box->max[axis] = other->max[axis];
+    }
+}
+
+static double sphere_cloud_box_area(const struct sphere_cloud_box *box)
+{
+    double extent[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        extent[axis] = (double)box->max[axis] - box->min[axis];
+        if (extent[axis] < 0)
+            return 0;
+    }
+    return 2 * (extent[0] * extent[1] + extent[1] * extent[2]
+                + extent[2] * extent[0]);
+}
+
+/*
+** Stores the bounds of a sphere, computed in single precision. They may be
+** off by half a unit in the last place, which nodes make up for.
+*/
+static inline void sphere_cloud_sphere_box(const struct sphere_cloud *cloud,
+                                           size_t i,
+                                           struct sphere_cloud_box *box)
+{
+    const float *centers[3] = {cloud->x, cloud->y, cloud->z};
+    float radius = cloud->radius[i];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        box->min[axis] = centers[axis][i] - radius;
+        box->max[axis] = centers[axis][i] + radius;
+    }
+}
+
+struct sphere_cloud_bin
+{
+    struct sphere_cloud_box bounds;
+    size_t count;
+};
+
+static inline size_t sphere_cloud_bin_index(float center, double min,
+                                            double scale, size_t bin_count)
+{
+    size_t i = (center - min) * scale;
+    return i < bin_count ? i : bin_count - 1;
+}
+
+/*
+** Finds the cheapest split along an axis, given its bins. Returns its cost,
+** and stores the first bin of the right side in split_bin.
+*/
+static double sphere_cloud_sweep_bins(const struct sphere_cloud_bin *bins,
+                                      size_t bin_count, size_t *split_bin)
+{
+    double right_areas[SPHERE_CLOUD_BIN_COUNT];
+    size_t right_counts[SPHERE_CLOUD_BIN_COUNT];
+    struct sphere_cloud_box right;
+    sphere_cloud_box_init_empty(&right);
+    size_t right_count = 0;
+    for (size_t i = bin_count - 1; i > 0; i--)
+    {
+        sphere_cloud_box_extend(&right, &bins[i].bounds);
+        right_count += bins[i].count;
+        right_areas[i] = sphere_cloud_box_area(&right);
+        right_counts[i] = right_count;
+    }
+
+    struct sphere_cloud_box left;
+    sphere_cloud_box_init_empty(&left);
+    size_t left_count = 0;
+    double best_cost = INFINITY;
+    for (size_t i = 1; i < bin_count; i++)
+    {
+        sphere_cloud_box_extend(&left, &bins[i - 1].bounds);
+        left_count += bins[i - 1].count;
+        if (left_count == 0 || right_counts[i] == 0)
+            continue;
+
+        double cost = sphere_cloud_box_area(&left) * left_count
+                      + right_areas[i] * right_counts[i];
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            *split_bin = i;
+        }
+    }
+    return best_cost;
+}
+
+static inline void sphere_cloud_swap(struct sphere_cloud *cloud, size_t a,
+                                     size_t b)
+{
+    float *arrays[4] = {cloud->x, cloud->y, cloud->z, cloud->radius};
+    for (size_t i = 0; i < 4; i++)
+    {
+        float tmp = arrays[i][a];
+        arrays[i][a] = arrays[i][b];
+        arrays[i][b] = tmp;
+    }
+}
+
+/*
+** Reorders the spheres of the range [begin, end) so that the one at index k
+** is the one it would be if they were sorted along an axis, with no sphere
+** before it being further along.
+*/
+static void sphere_cloud_select(struct sphere_cloud *cloud, size_t begin,
+                                size_t end, size_t k, int axis)
+{
+    const float *centers[3] = {cloud->x, cloud->y, cloud->z};
+    const float *key = centers[axis];
+    while (end - begin > 1)
+    {
+        // three way partition: [begin, lt) is below the pivot, [lt, i)
+        // equal to it and [gt, end) above it
+        float pivot = key[begin + (end - begin) / 2];
+        size_t lt = begin;
+        size_t i = begin;
+        size_t gt = end;
+        while (i < gt)
+        {
+            float value = key[i];
+            if (value < pivot)
+                sphere_cloud_swap(cloud, lt++, i++);
+            else if (value > pivot)
+                sphere_cloud_swap(cloud, i, --gt);
+            else
+                i++;
+        }
+
+        if (k < lt)
+            end = lt;
+        else if (k >= gt)
+            begin = gt;
+        else
+            return;
+    }
+}
+
+/*
+** Computes the bounds of a node over the spheres of the range [begin, end),
+** and splits them in two using the binned surface area heuristic, moving
+** spheres around in the arrays of the cloud. Returns the number of spheres
+** moved to the left side, or zero if the node should be a leaf.
+*/
+static size_t sphere_cloud_split(struct sphere_cloud *cloud,
+                                 struct sphere_cloud_node *node, size_t begin,
+                                 size_t end, size_t depth)
+{
+    size_t count = end - begin;
+    const float *centers[3] = {cloud->x, cloud->y, cloud->z};
+    struct sphere_cloud_box bounds;
+    struct sphere_cloud_box center_bounds;
+    sphere_cloud_box_init_empty(&bounds);
+    sphere_cloud_box_init_empty(&center_bounds);
+    for (size_t i = begin; i < end; i++)
+    {
+        struct sphere_cloud_box box;
+        sphere_cloud_sphere_box(cloud, i, &box);
+        sphere_cloud_box_extend(&bounds, &box);
+        for (int axis = 0; axis < 3; axis++)
+            box.min[axis] = box.max[axis] = centers[axis][i];
+        sphere_cloud_box_extend(&center_bounds, &box);
+    }
+    // the bounds of spheres are rounded to the nearest, so stepping one unit
+    // outwards makes sure nodes contain them
+    for (int axis = 0; axis < 3; axis++)
+    {
+        node->min[axis] = nextafterf(bounds.min[axis], -INFINITY);
+        node->max[axis] = nextafterf(bounds.max[axis], INFINITY);
+    }
+
+    if (count <= SPHERE_CLOUD_LEAF_SIZE)
+        return 0;
+
+    int largest_axis = 0;
+    for (int axis = 1; axis < 3; axis++)
+        if (center_bounds.max[axis] - center_bounds.min[axis]
+            > center_bounds.max[largest_axis] - center_bounds.min[largest_axis])
+            largest_axis = axis;
+
+    // all the centers are at the same place, there's nothing to sort
+    if (center_bounds.max[largest_axis] == center_bounds.min[largest_axis])
+        return count / 2;
+
+    if (depth >= BVH_MEDIAN_DEPTH)
+    {
+        sphere_cloud_select(cloud, begin, end, begin + count / 2,
+                            largest_axis);
+        return count / 2;
+    }
+
+    size_t bin_count
+        = count < SPHERE_CLOUD_BIN_COUNT ? count : SPHERE_CLOUD_BIN_COUNT;
+
+    // bin spheres along all axes in a single pass
+    struct sphere_cloud_bin bins[3][SPHERE_CLOUD_BIN_COUNT];
+    double scales[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double extent = (double)center_bounds.max[axis]
+                        - center_bounds.min[axis];
+        scales[axis] = extent > 0 ? bin_count / extent : 0;
+        for (size_t i = 0; i < bin_count; i++)
+        {
+            sphere_cloud_box_init_empty(&bins[axis][i].bounds);
+            bins[axis][i].count = 0;
+        }
+    }
+
+    for (size_t i = begin; i < end; i++)
+    {
+        struct sphere_cloud_box box;
+        sphere_cloud_sphere_box(cloud, i, &box);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            size_t bin_i = sphere_cloud_bin_index(
+                centers[axis][i], center_bounds.min[axis], scales[axis],
+                bin_count);
+            struct sphere_cloud_bin *bin = &bins[axis][bin_i];
+            sphere_cloud_box_extend(&bin->bounds, &box);
+            bin->count++;
+        }
+    }
+
+    int best_axis = -1;
+    size_t best_bin = 0;
+    double best_cost = INFINITY;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // all the centers are in the same bin along this axis
+        if (scales[axis] == 0)
+            continue;
+
+        size_t split_bin = 0;
+        double cost = sphere_cloud_sweep_bins(bins[axis], bin_count,
+                                              &split_bin);
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best_axis = axis;
+            best_bin = split_bin;
+        }
+    }
+
+    // all the centers fell in a single bin along all axes
+    if (best_axis == -1)
+    {
+        sphere_cloud_select(cloud, begin, end, begin + count / 2,
+                            largest_axis);
+        return count / 2;
+    }
+
+    // move the spheres of the left bins to the front
+    const float *key = centers[best_axis];
+    double min = center_bounds.min[best_axis];
+    double scale = scales[best_axis];
+    size_t left = begin;
+    size_t right = end;
+    while (left < right)
+    {
+        if (sphere_cloud_bin_index(key[left], min, scale, bin_count)
+            < best_bin)
+        {
+            left++;
+            continue;
+        }
+
+        right--;
+        sphere_cloud_swap(cloud, left, right);
+    }
+    return left - begin;
+}
+
+/*
+** The spheres of a cloud and the bounds of the nodes built over them, as
+** numbered by bvh_build_parallel.
+*/
+struct sphere_cloud_builder
+{
+    struct sphere_cloud *cloud;
+    struct sphere_cloud_node *nodes;
+};
+
+static size_t sphere_cloud_split_node(void *data, size_t node_i,
+                                      size_t begin, size_t end, size_t depth)
+{
+    struct sphere_cloud_builder *builder = data;
+    return sphere_cloud_split(builder->cloud, &builder->nodes[node_i], begin,
+                              end, depth);
+}
+
+void sphere_cloud_build(struct sphere_cloud *cloud,
+                        const struct bvh_build_options *options)
+{
+    free(cloud->nodes);
+    cloud->nodes = NULL;
+    cloud->node_count = 0;
+    aabb_init_empty(&cloud->bounds);
+
+    size_t count = cloud->sphere_count;
+    if (count == 0)
+        return;
+
+    // leaves refer to spheres using 32 bit indices
+    if (count > UINT32_MAX)
+        errx(1, "too many spheres: %zu", count);
+
+    // spheres are reordered in place, so drop the room left for more of them
+    sphere_cloud_reserve(cloud, count);
+
+    // nodes are only touched once used, so that reserving room for the
+    // largest possible tree doesn't cost memory
+    struct sphere_cloud_builder builder = {
+        .cloud = cloud,
+        .nodes = xcalloc(2 * count - 1, sizeof(*builder.nodes)),
+    };
+    struct bvh_build_node *nodes = bvh_build_parallel(
+        count, options->pool, sphere_cloud_split_node, &builder,
+        &cloud->node_count);
+
+    cloud->nodes = xcalloc(cloud->node_count, sizeof(*cloud->nodes));
+    for (size_t i = 0; i < cloud->node_count; i++)
+    {
+        cloud->nodes[i] = builder.nodes[nodes[i].src];
+        cloud->nodes[i].offset = nodes[i].offset;
+        cloud->nodes[i].count = nodes[i].count;
+    }
+    free(nodes);
+    free(builder.nodes);
+
+    // the root node is rounded outwards, while cameras are framed using the
+    // exact bounds of the cloud
+    for (size_t i = 0; i < count; i++)
+    {
+        struct vec3 center = {cloud->x[i], cloud->y[i], cloud->z[i]};
+        struct vec3 radius = {cloud->radius[i], cloud->radius[i],
+                              cloud->radius[i]};
+        struct aabb box = {vec3_sub(&center, &radius),
+                           vec3_add(&center, &radius)};
+        aabb_extend(&cloud->bounds, &box);
+    }
+}
+
+size_t sphere_cloud_memory(const struct sphere_cloud *cloud)
+{
+    return 4 * (cloud->capacity + SPHERE_CLOUD_LANES - 1) * sizeof(float)
+           + cloud->node_count * sizeof(*cloud->nodes);
+}
+
+/*
+** A ray, converted to single precision.
+*/
+struct sphere_cloud_ray
+{
+    float source[3];
+    float direction[3];
+    float inv_direction[3];
+};
+
+static void sphere_cloud_ray_init(struct sphere_cloud_ray *res,
+                                  const struct ray *ray)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        res->source[axis] = vec3_get(&ray->source, axis);
+        res->direction[axis] = vec3_get(&ray->direction, axis);
+        res->inv_direction[axis] = 1.f / res->direction[axis];
+    }
+}
+
+/*
+** Returns the distance at which the ray enters the box of a node, if it's
+** lower than max_dist, or INFINITY.
+*/
+static inline float
+sphere_cloud_node_entry(const struct sphere_cloud_node *node,
+                        const struct sphere_cloud_ray *ray, float max_dist)
+{
+    float tmin = 0;
+    float tmax = max_dist;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float inv_dir = ray->inv_direction[axis];
+        float tnear = (node->min[axis] - ray->source[axis]) * inv_dir;
+        float tfar = (node->max[axis] - ray->source[axis]) * inv_dir;
+        if (inv_dir < 0)
+        {
+            float tmp = tnear;
+            tnear = tfar;
+            tfar = tmp;
+        }
+
+        // NaNs, which come from rays lying in the plane of a slab, are ignored
+        tmin = tnear > tmin ? tnear : tmin;
+        tmax = tfar < tmax ? tfar : tmax;
+    }
+    return tmin <= tmax ? tmin : INFINITY;
+}
+
+/*
+** Tests the ray against count spheres, starting at index offset. When one is
+** hit closer than *max_dist, stores the distance to it in *max_dist and its
+** index in *closest, and returns true. Unless any is set, the closest hit is
+** kept, and ties go to the lowest index.
+**
+** Rays hit spheres at the distance b - sqrt(r^2 - |f|^2), or b + the same
+** from inside, where b is the projection of the center on the ray and f the
+** vector from the center to this projection. Computing |f| directly rather
+** than |center|^2 - b^2 avoids cancellation with distant spheres.
+*/
+#ifdef __SSE2__
+static bool sphere_cloud_leaf(const struct sphere_cloud *cloud,
+                              const struct sphere_cloud_ray *ray,
+                              size_t offset, size_t count, float *max_dist,
+                              uint32_t *closest, bool any)
+{
+    __m128 source[3];
+    __m128 direction[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        source[axis] = _mm_set1_ps(ray->source[axis]);
+        direction[axis] = _mm_set1_ps(ray->direction[axis]);
+    }
+    const __m128i lane_indices = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128 zero = _mm_setzero_ps();
+
+    bool found = false;
+    for (size_t i = 0; i < count; i += SPHERE_CLOUD_LANES)
+    {
+        size_t first = offset + i;
+        __m128 ox = _mm_sub_ps(_mm_loadu_ps(&cloud->x[first]), source[0]);
+        __m128 oy = _mm_sub_ps(_mm_loadu_ps(&cloud->y[first]), source[1]);
+        __m128 oz = _mm_sub_ps(_mm_loadu_ps(&cloud->z[first]), source[2]);
+        __m128 radius = _mm_loadu_ps(&cloud->radius[first]);
+
+        __m128 b = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(ox, direction[0]),
+                       _mm_mul_ps(oy, direction[1])),
+            _mm_mul_ps(oz, direction[2]));
+        __m128 fx = _mm_sub_ps(ox, _mm_mul_ps(b, direction[0]));
+        __m128 fy = _mm_sub_ps(oy, _mm_mul_ps(b, direction[1]));
+        __m128 fz = _mm_sub_ps(oz, _mm_mul_ps(b, direction[2]));
+        __m128 f2 = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)),
+            _mm_mul_ps(fz, fz));
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(radius, radius), f2);
+        __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+        __m128 near = _mm_sub_ps(b, root);
+        __m128 far = _mm_add_ps(b, root);
+        __m128 near_ok = _mm_cmpge_ps(near, zero);
+        __m128 t = _mm_or_ps(_mm_and_ps(near_ok, near),
+                             _mm_andnot_ps(near_ok, far));
+
+        __m128 valid = _mm_castsi128_ps(_mm_cmplt_epi32(
+            lane_indices, _mm_set1_epi32((int)(count - i))));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(disc, zero));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(t, zero));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(*max_dist)));
+        int mask = _mm_movemask_ps(valid);
+        if (mask == 0)
+            continue;
+
+        float dists[SPHERE_CLOUD_LANES];
+        _mm_storeu_ps(dists, t);
+        for (; mask != 0; mask &= mask - 1)
+        {
+            int lane = __builtin_ctz(mask);
+            if (dists[lane] < *max_dist)
+            {
+                *max_dist = dists[lane];
+                *closest = first + lane;
+                found = true;
+            }
+        }
+        if (found && any)
+            return true;
+    }
+    return found;
+}
+#else
+static bool sphere_cloud_leaf(const struct sphere_cloud *cloud,
+                              const struct sphere_cloud_ray *ray,
+                              size_t offset, size_t count, float *max_dist,
+                              uint32_t *closest, bool any)
+{
+    const float *direction = ray->direction;
+    bool found = false;
+    for (size_t i = offset; i < offset + count; i++)
+    {
+        float ox = cloud->x[i] - ray->source[0];
+        float oy = cloud->y[i] - ray->source[1];
+        float oz = cloud->z[i] - ray->source[2];
+        float b = ox * direction[0] + oy * direction[1] + oz * direction[2];
+        float fx = ox - b * direction[0];
+        float fy = oy - b * direction[1];
+        float fz = oz - b * direction[2];
+        float disc = cloud->radius[i] * cloud->radius[i]
+                     - (fx * fx + fy * fy + fz * fz);
+        if (disc < 0)
+            continue;
+
+        float root = sqrtf(disc);
+        float t = b - root;
+        if (t < 0)
+            t = b + root;
+        if (t < 0 || t >= *max_dist)
+            continue;
+
+        *max_dist = t;
+        *closest = i;
+        found = true;
+        if (any)
+            return true;
+    }
+    return found;
+}
+#endif
+
+/*
+** Finds the closest sphere hit by the ray closer than *max_dist, or any of
+** them if any is set. Returns false if there's none.
+*/
+static bool sphere_cloud_traverse(const struct sphere_cloud *cloud,
+                                  const struct ray *ray, float *max_dist,
+                                  uint32_t *closest, bool any)
+{
+    if (cloud->node_count == 0)
+        return false;
+
+    struct sphere_cloud_ray cloud_ray;
+    sphere_cloud_ray_init(&cloud_ray, ray);
+
+    bool found = false;
+    uint32_t stack[BVH_MAX_DEPTH + 1];
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0)
+    {
+        const struct sphere_cloud_node *node
+            = &cloud->nodes[stack[--stack_size]];
+        if (isinf(sphere_cloud_node_entry(node, &cloud_ray, *max_dist)))
+            continue;
+
+        if (node->count != 0)
+        {
+            if (sphere_cloud_leaf(cloud, &cloud_ray, node->offset, node->count,
+                                  max_dist, closest, any))
+            {
+                found = true;
+                if (any)
+                    return true;
+            }
+            continue;
+        }
+
+        // visit the closest child first
+        uint32_t near = node->offset;
+        uint32_t far = node->offset + 1;
+        float near_dist = sphere_cloud_node_entry(&cloud->nodes[near],
+                                                  &cloud_ray, *max_dist);
+        float far_dist = sphere_cloud_node_entry(&cloud->nodes[far],
+                                                 &cloud_ray, *max_dist);
+        if (far_dist < near_dist)
+        {
+            uint32_t tmp = near;
+            near = far;
+            far = tmp;
+        }
+        stack[stack_size++] = far;
+        stack[stack_size++] = near;
+    }
+    return found;
+}
+
+double object_sphere_cloud_ray_intersect(struct object_hit *hit,
+                                         const struct object *obj,
+                                         size_t prim, const struct ray *ray)
+{
+    (void)prim;
+    const struct sphere_cloud *cloud = (const struct sphere_cloud *)obj;
+    float dist = INFINITY;
+    uint32_t sphere;
+    if (!sphere_cloud_traverse(cloud, ray, &dist, &sphere, false))
+        return INFINITY;
+
+    hit->inner_prim = sphere;
+    hit->inner_dist = dist;
+    return dist;
+}
+
+void object_sphere_cloud_resolve(struct object_intersection *inter,
+                                 const struct object *obj, size_t prim,
+                                 const struct ray *ray, double dist,
+                                 const struct object_hit *hit)
+{
+    (void)prim;
+    const struct sphere_cloud *cloud = (const struct sphere_cloud *)obj;
+    size_t i = hit->inner_prim;
+    struct vec3 center = {cloud->x[i], cloud->y[i], cloud->z[i]};
+    struct vec3 point_offset = vec3_mul(&ray->direction, dist);
+    inter->location.point = vec3_add(&ray->source, &point_offset);
+    inter->location.normal = vec3_sub(&inter->location.point, &center);
+    vec3_normalize(&inter->location.normal);
+    inter->location.u = 0;
+    inter->location.v = 0;
+    inter->material = cloud->material;
+}
+
+bool object_sphere_cloud_occluded(const struct object *obj, size_t prim,
+                                  const struct ray *ray, double max_dist)
+{
+    (void)prim;
+    const struct sphere_cloud *cloud = (const struct sphere_cloud *)obj;
+    // single precision distances below this are exactly those below max_dist
+    float dist = sphere_cloud_round(max_dist, true);
+    uint32_t sphere;
+    return sphere_cloud_traverse(cloud, ray, &dist, &sphere, true);
+}
+
+void object_sphere_cloud_bounds(struct aabb *bounds, const struct object *obj,
+                                size_t prim)
+{
+    (void)prim;
+    const struct sphere_cloud *cloud = (const struct sphere_cloud *)obj;
+    *bounds = cloud->bounds;
+}
+
+void sphere_cloud_free(struct object *obj)
+{
+    struct sphere_cloud *cloud = (struct sphere_cloud *)obj;
+    material_put(cloud->material);
+    free(cloud->x);
+    free(cloud->y);
+    free(cloud->z);
+    free(cloud->radius);
+    free(cloud->nodes);
+    free(cloud);
+}
@@ -0,0 +1,159 @@
+#include "thread_pool.h"
+#include "utils/alloc.h"
+#include "utils/cpu.h"
+
+#include <err.h>
+#include <sched.h>
+#include <stdlib.h>
+
+struct thread_pool_worker
+{
+    struct thread_pool *pool;
+    size_t thread_i;
+};
+
+static void thread_pool_pin(struct thread_pool *pool, size_t thread_i)
+{
+    int cpu = pool->cpus[thread_i];
+    if (cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0)
+        errx(1, "failed to pin a thread to processor %d", cpu);
+}
+
+static void *thread_pool_worker(void *data)
+{
+    struct thread_pool_worker *worker = data;
+    struct thread_pool *pool = worker->pool;
+    thread_pool_pin(pool, worker->thread_i);
+
+    size_t generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        while (pool->generation == generation && !pool->stopping)
+            pthread_cond_wait(&pool->task_cond, &pool->lock);
+        if (pool->stopping)
+            break;
+
+        generation = pool->generation;
+        thread_pool_task_f task = pool->task;
+        void *task_data = pool->data;
+        pthread_mutex_unlock(&pool->lock);
+
+        task(task_data, worker->thread_i);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+** Assigns the processors of the affinity mask to threads in order, going
+** around when there are more threads than processors.
+*/
+static void thread_pool_assign_cpus(struct thread_pool *pool)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) == 0)
+        err(1, "failed to get the processors threads may run on");
+
+    int cpu = -1;
+    for (size_t i = 0; i < pool->thread_count; i++)
+    {
+        do
+            cpu = (cpu + 1) % CPU_SETSIZE;
+        while (!CPU_ISSET(cpu, &set));
+        pool->cpus[i] = cpu;
+        pool->nodes[i] = cpu_node(cpu);
+    }
+}
+
+struct thread_pool *thread_pool_create(size_t thread_count, bool pin)
+{
+    if (thread_count == 0)
+        thread_count = 1;
+
+    struct thread_pool *pool = zalloc(sizeof(*pool));
+    pool->thread_count = thread_count;
+    pool->threads = xcalloc(thread_count, sizeof(*pool->threads));
+    pool->workers = xcalloc(thread_count, sizeof(*pool->workers));
+    pool->cpus = xcalloc(thread_count, sizeof(*pool->cpus));
+    pool->nodes = xcalloc(thread_count, sizeof(*pool->nodes));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->task_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (size_t i = 0; i < thread_count; i++)
+        pool->cpus[i] = -1;
+    if (pin)
+        thread_pool_assign_cpus(pool);
+
+    // the calling thread is thread zero
+    thread_pool_pin(pool, 0);
+    for (size_t i = 1; i < thread_count; i++)
+    {
+        pool->workers[i] = (struct thread_pool_worker){pool, i};
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker,
+                           &pool->workers[i]) != 0)
+            err(1, "Fail to create thread");
+    }
+    return pool;
+}
+
+void thread_pool_run(struct thread_pool *pool, thread_pool_task_f task,
+                     void *data)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->data = data;
+    pool->running = pool->thread_count - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->task_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    task(data, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running != 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int thread_pool_node(const struct thread_pool *pool, size_t thread_i)
+{
+    if (pool->cpus[thread_i] >= 0)
+        return pool->nodes[thread_i];
+
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu_node(cpu);
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->task_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 1; i < pool->thread_count; i++)
+        if (pthread_join(pool->threads[i], NULL) != 0)
+            err(1, "Fail to join thread");
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->task_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->nodes);
+    free(pool->cpus);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,200 @@
+#include "tile_scheduler.h"
+#include "utils/alloc.h"
+#include "utils/timer.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+** The tiles left in the range of a thread, from begin to end excluded.
+*/
+struct tile_range
+{
+    size_t begin;
+    size_t end;
+};
+
+struct tile_ctx
+{
+    size_t width;
+    size_t height;
+    size_t tile_size;
+    size_t tiles_x;
+    size_t tile_count;
+
+    tile_render_f render;
+    void *data;
+    bool steal;
+
+    struct thread_pool *pool;
+    struct tile_thread_stats *stats;
+
+    // the ranges of all threads, guarded by lock
+    struct tile_range *ranges;
+    pthread_mutex_t lock;
+};
+
+static void tile_ctx_init(struct tile_ctx *ctx, struct thread_pool *pool,
+                          size_t width, size_t height, size_t tile_size,
+                          tile_render_f render, void *data, bool steal)
+{
+    if (tile_size == 0)
+        tile_size = TILE_SCHEDULER_DEFAULT_SIZE;
+
+    size_t tiles_x = (width + tile_size - 1) / tile_size;
+    size_t tiles_y = (height + tile_size - 1) / tile_size;
+    size_t thread_count = pool->thread_count;
+    *ctx = (struct tile_ctx){
+        .width = width,
+        .height = height,
+        .tile_size = tile_size,
+        .tiles_x = tiles_x,
+        .tile_count = tiles_x * tiles_y,
+        .render = render,
+        .data = data,
+        .steal = steal,
+        .pool = pool,
+        .stats = xcalloc(thread_count, sizeof(*ctx->stats)),
+        .ranges = xcalloc(thread_count, sizeof(*ctx->ranges)),
+    };
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        ctx->ranges[i].begin = i * ctx->tile_count / thread_count;
+        ctx->ranges[i].end = (i + 1) * ctx->tile_count / thread_count;
+    }
+}
+
+static void tile_ctx_destroy(struct tile_ctx *ctx)
+{
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx->ranges);
+    free(ctx->stats);
+}
+
+/*
+** Picks the next tile of a thread, either from its own range, or from the
+** end of the largest range left. Returns false once all tiles are taken.
+*/
+static bool tile_take(struct tile_ctx *ctx, size_t thread_i, size_t *tile_i,
+                      bool *stolen)
+{
+    bool found = true;
+    pthread_mutex_lock(&ctx->lock);
+    struct tile_range *own = &ctx->ranges[thread_i];
+    if (own->begin < own->end)
+    {
+        *tile_i = own->begin++;
+        *stolen = false;
+    }
+    else if (ctx->steal)
+    {
+        struct tile_range *victim = own;
+        for (size_t i = 0; i < ctx->pool->thread_count; i++)
+        {
+            struct tile_range *range = &ctx->ranges[i];
+            if (range->end - range->begin > victim->end - victim->begin)
+                victim = range;
+        }
+
+        found = victim->begin < victim->end;
+        if (found)
+            *tile_i = --victim->end;
+        *stolen = true;
+    }
+    else
+        found = false;
+    pthread_mutex_unlock(&ctx->lock);
+    return found;
+}
+
+static void tile_worker(void *data, size_t thread_i)
+{
+    struct tile_ctx *ctx = data;
+    struct tile_thread_stats *stats = &ctx->stats[thread_i];
+    stats->node = thread_pool_node(ctx->pool, thread_i);
+
+    size_t tile_i;
+    bool stolen;
+    while (tile_take(ctx, thread_i, &tile_i, &stolen))
+    {
+        double start = timer_now();
+        size_t min_x = tile_i % ctx->tiles_x * ctx->tile_size;
+        size_t min_y = tile_i / ctx->tiles_x * ctx->tile_size;
+        size_t width = ctx->width - min_x;
+        size_t height = ctx->height - min_y;
+        if (width > ctx->tile_size)
+            width = ctx->tile_size;
+        if (height > ctx->tile_size)
+            height = ctx->tile_size;
+        ctx->render(ctx->data, min_x, min_y, width, height);
+
+        stats->tile_count++;
+        stats->stolen_count += stolen;
+        stats->pixel_count += width * height;
+        stats->busy_time += timer_now() - start;
+    }
+}
+
+void tile_scheduler_run(struct thread_pool *pool, size_t width, size_t height,
+                        size_t tile_size, tile_render_f render, void *data,
+                        struct tile_scheduler_stats *stats)
+{
+    struct tile_ctx ctx;
+    tile_ctx_init(&ctx, pool, width, height, tile_size, render, data, true);
+
+    double start = timer_now();
+    thread_pool_run(pool, tile_worker, &ctx);
+    double wall_time = timer_now() - start;
+
+    if (stats != NULL)
+    {
+        size_t thread_count = pool->thread_count;
+        *stats = (struct tile_scheduler_stats){
+            .tile_count = ctx.tile_count,
+            .thread_count = thread_count,
+            .wall_time = wall_time,
+            .threads = xcalloc(thread_count, sizeof(*stats->threads)),
+        };
+
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            stats->threads[i] = ctx.stats[i];
+            if ((size_t)ctx.stats[i].node >= stats->node_count)
+                stats->node_count = ctx.stats[i].node + 1;
+        }
+
+        stats->nodes = xcalloc(stats->node_count, sizeof(*stats->nodes));
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            const struct tile_thread_stats *thread = &ctx.stats[i];
+            struct tile_node_stats *node = &stats->nodes[thread->node];
+            node->thread_count++;
+            node->tile_count += thread->tile_count;
+            node->pixel_count += thread->pixel_count;
+            node->busy_time += thread->busy_time;
+        }
+    }
+
+    tile_ctx_destroy(&ctx);
+}
+
+void tile_scheduler_first_touch(struct thread_pool *pool, size_t width,
+                                size_t height, size_t tile_size,
+                                tile_render_f touch, void *data)
+{
+    struct tile_ctx ctx;
+    tile_ctx_init(&ctx, pool, width, height, tile_size, touch, data, false);
+    thread_pool_run(pool, tile_worker, &ctx);
+    tile_ctx_destroy(&ctx);
+}
+
+void tile_scheduler_stats_destroy(struct tile_scheduler_stats *stats)
+{
+    free(stats->threads);
+    free(stats->nodes);
+    stats->threads = NULL;
+    stats->nodes = NULL;
+}
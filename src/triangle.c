@@ -4,79 +4,116 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#define INTER_EPSILON 0.0000001
-
-double object_triangle_ray_intersect(struct object_intersection *inter,
-                                     const struct object *obj,
-                                     const struct ray *ray)
+void triangle_update(struct triangle *trian)
 {
-    struct triangle *trian = (struct triangle *)obj;
-
     /*        0
     **        o
     **       / \
-    **   a  /   \  c
+    **  e0  /   \  e1
     **     /     \
     **    /       \
     ** 1 o---------o 2
-    **        b
     **
     ** The facing side is the one where points appear counter-clockwise.
     ** It's a somewhat arbitrary choice. I picked this way because of OpenGL.
     */
+    trian->edges[0] = vec3_sub(&trian->points[1], &trian->points[0]);
+    trian->edges[1] = vec3_sub(&trian->points[2], &trian->points[0]);
+    trian->normal = vec3_cross(&trian->edges[0], &trian->edges[1]);
+    vec3_normalize(&trian->normal);
+}
 
-    const struct vec3 *v0 = &trian->points[0];
-    const struct vec3 *v1 = &trian->points[1];
-    const struct vec3 *v2 = &trian->points[2];
-
-    struct vec3 a = vec3_sub(v1, v0);
-    struct vec3 b = vec3_sub(v2, v1);
-    struct vec3 c = vec3_sub(v0, v2);
-
-    // compute the face's normal vector
-    struct vec3 n = vec3_cross(&a, &b);
-
-    // if the normal and the ray direction have the same sign, then the triangle
-    // is facing the wrong way
-    if (vec3_dot(&ray->direction, &n) >= 0)
-        return INFINITY;
+double triangle_ray_dist(const struct triangle *trian, const struct ray *ray,
+                         double max_dist, double *u, double *v)
+{
+    return triangle_intersect(&trian->points[0], &trian->edges[0],
+                              &trian->edges[1], ray, max_dist, u, v);
+}
 
-    // compute the distance from the plane to (0, 0, 0)
-    // (aka the fourth plane equation component)
-    double D = -vec3_dot(&n, v0);
-    double t
-        = -(vec3_dot(&n, &ray->source) + D) / vec3_dot(&n, &ray->direction);
-    if (t < 0)
-        return INFINITY;
+double object_triangle_ray_intersect(struct object_hit *hit,
+                                     const struct object *obj, size_t prim,
+                                     const struct ray *ray)
+{
+    (void)prim;
+    const struct triangle *trian = (const struct triangle *)obj;
+    return triangle_ray_dist(trian, ray, INFINITY, &hit->u, &hit->v);
+}
 
+void object_triangle_resolve(struct object_intersection *inter,
+                             const struct object *obj, size_t prim,
+                             const struct ray *ray, double dist,
+                             const struct object_hit *hit)
+{
+    (void)prim;
+    const struct triangle *trian = (const struct triangle *)obj;
     // P = O + t * dir
-    struct vec3 P_off = vec3_mul(&ray->direction, t);
-    struct vec3 P = vec3_add(&ray->source, &P_off);
-
-    // check on which side of a, b, and c P is
+    struct vec3 point_offset = vec3_mul(&ray->direction, dist);
+    inter->location.point = vec3_add(&ray->source, &point_offset);
+    inter->location.normal = trian->normal;
+    inter->location.u = hit->u;
+    inter->location.v = hit->v;
+    inter->material = trian->material;
+}
 
-    struct vec3 v0_to_p = vec3_sub(&P, v0);
-    struct vec3 v0_cross = vec3_cross(&a, &v0_to_p);
-    if (vec3_dot(&v0_cross, &n) < -INTER_EPSILON)
-        return INFINITY;
+bool object_triangle_occluded(const struct object *obj, size_t prim,
+                              const struct ray *ray, double max_dist)
+{
+    (void)prim;
+    const struct triangle *trian = (const struct triangle *)obj;
+    double u;
+    double v;
+    return !isinf(triangle_ray_dist(trian, ray, max_dist, &u, &v));
+}
 
-    struct vec3 v1_to_p = vec3_sub(&P, v1);
-    struct vec3 v1_cross = vec3_cross(&b, &v1_to_p);
-    if (vec3_dot(&v1_cross, &n) < -INTER_EPSILON)
-        return INFINITY;
+void object_triangle_bounds(struct aabb *bounds, const struct object *obj,
+                           size_t prim)
+{
+    (void)prim;
+    const struct triangle *trian = (const struct triangle *)obj;
+    aabb_init_empty(bounds);
+    for (size_t i = 0; i < 3; i++)
+        aabb_extend_point(bounds, &trian->points[i]);
+}
 
-    struct vec3 v2_to_p = vec3_sub(&P, v2);
-    struct vec3 v2_cross = vec3_cross(&c, &v2_to_p);
-    if (vec3_dot(&v2_cross, &n) < -INTER_EPSILON)
-        return INFINITY;
+void triangle_split(const struct vec3 *points[3], int axis, double pos,
+                    struct aabb *left, struct aabb *right)
+{
+    aabb_init_empty(left);
+    aabb_init_empty(right);
+    for (size_t i = 0; i < 3; i++)
+    {
+        const struct vec3 *v0 = points[i];
+        const struct vec3 *v1 = points[(i + 1) % 3];
+        double c0 = vec3_get(v0, axis);
+        double c1 = vec3_get(v1, axis);
+        if (c0 <= pos)
+            aabb_extend_point(left, v0);
+        if (c0 >= pos)
+            aabb_extend_point(right, v0);
+
+        // the edge crosses the plane
+        if ((c0 < pos && c1 > pos) || (c0 > pos && c1 < pos))
+        {
+            struct vec3 edge = vec3_sub(v1, v0);
+            struct vec3 off = vec3_mul(&edge, (pos - c0) / (c1 - c0));
+            struct vec3 point = vec3_add(v0, &off);
+            aabb_extend_point(left, &point);
+            aabb_extend_point(right, &point);
+        }
+    }
+}
 
-    // if P is on the right side of the triangle's edges,
-    // it is inside the triangle, and there is an intersection
-    inter->material = trian->material;
-    vec3_normalize(&n);
-    inter->location.normal = n;
-    inter->location.point = P;
-    return t;
+void object_triangle_split(const struct object *obj, size_t prim, int axis,
+                           double pos, struct aabb *left, struct aabb *right)
+{
+    (void)prim;
+    const struct triangle *trian = (const struct triangle *)obj;
+    const struct vec3 *points[3] = {
+        &trian->points[0],
+        &trian->points[1],
+        &trian->points[2],
+    };
+    triangle_split(points, axis, pos, left, right);
 }
 
 void triangle_free(struct object *obj)
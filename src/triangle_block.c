@@ -0,0 +1,113 @@
+#include "triangle_block.h"
+#include "triangle.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void triangle_block_set(struct triangle_block *block, size_t lane,
+                        const struct vec3 *points[3], uint32_t prim)
+{
+    struct vec3 e0 = vec3_sub(points[1], points[0]);
+    struct vec3 e1 = vec3_sub(points[2], points[0]);
+    triangle_block_set_edges(block, lane, points[0], &e0, &e1, prim);
+}
+
+void triangle_block_set_edges(struct triangle_block *block, size_t lane,
+                              const struct vec3 *v0, const struct vec3 *e0,
+                              const struct vec3 *e1, uint32_t prim)
+{
+    const struct vec3 *vectors[3] = {v0, e0, e1};
+    real(*dst[3])[TRIANGLE_BLOCK_WIDTH] = {block->v0, block->e0, block->e1};
+    for (size_t i = 0; i < 3; i++)
+    {
+        dst[i][0][lane] = vectors[i]->x;
+        dst[i][1][lane] = vectors[i]->y;
+        dst[i][2][lane] = vectors[i]->z;
+    }
+    block->prims[lane] = prim;
+}
+
+#if defined(__SSE2__) && defined(RT_FLOAT_GEOMETRY)
+#define TBLK_FNAME triangle_block_intersect_sse2
+#define TBLK_LANES 4
+#define TBLK_VEC __m128
+#define TBLK_SET1 _mm_set1_ps
+#define TBLK_LOAD _mm_loadu_ps
+#define TBLK_STORE _mm_storeu_ps
+#define TBLK_ADD _mm_add_ps
+#define TBLK_SUB _mm_sub_ps
+#define TBLK_MUL _mm_mul_ps
+#define TBLK_DIV _mm_div_ps
+#define TBLK_LT _mm_cmplt_ps
+#define TBLK_LE _mm_cmple_ps
+#define TBLK_GT _mm_cmpgt_ps
+#define TBLK_GE _mm_cmpge_ps
+#define TBLK_AND _mm_and_ps
+#define TBLK_MOVEMASK _mm_movemask_ps
+#define TBLK_SELECT(Mask, A, B)                                                \
+    _mm_or_ps(_mm_and_ps((Mask), (A)), _mm_andnot_ps((Mask), (B)))
+#include "triangle_block.defs"
+#elif defined(__SSE2__)
+#define TBLK_FNAME triangle_block_intersect_sse2
+#define TBLK_LANES 2
+#define TBLK_VEC __m128d
+#define TBLK_SET1 _mm_set1_pd
+#define TBLK_LOAD _mm_loadu_pd
+#define TBLK_STORE _mm_storeu_pd
+#define TBLK_ADD _mm_add_pd
+#define TBLK_SUB _mm_sub_pd
+#define TBLK_MUL _mm_mul_pd
+#define TBLK_DIV _mm_div_pd
+#define TBLK_LT _mm_cmplt_pd
+#define TBLK_LE _mm_cmple_pd
+#define TBLK_GT _mm_cmpgt_pd
+#define TBLK_GE _mm_cmpge_pd
+#define TBLK_AND _mm_and_pd
+#define TBLK_MOVEMASK _mm_movemask_pd
+#define TBLK_SELECT(Mask, A, B)                                                \
+    _mm_or_pd(_mm_and_pd((Mask), (A)), _mm_andnot_pd((Mask), (B)))
+#include "triangle_block.defs"
+#endif
+
+bool triangle_block_intersect(const struct triangle_block *block,
+                              size_t lane_begin, size_t lane_end,
+                              const struct ray *ray, double max_dist,
+                              struct triangle_block_hit *hit)
+{
+    real dists[TRIANGLE_BLOCK_WIDTH];
+    real det_u[TRIANGLE_BLOCK_WIDTH];
+    real det_v[TRIANGLE_BLOCK_WIDTH];
+    real det[TRIANGLE_BLOCK_WIDTH];
+
+#ifdef __SSE2__
+    // only test the vectors holding the requested lanes
+    real limit = triangle_block_dist_up(max_dist);
+    bool any_hit = false;
+    for (size_t i = lane_begin / TBLK_LANES * TBLK_LANES; i < lane_end;
+         i += TBLK_LANES)
+        any_hit |= triangle_block_intersect_sse2(
+            block, i, ray, limit, &dists[i], &det_u[i], &det_v[i], &det[i]);
+    if (!any_hit)
+        return false;
+#else
+    // without vector instructions, test lanes one by one, and store the
+    // barycentric coordinates themselves
+    for (size_t i = lane_begin; i < lane_end; i++)
+    {
+        struct vec3 v0;
+        struct vec3 e0;
+        struct vec3 e1;
+        triangle_block_get(block, i, &v0, &e0, &e1);
+        double u;
+        double v;
+        dists[i] = triangle_intersect(&v0, &e0, &e1, ray, max_dist, &u, &v);
+        det_u[i] = u;
+        det_v[i] = v;
+        det[i] = 1;
+    }
+#endif
+
+    return triangle_block_closest(block, lane_begin, lane_end, dists, det_u,
+                                  det_v, det, hit);
+}
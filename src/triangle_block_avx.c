@@ -0,0 +1,76 @@
+#include "triangle_block.h"
+#include "triangle.h"
+
+// the 256 bit version of the test requires AVX, which isn't enabled by
+// default. callers must check that the processor supports it
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC target("avx")
+#define TRIANGLE_BLOCK_AVX
+#include <immintrin.h>
+#endif
+
+#if defined(TRIANGLE_BLOCK_AVX) && defined(RT_FLOAT_GEOMETRY)
+#define TBLK_FNAME triangle_block_intersect_lanes
+#define TBLK_LANES 8
+#define TBLK_VEC __m256
+#define TBLK_SET1 _mm256_set1_ps
+#define TBLK_LOAD _mm256_loadu_ps
+#define TBLK_STORE _mm256_storeu_ps
+#define TBLK_ADD _mm256_add_ps
+#define TBLK_SUB _mm256_sub_ps
+#define TBLK_MUL _mm256_mul_ps
+#define TBLK_DIV _mm256_div_ps
+#define TBLK_LT(A, B) _mm256_cmp_ps((A), (B), _CMP_LT_OQ)
+#define TBLK_LE(A, B) _mm256_cmp_ps((A), (B), _CMP_LE_OQ)
+#define TBLK_GT(A, B) _mm256_cmp_ps((A), (B), _CMP_GT_OQ)
+#define TBLK_GE(A, B) _mm256_cmp_ps((A), (B), _CMP_GE_OQ)
+#define TBLK_AND _mm256_and_ps
+#define TBLK_MOVEMASK _mm256_movemask_ps
+#define TBLK_SELECT(Mask, A, B) _mm256_blendv_ps((B), (A), (Mask))
+#include "triangle_block.defs"
+#elif defined(TRIANGLE_BLOCK_AVX)
+#define TBLK_FNAME triangle_block_intersect_lanes
+#define TBLK_LANES 4
+#define TBLK_VEC __m256d
+#define TBLK_SET1 _mm256_set1_pd
+#define TBLK_LOAD _mm256_loadu_pd
+#define TBLK_STORE _mm256_storeu_pd
+#define TBLK_ADD _mm256_add_pd
+#define TBLK_SUB _mm256_sub_pd
+#define TBLK_MUL _mm256_mul_pd
+#define TBLK_DIV _mm256_div_pd
+#define TBLK_LT(A, B) _mm256_cmp_pd((A), (B), _CMP_LT_OQ)
+#define TBLK_LE(A, B) _mm256_cmp_pd((A), (B), _CMP_LE_OQ)
+#define TBLK_GT(A, B) _mm256_cmp_pd((A), (B), _CMP_GT_OQ)
+#define TBLK_GE(A, B) _mm256_cmp_pd((A), (B), _CMP_GE_OQ)
+#define TBLK_AND _mm256_and_pd
+#define TBLK_MOVEMASK _mm256_movemask_pd
+#define TBLK_SELECT(Mask, A, B) _mm256_blendv_pd((B), (A), (Mask))
+#include "triangle_block.defs"
+#endif
+
+bool triangle_block_intersect_avx(const struct triangle_block *block,
+                                  size_t lane_begin, size_t lane_end,
+                                  const struct ray *ray, double max_dist,
+                                  struct triangle_block_hit *hit)
+{
+#ifdef TRIANGLE_BLOCK_AVX
+    real dists[TRIANGLE_BLOCK_WIDTH];
+    real det_u[TRIANGLE_BLOCK_WIDTH];
+    real det_v[TRIANGLE_BLOCK_WIDTH];
+    real det[TRIANGLE_BLOCK_WIDTH];
+    real limit = triangle_block_dist_up(max_dist);
+    bool any_hit = false;
+    for (size_t i = lane_begin / TBLK_LANES * TBLK_LANES; i < lane_end;
+         i += TBLK_LANES)
+        any_hit |= triangle_block_intersect_lanes(
+            block, i, ray, limit, &dists[i], &det_u[i], &det_v[i], &det[i]);
+    if (!any_hit)
+        return false;
+    return triangle_block_closest(block, lane_begin, lane_end, dists, det_u,
+                                  det_v, det, hit);
+#else
+    return triangle_block_intersect(block, lane_begin, lane_end, ray,
+                                    max_dist, hit);
+#endif
+}
@@ -33,3 +33,11 @@ __attribute__((malloc)) void *zalloc(size_t size)
     memset(res, 0, size);
     return res;
 }
+
+__attribute__((malloc)) void *xaligned_alloc(size_t alignment, size_t size)
+{
+    void *res;
+    if (posix_memalign(&res, alignment, size) != 0)
+        err(1, "posix_memalign failed");
+    return res;
+}
@@ -0,0 +1,257 @@
+#include "utils/cpu.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// where cgroup hierarchies are usually mounted
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/*
+** Returns the number of processors the process may run on, or zero if it
+** isn't known.
+*/
+static size_t cpu_affinity_count(void)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return 0;
+    return CPU_COUNT(&set);
+}
+
+/*
+** Reads the quota and period of a cgroup v2 cpu.max file. Returns zero if
+** the file doesn't exist or has no limit, and the number of processors the
+** quota is worth otherwise, rounded up.
+*/
+static size_t cgroup_v2_limit(const char *dir)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cpu.max", dir);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+
+    char quota[32];
+    unsigned long period;
+    int rc = fscanf(fp, "%31s %lu", quota, &period);
+    fclose(fp);
+    if (rc != 2 || strcmp(quota, "max") == 0 || period == 0)
+        return 0;
+
+    unsigned long quota_us = strtoul(quota, NULL, 10);
+    return (quota_us + period - 1) / period;
+}
+
+static long cgroup_read_long(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+
+    long value;
+    if (fscanf(fp, "%ld", &value) != 1)
+        value = -1;
+    fclose(fp);
+    return value;
+}
+
+/*
+** Same as cgroup_v2_limit, for the cpu.cfs_quota_us and cpu.cfs_period_us
+** files of cgroup v1, where a quota of -1 means no limit.
+*/
+static size_t cgroup_v1_limit(const char *dir)
+{
+    long quota = cgroup_read_long(dir, "cpu.cfs_quota_us");
+    long period = cgroup_read_long(dir, "cpu.cfs_period_us");
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return (quota + period - 1) / period;
+}
+
+/*
+** Returns the smallest limit of a cgroup and its ancestors, or zero if none
+** of them is limited. Limits of ancestors apply to their children, and
+** inside a cgroup namespace, the cgroup of the process is the root.
+*/
+static size_t cgroup_hierarchy_limit(const char *mount, const char *cgroup,
+                                     size_t (*read_limit)(const char *))
+{
+    char dir[PATH_MAX];
+    int len = snprintf(dir, sizeof(dir), "%s%s", mount, cgroup);
+    if (len < 0 || (size_t)len >= sizeof(dir))
+        return 0;
+
+    size_t mount_len = strlen(mount);
+    size_t min_limit = 0;
+    while (true)
+    {
+        size_t limit = read_limit(dir);
+        if (limit != 0 && (min_limit == 0 || limit < min_limit))
+            min_limit = limit;
+
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || (size_t)(slash - dir) < mount_len)
+            break;
+        *slash = '\0';
+    }
+    return min_limit;
+}
+
+/*
+** Returns whether a comma separated list of cgroup v1 controllers contains
+** the cpu controller.
+*/
+static bool has_cpu_controller(const char *controllers)
+{
+    const char *it = controllers;
+    while (true)
+    {
+        size_t len = strcspn(it, ",");
+        if (len == 3 && strncmp(it, "cpu", 3) == 0)
+            return true;
+        if (it[len] == '\0')
+            return false;
+        it += len + 1;
+    }
+}
+
+/*
+** Returns the number of processors the CFS quota of the cgroups of the
+** process is worth, or zero if there's no quota. Hierarchies are expected
+** at their usual mount points: /sys/fs/cgroup for cgroup v2, and
+** /sys/fs/cgroup/cpu or /sys/fs/cgroup/cpu,cpuacct for cgroup v1.
+*/
+static size_t cgroup_cpu_limit(void)
+{
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL)
+        return 0;
+
+    size_t min_limit = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_size, fp)) != -1)
+    {
+        // lines are formatted as id:controllers:path
+        if (line_len > 0 && line[line_len - 1] == '\n')
+            line[line_len - 1] = '\0';
+        char *controllers = strchr(line, ':');
+        char *cgroup = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (cgroup == NULL)
+            continue;
+        *controllers++ = '\0';
+        *cgroup++ = '\0';
+        if (strcmp(cgroup, "/") == 0)
+            cgroup = "";
+
+        size_t limit = 0;
+        if (strcmp(line, "0") == 0 && *controllers == '\0')
+            limit = cgroup_hierarchy_limit(CGROUP_ROOT, cgroup,
+                                           cgroup_v2_limit);
+        else if (has_cpu_controller(controllers))
+        {
+            limit = cgroup_hierarchy_limit(CGROUP_ROOT "/cpu", cgroup,
+                                           cgroup_v1_limit);
+            if (limit == 0)
+                limit = cgroup_hierarchy_limit(CGROUP_ROOT "/cpu,cpuacct",
+                                               cgroup, cgroup_v1_limit);
+        }
+
+        if (limit != 0 && (min_limit == 0 || limit < min_limit))
+            min_limit = limit;
+    }
+
+    free(line);
+    fclose(fp);
+    return min_limit;
+}
+
+size_t cpu_parse_worker_count(const char *str)
+{
+    // strtoul skips blanks and accepts signs, which would turn -1 into
+    // ULONG_MAX threads
+    if (!isdigit((unsigned char)*str))
+        return 0;
+
+    char *end;
+    errno = 0;
+    unsigned long count = strtoul(str, &end, 10);
+    if (*end != '\0' || errno != 0 || count > CPU_MAX_WORKERS)
+        return 0;
+    return count;
+}
+
+size_t cpu_worker_count(void)
+{
+    const char *env = getenv("RT_THREADS");
+    if (env != NULL && *env != '\0')
+    {
+        size_t count = cpu_parse_worker_count(env);
+        if (count == 0)
+            errx(1, "invalid RT_THREADS: %s", env);
+        return count;
+    }
+
+    // sysconf fails with -1, and may not know about any processor
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = online < 1 ? 1 : online;
+
+    // the process may be restricted to some processors
+    size_t affinity = cpu_affinity_count();
+    if (affinity != 0 && affinity < count)
+        count = affinity;
+
+    // running more threads than the quota allows gets them throttled
+    size_t quota = cgroup_cpu_limit();
+    if (quota != 0 && quota < count)
+        count = quota;
+
+    return count;
+}
+
+int cpu_node(int cpu)
+{
+    // sysfs links each processor to its node, as a nodeN entry
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char *end;
+        if (strncmp(entry->d_name, "node", 4) != 0)
+            continue;
+        long value = strtol(entry->d_name + 4, &end, 10);
+        if (*end == '\0' && end != entry->d_name + 4 && value >= 0)
+        {
+            node = value;
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+bool cpu_has_avx(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx");
+#else
+    return true;
+#endif
+}
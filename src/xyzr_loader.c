@@ -0,0 +1,184 @@
+#include "xyzr_loader.h"
+#include "color.h"
+#include "phong_material.h"
+#include "utils/alloc.h"
+
+#include <err.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// binary files are read by chunks of this many spheres
+#define XYZR_CHUNK_SIZE 4096
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+bool is_xyzr_file(const char *filename)
+{
+    return has_suffix(filename, ".xyzr") || has_suffix(filename, ".xyzrb");
+}
+
+/*
+** Returns whether a center and radius make a sphere nodes can bound: a
+** negative or NaN radius, or a coordinate which isn't finite, would corrupt
+** the bounds of nodes.
+*/
+static bool xyzr_valid_sphere(const float values[4])
+{
+    for (size_t i = 0; i < 4; i++)
+        if (!isfinite(values[i]))
+            return false;
+    return values[3] >= 0;
+}
+
+static bool load_xyzr_binary(struct sphere_cloud *cloud, FILE *fp,
+                             const char *filename)
+{
+    uint64_t count;
+    if (fread(&count, sizeof(count), 1, fp) != 1)
+    {
+        warnx("truncated sphere cloud header: %s", filename);
+        return false;
+    }
+
+    // check the size of the file before trusting the count
+    long start = ftell(fp);
+    if (start < 0 || fseek(fp, 0, SEEK_END) != 0)
+    {
+        warn("failed to read the sphere cloud: %s", filename);
+        return false;
+    }
+    uint64_t size = ftell(fp) - start;
+    fseek(fp, start, SEEK_SET);
+    if (size / (4 * sizeof(float)) < count)
+    {
+        warnx("truncated sphere cloud: %s", filename);
+        return false;
+    }
+    sphere_cloud_reserve(cloud, count);
+
+    float chunk[XYZR_CHUNK_SIZE][4];
+    for (uint64_t read = 0; read < count;)
+    {
+        size_t size = count - read < XYZR_CHUNK_SIZE ? count - read
+                                                     : XYZR_CHUNK_SIZE;
+        if (fread(chunk, sizeof(*chunk), size, fp) != size)
+        {
+            warnx("truncated sphere cloud: %s", filename);
+            return false;
+        }
+
+        for (size_t i = 0; i < size; i++)
+        {
+            if (!xyzr_valid_sphere(chunk[i]))
+            {
+                warnx("%s: sphere %" PRIu64 " has an invalid center or "
+                      "radius", filename, read + i);
+                return false;
+            }
+            sphere_cloud_push(cloud, chunk[i][0], chunk[i][1], chunk[i][2],
+                              chunk[i][3]);
+        }
+        read += size;
+    }
+    return true;
+}
+
+static bool load_xyzr_text(struct sphere_cloud *cloud, FILE *fp,
+                           const char *filename)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t line_number = 0;
+    bool res = true;
+    while (getline(&line, &line_size, fp) != -1)
+    {
+        line_number++;
+        char *cur = line + strspn(line, " \t");
+        if (*cur == '#' || *cur == '\n' || *cur == '\r' || *cur == '\0')
+            continue;
+
+        float values[4];
+        for (size_t i = 0; i < 4 && res; i++)
+        {
+            char *end;
+            values[i] = strtof(cur, &end);
+            res = end != cur;
+            cur = end;
+        }
+
+        // extra columns, such as colors, would be silently ignored
+        cur += strspn(cur, " \t");
+        if (*cur != '#' && *cur != '\n' && *cur != '\r' && *cur != '\0')
+            res = false;
+
+        if (!res || !xyzr_valid_sphere(values))
+        {
+            warnx("%s:%zu: expected a center and a radius", filename,
+                  line_number);
+            res = false;
+            break;
+        }
+
+        sphere_cloud_push(cloud, values[0], values[1], values[2], values[3]);
+    }
+    free(line);
+    return res;
+}
+
+struct sphere_cloud *load_xyzr(const char *filename,
+                               const struct bvh_build_options *options)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        warn("failed to open the sphere cloud: %s", filename);
+        return NULL;
+    }
+
+    struct phong_material *material = zalloc(sizeof(*material));
+    phong_material_init(material);
+    material->surface_color = light_from_rgb_color(200, 200, 200);
+    material->diffuse_Kn = 0.2;
+    material->spec_n = 10;
+    material->spec_Ks = 0.2;
+    material->ambient_intensity = 0.01;
+    struct sphere_cloud *cloud = sphere_cloud_create(&material->base);
+    material_put(&material->base);
+
+    // binary files are told apart from text ones by their header
+    char magic[sizeof(XYZR_BINARY_MAGIC) - 1];
+    bool binary = fread(magic, sizeof(magic), 1, fp) == 1
+                  && memcmp(magic, XYZR_BINARY_MAGIC, sizeof(magic)) == 0;
+    bool loaded;
+    if (!binary && has_suffix(filename, ".xyzrb"))
+    {
+        warnx("missing the binary sphere cloud header: %s", filename);
+        loaded = false;
+    }
+    else if (binary)
+        loaded = load_xyzr_binary(cloud, fp, filename);
+    else
+    {
+        rewind(fp);
+        loaded = load_xyzr_text(cloud, fp, filename);
+    }
+    fclose(fp);
+
+    if (!loaded)
+    {
+        sphere_cloud_free(&cloud->base);
+        return NULL;
+    }
+
+    sphere_cloud_build(cloud, options);
+    return cloud;
+}